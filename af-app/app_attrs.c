@@ -0,0 +1,86 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Role binding for the handlers in my_app.c. See app_attrs.h.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "af_log.h"
+#include "device-description.h"
+#include "app_attrs.h"
+
+//
+// What each role expects to find in the profile. The type has to match exactly since
+// the handlers cast the value to it, and the size can't exceed what device-description.h
+// said when the app was built, because that's how big the buffers are.
+//
+typedef struct {
+    app_attr_t  role;
+    const char *name;      // Semantic type in the profile.
+    uint8_t     type;      // ATTRIBUTE_TYPE_*
+    uint16_t    capacity;  // Largest value the handler can hold.
+} app_attr_binding_t;
+
+#define BIND(role, name, af)  { role, name, af##_TYPE, af##_SZ }
+
+static const app_attr_binding_t sBindings[] = {
+    BIND(APP_ATTR_GETDOUBLED,       "GetDoubled",       AF_GETDOUBLED),
+    BIND(APP_ATTR_DOUBLED,          "Doubled",          AF_DOUBLED),
+    BIND(APP_ATTR_GETROTATED,       "GetRotated",       AF_GETROTATED),
+    BIND(APP_ATTR_ROTATE,           "Rotate",           AF_ROTATE),
+    BIND(APP_ATTR_TOGGLELED,        "ToggleLED",        AF_TOGGLELED),
+    BIND(APP_ATTR_GETADDED,         "GetAdded",         AF_GETADDED),
+    BIND(APP_ATTR_CURRENTSUM,       "CurrentSum",       AF_CURRENTSUM),
+    BIND(APP_ATTR_READVARLOG,       "ReadVarLog",       AF_READVARLOG),
+    BIND(APP_ATTR_LASTLINEOFVARLOG, "LastLineOfVarLog", AF_LASTLINEOFVARLOG),
+    BIND(APP_ATTR_GETREVERSED,      "GetReversed",      AF_GETREVERSED),
+    BIND(APP_ATTR_REVERSED,         "Reversed",         AF_REVERSED),
+    BIND(APP_ATTR_COUNTBITSOFTHIS,  "CountBitsOfThis",  AF_COUNTBITSOFTHIS),
+    BIND(APP_ATTR_NUMBEROFBITS,     "NumberOfBits",     AF_NUMBEROFBITS),
+    BIND(APP_ATTR_ROTATEDR,         "RotatedR",         AF_ROTATEDR),
+    BIND(APP_ATTR_ROTATEL,          "RotateL",          AF_ROTATEL),
+};
+
+#undef BIND
+
+int app_attrs_bind(app_attrs_t *attrs, const profile_t *profile)
+{
+    const app_attr_binding_t *b;
+    const profile_attr_t *a;
+    size_t i;
+    int bound = 0;
+
+    memset(attrs, 0, sizeof(*attrs));
+    attrs->profile = profile;
+    attrs->roleBySlot = calloc(profile->hdr->slotCount, sizeof(uint8_t));
+    if (attrs->roleBySlot == NULL) {
+        AFLOG_ERR("my-app: attrs: out of memory binding the profile");
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(sBindings) / sizeof(sBindings[0]); i++) {
+        b = &sBindings[i];
+        a = profile_find_by_name(profile, b->name);
+        if (a == NULL) {
+            AFLOG_WARNING("my-app: attrs: profile has no %s, handler disabled", b->name);
+            continue;
+        }
+        if (a->type != b->type || a->size > b->capacity) {
+            AFLOG_ERR("my-app: attrs: %s (id %d) is type %d size %d, expected type %d size <= %d; handler disabled",
+                      b->name, a->id, a->type, a->size, b->type, b->capacity);
+            continue;
+        }
+        attrs->id[b->role] = a->id;
+        attrs->roleBySlot[profile_slot(profile, a->id)] = (uint8_t)b->role;
+        bound++;
+    }
+    AFLOG_INFO("my-app: attrs: bound %d of %d handler attributes", bound, APP_ATTR_COUNT - 1);
+    return bound;
+}
+
+void app_attrs_unbind(app_attrs_t *attrs)
+{
+    free(attrs->roleBySlot);
+    memset(attrs, 0, sizeof(*attrs));
+}
@@ -0,0 +1,70 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Binds the handlers in my_app.c to the attributes in the runtime profile.
+
+   Handlers don't use the attribute IDs from device-description.h directly any more.
+   Each attribute the app cares about has a role, and at startup the role is bound to
+   whatever ID the profile gives the attribute with the matching semantic type (the
+   name you typed in the Afero Profile Editor). Renumbering attributes in the editor
+   then only needs a new compiled profile, not a new build of the app.
+
+   Both directions are as cheap as the old #defines: an outbound ID is one array load
+   (APP_ATTR_ID), and mapping an inbound ID back to its role is one perfect hash probe.
+*/
+#ifndef APP_ATTRS_H
+#define APP_ATTRS_H
+
+#include <stdint.h>
+#include "profile.h"
+
+typedef enum {
+    APP_ATTR_NONE = 0,
+    APP_ATTR_GETDOUBLED,
+    APP_ATTR_DOUBLED,
+    APP_ATTR_GETROTATED,
+    APP_ATTR_ROTATE,
+    APP_ATTR_TOGGLELED,
+    APP_ATTR_GETADDED,
+    APP_ATTR_CURRENTSUM,
+    APP_ATTR_READVARLOG,
+    APP_ATTR_LASTLINEOFVARLOG,
+    APP_ATTR_GETREVERSED,
+    APP_ATTR_REVERSED,
+    APP_ATTR_COUNTBITSOFTHIS,
+    APP_ATTR_NUMBEROFBITS,
+    APP_ATTR_ROTATEDR,
+    APP_ATTR_ROTATEL,
+    APP_ATTR_COUNT
+} app_attr_t;
+
+typedef struct {
+    const profile_t *profile;
+    uint16_t         id[APP_ATTR_COUNT];  // Bound attribute ID for each role, 0 if unbound.
+    uint8_t         *roleBySlot;          // Role for each perfect hash slot in the profile.
+} app_attrs_t;
+
+//
+// Outbound: the attribute ID bound to a role.
+//
+#define APP_ATTR_ID(attrs, role)   ((attrs)->id[(role)])
+
+//
+// Bind every role against the profile. Roles whose attribute is missing, or whose type
+// or size doesn't fit the handler's buffers, are left unbound and logged. Returns the
+// number of roles bound, or -1 if memory ran out.
+//
+int app_attrs_bind(app_attrs_t *attrs, const profile_t *profile);
+
+void app_attrs_unbind(app_attrs_t *attrs);
+
+//
+// Inbound: the role bound to an attribute ID, or APP_ATTR_NONE.
+//
+static inline app_attr_t app_attrs_role(const app_attrs_t *attrs, uint16_t id)
+{
+    uint8_t role = attrs->roleBySlot[profile_slot(attrs->profile, id)];
+
+    return (role != APP_ATTR_NONE && attrs->id[role] == id) ? (app_attr_t)role : APP_ATTR_NONE;
+}
+
+#endif // APP_ATTRS_H
@@ -0,0 +1,53 @@
+/**
+   Copyright 2019 Afero, Inc.
+   The af_lib side of asr_link_t. See asr_link.h.
+*/
+#include <stdint.h>
+#include <string.h>
+
+#include "aflib.h"
+#include "asr_link.h"
+
+static af_lib_error_t aflib_set(asr_link_t *link, uint16_t attrId, set_kind_t kind,
+                                const void *value, uint16_t len)
+{
+    af_lib_t *afLib = ((asr_link_aflib_t *)link)->afLib;
+    int32_t v32 = 0;
+    int16_t v16 = 0;
+    int8_t  v8  = 0;
+
+    switch (kind) {
+        case SET_KIND_8:
+            memcpy(&v8, value, sizeof(v8));
+            return af_lib_set_attribute_8(afLib, attrId, v8, AF_LIB_SET_REASON_LOCAL_CHANGE);
+        case SET_KIND_16:
+            memcpy(&v16, value, sizeof(v16));
+            return af_lib_set_attribute_16(afLib, attrId, v16, AF_LIB_SET_REASON_LOCAL_CHANGE);
+        case SET_KIND_32:
+            memcpy(&v32, value, sizeof(v32));
+            return af_lib_set_attribute_32(afLib, attrId, v32, AF_LIB_SET_REASON_LOCAL_CHANGE);
+        case SET_KIND_STR:
+            return af_lib_set_attribute_str(afLib, attrId, len, (const char *)value,
+                                            AF_LIB_SET_REASON_LOCAL_CHANGE);
+        default:
+            return af_lib_set_attribute_bytes(afLib, attrId, len, (const uint8_t *)value,
+                                              AF_LIB_SET_REASON_LOCAL_CHANGE);
+    }
+}
+
+static void aflib_set_response(asr_link_t *link, uint16_t attrId, bool succeeded,
+                               uint16_t len, const uint8_t *value)
+{
+    af_lib_send_set_response(((asr_link_aflib_t *)link)->afLib, attrId, succeeded, len, value);
+}
+
+static const asr_link_ops_t sAflibOps = {
+    .set          = aflib_set,
+    .set_response = aflib_set_response,
+};
+
+void asr_link_aflib_init(asr_link_aflib_t *l, af_lib_t *afLib)
+{
+    l->link.ops = &sAflibOps;
+    l->afLib    = afLib;
+}
@@ -0,0 +1,73 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Where an app instance's sets and set responses go.
+
+   For the one real device on the board that's af_lib, and through it the ASR. A
+   virtual device in gateway mode (see fake_asr.h) has a simulated ASR instead. The set
+   tracker and the handlers only ever talk to an asr_link_t, so they can't tell the
+   difference.
+
+   Inbound events don't go through the link; each side hands them to its instance's
+   event queue itself.
+*/
+#ifndef ASR_LINK_H
+#define ASR_LINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "aflib.h"
+
+//
+// Which af_lib_set_attribute_* call to use.
+//
+typedef enum {
+    SET_KIND_8,
+    SET_KIND_16,
+    SET_KIND_32,
+    SET_KIND_STR,
+    SET_KIND_BYTES,
+} set_kind_t;
+
+typedef struct asr_link asr_link_t;
+
+typedef struct {
+    //
+    // Send a value to the Cloud. The ASR_SET_RESPONSE comes back later as an event.
+    //
+    af_lib_error_t (*set)(asr_link_t *link, uint16_t attrId, set_kind_t kind,
+                          const void *value, uint16_t len);
+    //
+    // Answer an MCU_SET_REQUEST.
+    //
+    void (*set_response)(asr_link_t *link, uint16_t attrId, bool succeeded,
+                         uint16_t len, const uint8_t *value);
+} asr_link_ops_t;
+
+struct asr_link {
+    const asr_link_ops_t *ops;
+};
+
+//
+// The real thing. afLib may be filled in after asr_link_aflib_init(), once
+// af_lib_create_with_unified_callback() has returned, as long as it's before the first set.
+//
+typedef struct {
+    asr_link_t  link;
+    af_lib_t   *afLib;
+} asr_link_aflib_t;
+
+void asr_link_aflib_init(asr_link_aflib_t *l, af_lib_t *afLib);
+
+static inline af_lib_error_t asr_link_set(asr_link_t *link, uint16_t attrId, set_kind_t kind,
+                                          const void *value, uint16_t len)
+{
+    return link->ops->set(link, attrId, kind, value, len);
+}
+
+static inline void asr_link_set_response(asr_link_t *link, uint16_t attrId, bool succeeded,
+                                         uint16_t len, const uint8_t *value)
+{
+    link->ops->set_response(link, attrId, succeeded, len, value);
+}
+
+#endif // ASR_LINK_H
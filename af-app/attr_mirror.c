@@ -0,0 +1,318 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Shared-memory mirror of the MCU attributes. See attr_mirror.h.
+*/
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "af_log.h"
+#include "attr_mirror.h"
+
+static uint64_t attr_mirror_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint32_t attr_mirror_align8(uint32_t n)
+{
+    return (n + 7) & ~7u;
+}
+
+static uint32_t attr_mirror_entry_size(uint16_t size)
+{
+    return attr_mirror_align8(sizeof(attr_mirror_entry_t) + size);
+}
+
+static attr_mirror_entry_t *attr_mirror_entry(const attr_mirror_header_t *hdr, uint16_t id)
+{
+    const uint32_t *slots = (const uint32_t *)((const uint8_t *)hdr + hdr->slotsOffset);
+    uint32_t off = slots[((uint32_t)id * hdr->hashMult) >> hdr->hashShift];
+    attr_mirror_entry_t *e;
+
+    if (off == 0) {
+        return NULL;
+    }
+    e = (attr_mirror_entry_t *)((uint8_t *)hdr + off);
+    return e->id == id ? e : NULL;
+}
+
+int attr_mirror_create(attr_mirror_t *m, const profile_t *p)
+{
+    attr_mirror_header_t *hdr;
+    uint32_t *slots;
+    uint32_t total;
+    uint32_t off;
+    uint32_t i;
+    uint16_t count = 0;
+    int fd;
+
+    memset(m, 0, sizeof(*m));
+
+    total = attr_mirror_align8(sizeof(*hdr)) + p->hdr->slotCount * sizeof(uint32_t);
+    total = attr_mirror_align8(total);
+    for (i = 0; i < p->hdr->attrCount; i++) {
+        if (p->attrs[i].id <= ATTR_MIRROR_MAX_ID) {
+            total += attr_mirror_entry_size(p->attrs[i].size);
+        }
+    }
+
+    //
+    // Start from scratch every time; a mirror left over from an earlier run may have a
+    // different layout, and whoever still has it mapped sees alive == 0.
+    //
+    shm_unlink(ATTR_MIRROR_NAME);
+    fd = shm_open(ATTR_MIRROR_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        AFLOG_ERR("my-app: mirror: can't create %s: %m", ATTR_MIRROR_NAME);
+        return -1;
+    }
+    if (ftruncate(fd, total) != 0) {
+        AFLOG_ERR("my-app: mirror: can't size %s: %m", ATTR_MIRROR_NAME);
+        close(fd);
+        shm_unlink(ATTR_MIRROR_NAME);
+        return -1;
+    }
+    hdr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        AFLOG_ERR("my-app: mirror: can't map %s: %m", ATTR_MIRROR_NAME);
+        shm_unlink(ATTR_MIRROR_NAME);
+        return -1;
+    }
+
+    hdr->version     = ATTR_MIRROR_VERSION;
+    hdr->headerSize  = sizeof(*hdr);
+    hdr->totalSize   = total;
+    hdr->hashMult    = p->hashMult;
+    hdr->hashShift   = p->hashShift;
+    hdr->slotCount   = p->hdr->slotCount;
+    hdr->slotsOffset = attr_mirror_align8(sizeof(*hdr));
+    hdr->writerPid   = (uint32_t)getpid();
+    hdr->alive       = 1;
+
+    //
+    // Lay the entries out in slot order so each one is found through the profile's hash.
+    //
+    slots = (uint32_t *)((uint8_t *)hdr + hdr->slotsOffset);
+    off = attr_mirror_align8(hdr->slotsOffset + hdr->slotCount * sizeof(uint32_t));
+    for (i = 0; i < p->hdr->slotCount; i++) {
+        const profile_attr_t *a;
+        attr_mirror_entry_t *e;
+
+        if (p->slots[i] == 0 || p->attrs[p->slots[i] - 1].id > ATTR_MIRROR_MAX_ID) {
+            continue;
+        }
+        a = &p->attrs[p->slots[i] - 1];
+        e = (attr_mirror_entry_t *)((uint8_t *)hdr + off);
+        e->id   = a->id;
+        e->size = a->size;
+        e->type = a->type;
+        slots[i] = off;
+        off += attr_mirror_entry_size(a->size);
+        count++;
+    }
+    hdr->attrCount = count;
+
+    //
+    // The magic goes in last, so a reader never sees a half-built mirror as valid.
+    //
+    __atomic_store_n(&hdr->magic, ATTR_MIRROR_MAGIC, __ATOMIC_RELEASE);
+
+    m->hdr    = hdr;
+    m->len    = total;
+    m->writer = 1;
+    AFLOG_INFO("my-app: mirror: %s has %d attributes in %u bytes", ATTR_MIRROR_NAME, count, total);
+    return 0;
+}
+
+void attr_mirror_write(attr_mirror_t *m, uint16_t id, const void *value, uint16_t len)
+{
+    attr_mirror_entry_t *e;
+    struct timespec ts;
+    uint32_t seq;
+
+    if (m->hdr == NULL || id > ATTR_MIRROR_MAX_ID || (e = attr_mirror_entry(m->hdr, id)) == NULL) {
+        return;
+    }
+    if (len > e->size) {
+        len = e->size;
+        m->truncated++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    //
+    // Odd while writing. The fence keeps the value stores from getting ahead of it.
+    //
+    seq = e->seq;
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(e->data, value, len);
+    e->len       = len;
+    e->updatedMs = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+    e->writes++;
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+    m->writes++;
+}
+
+int attr_mirror_open(attr_mirror_t *m)
+{
+    const attr_mirror_header_t *hdr;
+    const uint32_t *slots;
+    struct stat st;
+    uint32_t i;
+    int fd;
+
+    memset(m, 0, sizeof(*m));
+    fd = shm_open(ATTR_MIRROR_NAME, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return -1;
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        return -1;
+    }
+
+    //
+    // Don't trust the layout any further than the mapping goes.
+    //
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != ATTR_MIRROR_MAGIC ||
+        hdr->version != ATTR_MIRROR_VERSION || hdr->totalSize != (uint32_t)st.st_size ||
+        hdr->hashShift == 0 || hdr->slotCount != (1u << (32 - hdr->hashShift)) ||
+        hdr->slotsOffset < sizeof(*hdr) ||
+        hdr->slotsOffset + (uint64_t)hdr->slotCount * sizeof(uint32_t) > hdr->totalSize) {
+        munmap((void *)hdr, st.st_size);
+        return -1;
+    }
+    slots = (const uint32_t *)((const uint8_t *)hdr + hdr->slotsOffset);
+    for (i = 0; i < hdr->slotCount; i++) {
+        const attr_mirror_entry_t *e;
+
+        if (slots[i] == 0) {
+            continue;
+        }
+        if ((slots[i] & 7) || (uint64_t)slots[i] + sizeof(*e) > hdr->totalSize) {
+            munmap((void *)hdr, st.st_size);
+            return -1;
+        }
+        e = (const attr_mirror_entry_t *)((const uint8_t *)hdr + slots[i]);
+        if ((uint64_t)slots[i] + attr_mirror_entry_size(e->size) > hdr->totalSize) {
+            munmap((void *)hdr, st.st_size);
+            return -1;
+        }
+    }
+
+    m->hdr = (attr_mirror_header_t *)hdr;
+    m->len = st.st_size;
+    return 0;
+}
+
+//
+// Is the app that wrote the mirror still behind it? alive goes when it shuts down, but
+// not if it crashed, so every ATTR_MIRROR_PID_CHECK_MS (or when forced) make sure the
+// process is still there.
+//
+static int attr_mirror_alive(attr_mirror_t *m, int force)
+{
+    uint64_t now;
+
+    if (!__atomic_load_n(&m->hdr->alive, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    if (m->writer) {
+        return 1;
+    }
+    now = attr_mirror_now_ms();
+    if (force || now >= m->checkedMs + ATTR_MIRROR_PID_CHECK_MS) {
+        if (kill((pid_t)m->hdr->writerPid, 0) != 0 && errno == ESRCH) {
+            return 0;
+        }
+        m->checkedMs = now;
+    }
+    return 1;
+}
+
+int attr_mirror_read(attr_mirror_t *m, uint16_t id, void *buf, uint16_t bufLen,
+                     uint16_t *len, uint64_t *updatedMs)
+{
+    const attr_mirror_entry_t *e;
+    uint32_t seq;
+    uint16_t l;
+    uint64_t t;
+    unsigned tries;
+
+    if (m->hdr == NULL || !attr_mirror_alive(m, 0)) {
+        errno = ESTALE;
+        return -1;
+    }
+    if ((e = attr_mirror_entry(m->hdr, id)) == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    for (tries = 0; ; tries++) {
+        if (tries == ATTR_MIRROR_READ_TRIES) {
+            //
+            // A writer that died halfway through leaves the value odd for good.
+            //
+            errno = attr_mirror_alive(m, 1) ? EAGAIN : ESTALE;
+            return -1;
+        }
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            //
+            // The app is writing it right now. On a single core it can't finish until
+            // we get out of its way.
+            //
+            sched_yield();
+            continue;
+        }
+        l = e->len;
+        if (l > e->size) {
+            l = e->size;
+        }
+        memcpy(buf, e->data, l < bufLen ? l : bufLen);
+        t = e->updatedMs;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+    *len = l;
+    if (updatedMs) {
+        *updatedMs = t;
+    }
+    return 0;
+}
+
+void attr_mirror_close(attr_mirror_t *m)
+{
+    if (m->hdr == NULL) {
+        return;
+    }
+    if (m->writer) {
+        __atomic_store_n(&m->hdr->alive, 0, __ATOMIC_RELEASE);
+        shm_unlink(ATTR_MIRROR_NAME);
+    }
+    munmap(m->hdr, m->len);
+    m->hdr = NULL;
+}
+
+void attr_mirror_log_stats(const attr_mirror_t *m)
+{
+    AFLOG_INFO("my-app: mirror: writes=%u truncated=%u", m->writes, m->truncated);
+}
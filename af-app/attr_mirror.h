@@ -0,0 +1,131 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Shared-memory mirror of the MCU attributes.
+
+   Other processes on the gateway (a local UI, a logger) often just want the current
+   value of one of our attributes, say AF_CURRENTSUM or AF_REVERSED. Rather than have
+   them ask attrd for it over IPC on every read, the app keeps a copy of every MCU
+   attribute (IDs 1 to 1023) in a POSIX shared-memory object, ATTR_MIRROR_NAME, that
+   anyone can map read-only. Reading a value is then a hash, a copy and two compares;
+   no syscalls and no locks.
+
+   The app is the only writer. Each value has its own seqlock: the sequence number is
+   odd while the app is writing the value and goes up by two for every write, so a
+   reader that saw the same even number before and after copying the value knows the
+   copy is consistent. The writer never waits for readers, and a reader only tries again
+   if it overlapped a write to that very attribute.
+
+   Layout, laid out from the profile at startup:
+
+     attr_mirror_header_t
+     uint32_t             slots[slotCount]   entry offset, or 0 for an empty slot
+     attr_mirror_entry_t  entries, each followed by room for its attribute's size
+
+   The slot table uses the profile's perfect hash, so an attribute is found the same way
+   profile_lookup() finds it. The object is recreated every time the app starts, since
+   a new profile can change the layout. attr_mirror_read() fails with ESTALE once the
+   app has shut down or gone away, and readers should close the mirror and open it
+   again then.
+
+   A reader in another process only needs this header and attr_mirror.c:
+
+     attr_mirror_t m;
+     int32_t sum;
+     uint16_t len;
+
+     if (attr_mirror_open(&m) == 0 &&
+         attr_mirror_read(&m, AF_CURRENTSUM, &sum, sizeof(sum), &len, NULL) == 0) {
+         ...
+     }
+*/
+#ifndef ATTR_MIRROR_H
+#define ATTR_MIRROR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "profile.h"
+
+#define ATTR_MIRROR_NAME     "/af-app-attrs"
+#define ATTR_MIRROR_MAGIC    0x4d464641   // "AFFM" in memory.
+#define ATTR_MIRROR_VERSION  1
+#define ATTR_MIRROR_MAX_ID   1023         // The MCU's own attributes.
+#define ATTR_MIRROR_READ_TRIES    1000    // Copies a read makes before it gives up with EAGAIN.
+#define ATTR_MIRROR_PID_CHECK_MS  1000    // How often a reader makes sure the app is still there.
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t totalSize;
+    uint32_t hashMult;     // Same hash as the profile: slot = (uint32_t)(id * hashMult) >> hashShift
+    uint8_t  hashShift;
+    uint8_t  reserved[3];
+    uint32_t slotCount;
+    uint32_t slotsOffset;
+    uint16_t attrCount;
+    uint16_t reserved2;
+    uint32_t writerPid;
+    uint32_t alive;        // Cleared when the app shuts down.
+} attr_mirror_header_t;
+
+typedef struct {
+    uint32_t seq;          // Odd while the value is being written.
+    uint16_t id;
+    uint16_t size;         // Room for the value, the attribute's maximum length.
+    uint16_t len;          // Length of the current value, 0 until it is first written.
+    uint8_t  type;         // ATTRIBUTE_TYPE_* from device-description.h.
+    uint8_t  reserved;
+    uint32_t writes;       // How many times the value was written.
+    uint64_t updatedMs;    // CLOCK_MONOTONIC of the last write.
+    uint8_t  data[];
+} attr_mirror_entry_t;
+
+typedef struct {
+    attr_mirror_header_t *hdr;   // NULL when there is no mirror.
+    size_t                len;
+    int                   writer;
+    uint64_t              checkedMs;  // Reader: when the app was last seen running.
+    //
+    // Writer statistics.
+    //
+    uint32_t              writes;
+    uint32_t              truncated;  // Values longer than their attribute's size.
+} attr_mirror_t;
+
+//
+// Writer side, for the app. Creates the shared-memory object laid out from the profile's
+// MCU attributes. Returns 0 on success, -1 with the reason logged; the app can carry on
+// without a mirror, and attr_mirror_write() then does nothing.
+//
+int attr_mirror_create(attr_mirror_t *m, const profile_t *p);
+
+//
+// Copy a new value into the mirror. Attributes that aren't mirrored are ignored.
+//
+void attr_mirror_write(attr_mirror_t *m, uint16_t id, const void *value, uint16_t len);
+
+//
+// Reader side, for other processes. Maps the mirror read-only.
+//
+int attr_mirror_open(attr_mirror_t *m);
+
+//
+// Consistent copy of an attribute's current value, up to bufLen bytes. *len gets the
+// full length of the value and *updatedMs, if not NULL, when it was written. Returns 0,
+// or -1 with errno set:
+//
+//   ENOENT   the attribute isn't mirrored
+//   EAGAIN   it was being written every time we looked; try again later
+//   ESTALE   the app shut down or died; close the mirror and open it again
+//
+int attr_mirror_read(attr_mirror_t *m, uint16_t id, void *buf, uint16_t bufLen,
+                     uint16_t *len, uint64_t *updatedMs);
+
+//
+// Unmap. The writer also marks the mirror dead and removes the name.
+//
+void attr_mirror_close(attr_mirror_t *m);
+
+void attr_mirror_log_stats(const attr_mirror_t *m);
+
+#endif // ATTR_MIRROR_H
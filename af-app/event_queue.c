@@ -0,0 +1,384 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Priority queue for the events af_lib hands us. See event_queue.h.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+
+#include "af_log.h"
+#include "device-description.h"
+#include "event_queue.h"
+#include "trace.h"
+
+#define EVQ_NO_COLLAPSE  0x80   // In classBySlot: every value counts, never collapse.
+#define EVQ_CLASS_MASK   0x7f
+
+//
+// How long an event may wait before it jumps the queue.
+//
+static const uint32_t sAgeMs[EVQ_CLASS_COUNT] = { 0, 50, 100, 250 };
+
+static const char *sClassNames[EVQ_CLASS_COUNT] = { "control", "system", "normal", "bulk" };
+
+static uint64_t evq_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+//
+// Profile slot of an attribute, or -1 if the profile doesn't have it.
+//
+static int evq_slot(const event_queue_t *q, uint16_t attrId)
+{
+    uint32_t slot = profile_slot(q->profile, attrId);
+    uint16_t idx = q->profile->slots[slot];
+
+    if (idx == 0 || q->profile->attrs[idx - 1].id != attrId) {
+        return -1;
+    }
+    return (int)slot;
+}
+
+//
+// Make room for a value of len bytes, keeping the current one.
+//
+static int evq_reserve(evq_entry_t *e, uint16_t len)
+{
+    uint8_t *buf;
+
+    if (len <= e->cap) {
+        return 0;
+    }
+    if (e->value == e->inl) {
+        buf = malloc(len);
+        if (buf != NULL) {
+            memcpy(buf, e->inl, e->len);
+        }
+    }
+    else {
+        buf = realloc(e->value, len);
+    }
+    if (buf == NULL) {
+        return -1;
+    }
+    e->value = buf;
+    e->cap   = len;
+    return 0;
+}
+
+static void evq_set_value(evq_entry_t *e, uint16_t len, const uint8_t *value)
+{
+    if (len > 0 && value != NULL) {
+        memcpy(e->value, value, len);
+    }
+    e->len = len;
+}
+
+//
+// Next event to handle: the oldest one that has waited past its class's ageMs, if any,
+// otherwise the head of the most urgent class.
+//
+static evq_entry_t *evq_pop(event_queue_t *q, uint64_t now)
+{
+    evq_class_state_t *pick = NULL;
+    evq_class_state_t *c;
+    evq_entry_t *e;
+    int i;
+
+    for (i = 0; i < EVQ_CLASS_COUNT; i++) {
+        c = &q->cls[i];
+        if (c->head == NULL) {
+            continue;
+        }
+        if (pick == NULL) {
+            pick = c;
+        }
+        else if (now - c->head->enqueuedUs >= (uint64_t)c->ageMs * 1000 &&
+                 c->head->enqueuedUs < pick->head->enqueuedUs) {
+            pick = c;
+        }
+    }
+    if (pick == NULL) {
+        return NULL;
+    }
+    if (pick != &q->cls[0]) {
+        for (c = q->cls; c < pick; c++) {
+            if (c->head != NULL) {
+                pick->aged++;
+                break;
+            }
+        }
+    }
+
+    e = pick->head;
+    pick->head = e->next;
+    if (pick->head == NULL) {
+        pick->tail = NULL;
+    }
+    pick->depth--;
+    return e;
+}
+
+static void evq_note_wait(evq_class_state_t *c, uint64_t waitUs)
+{
+    int bucket = 0;
+
+    while (bucket < EVQ_HIST_BUCKETS - 1 && (waitUs >> bucket) > 1) {
+        bucket++;
+    }
+    c->waitHist[bucket]++;
+    c->waitTotalUs += waitUs;
+    if (waitUs > c->waitMaxUs) {
+        c->waitMaxUs = waitUs;
+    }
+    c->handled++;
+}
+
+static void evq_handle(event_queue_t *q, evq_entry_t *e, uint64_t now)
+{
+    int slot;
+
+    if (e->eventType == AF_LIB_EVENT_MCU_SET_REQUEST && (slot = evq_slot(q, e->attrId)) >= 0 &&
+        q->pendingBySlot[slot] == e) {
+        q->pendingBySlot[slot] = NULL;
+    }
+    evq_note_wait(&q->cls[e->cls], now - e->enqueuedUs);
+    TRACE_PROBE(queue__wait, e->attrId, now - e->enqueuedUs);
+    trace_span_at(TRACE_QUEUED, e->enqueuedUs * 1000, now * 1000, e->attrId, e->eventType, e->cls);
+    q->handler(q->ctx, e->eventType, e->error, e->attrId, e->len, e->value);
+
+    e->next = q->free;
+    q->free = e;
+    q->handled++;
+}
+
+static void evq_drain_cb(evutil_socket_t fd, short what, void *arg)
+{
+    event_queue_t *q = (event_queue_t *)arg;
+    struct timeval now = { 0, 0 };
+    evq_entry_t *e;
+    int n;
+
+    for (n = 0; n < EVQ_DRAIN_BATCH && (e = evq_pop(q, evq_now_us())) != NULL; n++) {
+        evq_handle(q, e, evq_now_us());
+    }
+    //
+    // More to do, but let the loop pick up new events first; they may be more urgent.
+    //
+    for (n = 0; n < EVQ_CLASS_COUNT; n++) {
+        if (q->cls[n].head != NULL) {
+            evtimer_add(q->drainEv, &now);
+            break;
+        }
+    }
+}
+
+int event_queue_init(event_queue_t *q, struct event_base *base, const profile_t *p,
+                     evq_handler_t handler, evq_collapsed_t collapsed, void *ctx)
+{
+    uint32_t i;
+
+    memset(q, 0, sizeof(*q));
+    q->profile   = p;
+    q->handler   = handler;
+    q->collapsed = collapsed;
+    q->ctx       = ctx;
+    for (i = 0; i < EVQ_CLASS_COUNT; i++) {
+        q->cls[i].ageMs = sAgeMs[i];
+    }
+    for (i = 0; i < EVQ_CAPACITY; i++) {
+        q->pool[i].value = q->pool[i].inl;
+        q->pool[i].cap   = EVQ_INLINE_MAX;
+        q->pool[i].next  = q->free;
+        q->free = &q->pool[i];
+    }
+
+    q->pendingBySlot = calloc(p->hdr->slotCount, sizeof(*q->pendingBySlot));
+    q->classBySlot   = calloc(p->hdr->slotCount, sizeof(*q->classBySlot));
+    q->drainEv       = evtimer_new(base, evq_drain_cb, q);
+    if (q->pendingBySlot == NULL || q->classBySlot == NULL || q->drainEv == NULL) {
+        AFLOG_ERR("my-app: evq: out of memory");
+        event_queue_free(q);
+        return -1;
+    }
+
+    for (i = 0; i < p->hdr->slotCount; i++) {
+        if (p->slots[i] != 0) {
+            uint8_t type = p->attrs[p->slots[i] - 1].type;
+
+            q->classBySlot[i] = (type == ATTRIBUTE_TYPE_UTF8S || type == ATTRIBUTE_TYPE_BYTES) ?
+                                EVQ_CLASS_BULK : EVQ_CLASS_NORMAL;
+        }
+    }
+    //
+    // Collapsing two values sent to an aggregate source would lose one of them.
+    //
+    for (i = 0; i < p->aggCount; i++) {
+        int slot = evq_slot(q, p->aggs[i].srcId);
+
+        if (slot >= 0) {
+            q->classBySlot[slot] |= EVQ_NO_COLLAPSE;
+        }
+    }
+    return 0;
+}
+
+void event_queue_free(event_queue_t *q)
+{
+    evq_entry_t *e;
+    uint32_t i;
+
+    if (q->drainEv) {
+        while ((e = evq_pop(q, evq_now_us())) != NULL) {
+            evq_handle(q, e, evq_now_us());
+        }
+        event_free(q->drainEv);
+        q->drainEv = NULL;
+    }
+    for (i = 0; i < EVQ_CAPACITY; i++) {
+        if (q->pool[i].value != q->pool[i].inl) {
+            free(q->pool[i].value);
+            q->pool[i].value = q->pool[i].inl;
+        }
+    }
+    free(q->pendingBySlot);
+    free(q->classBySlot);
+    q->pendingBySlot = NULL;
+    q->classBySlot   = NULL;
+}
+
+void event_queue_set_class(event_queue_t *q, uint16_t attrId, evq_class_t cls)
+{
+    int slot = evq_slot(q, attrId);
+
+    if (slot >= 0) {
+        q->classBySlot[slot] = (q->classBySlot[slot] & EVQ_NO_COLLAPSE) | cls;
+    }
+}
+
+void event_queue_push(event_queue_t *q, const af_lib_event_type_t eventType, const af_lib_error_t error,
+                      const uint16_t attributeId, const uint16_t valueLen, const uint8_t *value)
+{
+    struct timeval now = { 0, 0 };
+    evq_class_state_t *c;
+    evq_entry_t *e;
+    uint8_t cls = EVQ_CLASS_SYSTEM;
+    int slot = -1;
+
+    if (eventType == AF_LIB_EVENT_MCU_SET_REQUEST) {
+        cls = EVQ_CLASS_NORMAL;
+        slot = evq_slot(q, attributeId);
+        if (slot >= 0) {
+            cls = q->classBySlot[slot];
+        }
+    }
+
+    //
+    // Latest value wins. The request keeps its place in line and its age.
+    //
+    if (slot >= 0 && !(cls & EVQ_NO_COLLAPSE) && (e = q->pendingBySlot[slot]) != NULL &&
+        evq_reserve(e, valueLen) == 0) {
+        q->collapsed(q->ctx, e->attrId, e->len, e->value);
+        evq_set_value(e, valueLen, value);
+        q->cls[e->cls].collapsed++;
+        return;
+    }
+    cls &= EVQ_CLASS_MASK;
+
+    //
+    // Full: make room by handling the next event in line, as the drain would have. The
+    // new one still waits its turn behind everything already queued.
+    //
+    if (q->free == NULL && (e = evq_pop(q, evq_now_us())) != NULL) {
+        q->overflows++;
+        evq_handle(q, e, evq_now_us());
+    }
+    e = q->free;
+    if (e == NULL || evq_reserve(e, valueLen) != 0) {
+        //
+        // No memory for the value. Handle it on the spot, but not ahead of anything
+        // queued before it, and count it with its class like any other.
+        //
+        while ((e = evq_pop(q, evq_now_us())) != NULL) {
+            evq_handle(q, e, evq_now_us());
+        }
+        q->overflows++;
+        q->cls[cls].queued++;
+        evq_note_wait(&q->cls[cls], 0);
+        q->handler(q->ctx, eventType, error, attributeId, valueLen, value);
+        q->handled++;
+        return;
+    }
+    q->free = e->next;
+    evq_set_value(e, valueLen, value);
+    e->next       = NULL;
+    e->enqueuedUs = evq_now_us();
+    e->eventType  = eventType;
+    e->error      = error;
+    e->attrId     = attributeId;
+    e->cls        = cls;
+    if (slot >= 0) {
+        q->pendingBySlot[slot] = e;
+    }
+
+    c = &q->cls[cls];
+    if (c->tail) {
+        c->tail->next = e;
+    }
+    else {
+        c->head = e;
+    }
+    c->tail = e;
+    c->queued++;
+    if (++c->depth > c->peakDepth) {
+        c->peakDepth = c->depth;
+    }
+    evtimer_add(q->drainEv, &now);
+}
+
+//
+// Upper bound of the bucket the given fraction of waits fall in.
+//
+static uint64_t evq_percentile_us(const evq_class_state_t *c, uint32_t permille)
+{
+    uint64_t want = ((uint64_t)c->handled * permille + 999) / 1000;
+    uint64_t seen = 0;
+    int b;
+
+    for (b = 0; b < EVQ_HIST_BUCKETS; b++) {
+        seen += c->waitHist[b];
+        if (seen >= want) {
+            return (uint64_t)2 << b;
+        }
+    }
+    return c->waitMaxUs;
+}
+
+void event_queue_log_stats(const event_queue_t *q)
+{
+    int i;
+
+    for (i = 0; i < EVQ_CLASS_COUNT; i++) {
+        const evq_class_state_t *c = &q->cls[i];
+
+        if (c->queued == 0) {
+            continue;
+        }
+        AFLOG_INFO("my-app: evq: %s queued=%u collapsed=%u aged=%u depth=%u peak=%u "
+                   "wait avg=%lluus p50<%lluus p99<%lluus max=%lluus",
+                   sClassNames[i], c->queued, c->collapsed, c->aged, c->depth, c->peakDepth,
+                   (unsigned long long)(c->handled ? c->waitTotalUs / c->handled : 0),
+                   (unsigned long long)evq_percentile_us(c, 500),
+                   (unsigned long long)evq_percentile_us(c, 990),
+                   (unsigned long long)c->waitMaxUs);
+    }
+    if (q->overflows) {
+        AFLOG_INFO("my-app: evq: queue full %u times, handled the next event early", q->overflows);
+    }
+}
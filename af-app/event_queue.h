@@ -0,0 +1,131 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Priority queue for the events af_lib hands us.
+
+   af_lib calls attrEventCallback() for every event in the order they arrive, so a
+   ToggleLED from the mobile app or a notification from the ASR used to wait behind
+   whatever string reversing and /var/log/messages reading was queued ahead of it. Now
+   the callback only copies the event into this queue, and the events are handled from
+   the event loop a few at a time, most urgent class first:
+
+     control   attributes that switch something, like AF_TOGGLELED
+     system    everything that isn't an MCU set request: ASR notifications, set responses
+     normal    numeric MCU attributes
+     bulk      string and byte attributes, and handlers that do I/O
+
+   Strict priority alone would let a steady stream of control events starve the bulk
+   ones, so events age: one that has waited longer than its class's ageMs is handled
+   next no matter what else is queued.
+
+   While a set request is still queued, a newer one for the same attribute replaces its
+   value in place (latest value wins) and the older request is acknowledged right away,
+   as if it had been handled and immediately overwritten. Aggregate sources are the
+   exception, since every value sent to them counts.
+
+   The queue is a fixed pool of EVQ_CAPACITY events. If it ever fills, the next event in
+   line is handled right away to make room, so a new event never jumps the queue.
+*/
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <stdint.h>
+#include <event2/event.h>
+#include "aflib.h"
+#include "profile.h"
+
+#define EVQ_CAPACITY         64   // Events queued at most.
+#define EVQ_DRAIN_BATCH      4    // Events handled per pass of the event loop.
+#define EVQ_INLINE_MAX       16   // Values up to this size are kept in the event itself.
+#define EVQ_HIST_BUCKETS     24   // Wait time histogram, log2 of microseconds.
+
+typedef enum {
+    EVQ_CLASS_CONTROL,
+    EVQ_CLASS_SYSTEM,
+    EVQ_CLASS_NORMAL,
+    EVQ_CLASS_BULK,
+    EVQ_CLASS_COUNT
+} evq_class_t;
+
+//
+// Handles an event once it's its turn. Same arguments as the af_lib callback, plus the
+// ctx handed to event_queue_init().
+//
+typedef void (*evq_handler_t)(void *ctx, const af_lib_event_type_t eventType, const af_lib_error_t error,
+                              const uint16_t attributeId, const uint16_t valueLen, const uint8_t *value);
+
+//
+// Acknowledges a set request whose value was replaced by a newer one before it was handled.
+//
+typedef void (*evq_collapsed_t)(void *ctx, uint16_t attributeId, uint16_t valueLen, const uint8_t *value);
+
+typedef struct evq_entry evq_entry_t;
+
+struct evq_entry {
+    evq_entry_t         *next;
+    uint64_t             enqueuedUs;
+    af_lib_event_type_t  eventType;
+    af_lib_error_t       error;
+    uint16_t             attrId;
+    uint16_t             len;
+    uint16_t             cap;      // Size of value.
+    uint8_t              cls;
+    uint8_t             *value;    // Points at inl, or at a buffer the entry keeps for reuse.
+    uint8_t              inl[EVQ_INLINE_MAX];
+};
+
+typedef struct {
+    evq_entry_t *head;
+    evq_entry_t *tail;
+    uint32_t     ageMs;        // Waited this long, an event is handled ahead of higher classes.
+    //
+    // Statistics.
+    //
+    unsigned     depth;
+    unsigned     peakDepth;
+    uint32_t     queued;
+    uint32_t     collapsed;
+    uint32_t     aged;         // Handled ahead of a higher class because it got too old.
+    uint32_t     handled;
+    uint64_t     waitTotalUs;
+    uint64_t     waitMaxUs;
+    uint32_t     waitHist[EVQ_HIST_BUCKETS];
+} evq_class_state_t;
+
+typedef struct {
+    const profile_t   *profile;
+    struct event      *drainEv;
+    evq_handler_t      handler;
+    evq_collapsed_t    collapsed;
+    void              *ctx;
+    evq_entry_t       *free;
+    evq_entry_t      **pendingBySlot;   // Queued set request per profile slot, for collapsing.
+    uint8_t           *classBySlot;     // evq_class_t per profile slot, plus a no-collapse flag.
+    evq_class_state_t  cls[EVQ_CLASS_COUNT];
+    uint32_t           overflows;       // Times the queue was full and handled one early.
+    uint32_t           handled;
+    evq_entry_t        pool[EVQ_CAPACITY];
+} event_queue_t;
+
+int event_queue_init(event_queue_t *q, struct event_base *base, const profile_t *p,
+                     evq_handler_t handler, evq_collapsed_t collapsed, void *ctx);
+
+//
+// Handle whatever is still queued, so no set request goes unanswered, and free the queue.
+//
+void event_queue_free(event_queue_t *q);
+
+//
+// Put an attribute's set requests in another class. By default string and byte
+// attributes are bulk and everything else is normal.
+//
+void event_queue_set_class(event_queue_t *q, uint16_t attrId, evq_class_t cls);
+
+//
+// Called from the af_lib callback. Copies the event; value needn't outlive the call.
+//
+void event_queue_push(event_queue_t *q, const af_lib_event_type_t eventType, const af_lib_error_t error,
+                      const uint16_t attributeId, const uint16_t valueLen, const uint8_t *value);
+
+void event_queue_log_stats(const event_queue_t *q);
+
+#endif // EVENT_QUEUE_H
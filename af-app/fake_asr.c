@@ -0,0 +1,207 @@
+/**
+   Copyright 2019 Afero, Inc.
+   A simulated ASR for virtual devices. See fake_asr.h.
+*/
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+
+#include "af_log.h"
+#include "device-description.h"
+#include "fake_asr.h"
+
+static uint64_t fake_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint32_t fake_rand(fake_asr_t *f)
+{
+    f->rng ^= f->rng << 13;
+    f->rng ^= f->rng >> 17;
+    f->rng ^= f->rng << 5;
+    return f->rng;
+}
+
+static void fake_arm(struct event *ev, uint64_t us)
+{
+    struct timeval tv;
+
+    tv.tv_sec  = us / 1000000;
+    tv.tv_usec = us % 1000000;
+    evtimer_add(ev, &tv);
+}
+
+//
+// A random value that fits the attribute. Returns its length.
+//
+static uint16_t fake_value(fake_asr_t *f, const profile_attr_t *a, uint8_t *buf)
+{
+    uint16_t len;
+    uint16_t i;
+
+    switch (a->type) {
+        case ATTRIBUTE_TYPE_BOOLEAN:
+            buf[0] = fake_rand(f) & 1;
+            return 1;
+        case ATTRIBUTE_TYPE_UTF8S:
+            len = 1 + fake_rand(f) % FAKE_ASR_STR_MAX;
+            if (len > a->size) {
+                len = a->size;
+            }
+            for (i = 0; i < len; i++) {
+                buf[i] = 'a' + fake_rand(f) % 26;
+            }
+            return len;
+        default:
+            len = a->size < FAKE_ASR_STR_MAX ? a->size : FAKE_ASR_STR_MAX;
+            for (i = 0; i < len; i++) {
+                buf[i] = (uint8_t)fake_rand(f);
+            }
+            return len;
+    }
+}
+
+static void fake_request_cb(evutil_socket_t fd, short what, void *arg)
+{
+    fake_asr_t *f = (fake_asr_t *)arg;
+    uint8_t value[FAKE_ASR_STR_MAX];
+    const profile_attr_t *a;
+    uint16_t len;
+    uint8_t i;
+
+    if (f->inputCount > 0) {
+        i = fake_rand(f) % f->inputCount;
+        a = profile_lookup(f->profile, f->inputs[i]);
+        len = fake_value(f, a, value);
+        if (f->requestedUs[i] == 0) {
+            f->requestedUs[i] = fake_now_us();  // A newer request doesn't restart the clock.
+        }
+        f->requests++;
+        f->cb(f->ctx, AF_LIB_EVENT_MCU_SET_REQUEST, AF_SUCCESS, a->id, len, value);
+    }
+    if (f->periodMs) {
+        fake_arm(f->requestTimer, (uint64_t)f->periodMs * 500 + fake_rand(f) % ((uint64_t)f->periodMs * 1000 + 1));
+    }
+}
+
+static void fake_response_cb(evutil_socket_t fd, short what, void *arg)
+{
+    fake_asr_t *f = (fake_asr_t *)arg;
+    uint64_t nowMs = fake_now_us() / 1000;
+    fake_asr_pending_t p;
+
+    while (f->pendingCount > 0 && f->pending[f->pendingHead].dueMs <= nowMs) {
+        p = f->pending[f->pendingHead];
+        f->pendingHead = (f->pendingHead + 1) % FAKE_ASR_MAX_PENDING;
+        f->pendingCount--;
+        f->cb(f->ctx, AF_LIB_EVENT_ASR_SET_RESPONSE, p.error, p.attrId, 0, NULL);
+    }
+    if (f->pendingCount > 0) {
+        fake_arm(f->responseTimer, (f->pending[f->pendingHead].dueMs - nowMs) * 1000);
+    }
+}
+
+static af_lib_error_t fake_set(asr_link_t *link, uint16_t attrId, set_kind_t kind,
+                               const void *value, uint16_t len)
+{
+    fake_asr_t *f = (fake_asr_t *)link;
+    fake_asr_pending_t *p;
+
+    f->sets++;
+    if (f->pendingCount == FAKE_ASR_MAX_PENDING) {
+        f->refused++;
+        return AF_ERROR_BUSY;
+    }
+    p = &f->pending[(f->pendingHead + f->pendingCount) % FAKE_ASR_MAX_PENDING];
+    p->attrId = attrId;
+    p->error  = AF_SUCCESS;
+    p->dueMs  = fake_now_us() / 1000 + f->latencyMs;
+    if (f->failPermille && fake_rand(f) % 1000 < f->failPermille) {
+        p->error = AF_ERROR_BUSY;
+        f->refused++;
+    }
+    if (f->pendingCount++ == 0) {
+        fake_arm(f->responseTimer, (uint64_t)f->latencyMs * 1000);
+    }
+    return AF_SUCCESS;
+}
+
+static void fake_set_response(asr_link_t *link, uint16_t attrId, bool succeeded,
+                              uint16_t len, const uint8_t *value)
+{
+    fake_asr_t *f = (fake_asr_t *)link;
+    uint64_t us;
+    uint8_t i;
+
+    f->responses++;
+    for (i = 0; i < f->inputCount; i++) {
+        if (f->inputs[i] == attrId && f->requestedUs[i] != 0) {
+            us = fake_now_us() - f->requestedUs[i];
+            f->requestedUs[i] = 0;
+            f->responseTotalUs += us;
+            if (us > f->responseMaxUs) {
+                f->responseMaxUs = us;
+            }
+            break;
+        }
+    }
+}
+
+static const asr_link_ops_t sFakeOps = {
+    .set          = fake_set,
+    .set_response = fake_set_response,
+};
+
+int fake_asr_init(fake_asr_t *f, struct event_base *base, const profile_t *p,
+                  const uint16_t *inputs, uint8_t inputCount, uint32_t seed,
+                  fake_asr_event_cb_t cb, void *ctx)
+{
+    uint8_t i;
+
+    memset(f, 0, sizeof(*f));
+    f->link.ops  = &sFakeOps;
+    f->profile   = p;
+    f->cb        = cb;
+    f->ctx       = ctx;
+    f->rng       = seed * 2654435761u | 1;
+    f->periodMs  = FAKE_ASR_PERIOD_MS;
+    f->latencyMs = FAKE_ASR_LATENCY_MS;
+    for (i = 0; i < inputCount && f->inputCount < FAKE_ASR_MAX_INPUTS; i++) {
+        if (inputs[i] != 0 && profile_lookup(p, inputs[i]) != NULL) {
+            f->inputs[f->inputCount++] = inputs[i];
+        }
+    }
+
+    f->requestTimer  = evtimer_new(base, fake_request_cb, f);
+    f->responseTimer = evtimer_new(base, fake_response_cb, f);
+    if (f->requestTimer == NULL || f->responseTimer == NULL) {
+        AFLOG_ERR("my-app: fake: can't allocate timers");
+        fake_asr_free(f);
+        return -1;
+    }
+    return 0;
+}
+
+void fake_asr_start(fake_asr_t *f)
+{
+    if (f->periodMs) {
+        fake_arm(f->requestTimer, fake_rand(f) % ((uint64_t)f->periodMs * 1000 + 1));
+    }
+}
+
+void fake_asr_free(fake_asr_t *f)
+{
+    if (f->requestTimer) {
+        event_free(f->requestTimer);
+        f->requestTimer = NULL;
+    }
+    if (f->responseTimer) {
+        event_free(f->responseTimer);
+        f->responseTimer = NULL;
+    }
+}
@@ -0,0 +1,103 @@
+/**
+   Copyright 2019 Afero, Inc.
+   A simulated ASR for virtual devices.
+
+   In gateway mode (my_app -n) the app hosts many devices at once, and af_lib only
+   connects one of them to a real ASR. Every other device gets one of these instead: a
+   stand-in for the ASR and the Cloud behind it that
+
+     - sends the device MCU_SET_REQUESTs for its input attributes, with random values of
+       the right size, on average every periodMs, like a busy mobile app would
+     - answers every set the device sends with an ASR_SET_RESPONSE latencyMs later,
+       refusing failPermille of them to exercise the set tracker's retries
+     - counts the set responses the device sends back and how long they took
+
+   so the handlers, the event queue and the set tracker do their real work with nothing
+   on the other end. Everything runs on the event base the fake ASR was created on, the
+   same one as its device.
+*/
+#ifndef FAKE_ASR_H
+#define FAKE_ASR_H
+
+#include <stdint.h>
+#include <event2/event.h>
+#include "aflib.h"
+#include "asr_link.h"
+#include "profile.h"
+
+#define FAKE_ASR_MAX_INPUTS     16
+#define FAKE_ASR_MAX_PENDING    32    // Sets waiting for their ASR_SET_RESPONSE.
+#define FAKE_ASR_STR_MAX        32    // Longest random string sent to a string attribute.
+//
+// Defaults. All of them can be changed in the fake_asr_t after fake_asr_init().
+//
+#define FAKE_ASR_PERIOD_MS      1000
+#define FAKE_ASR_LATENCY_MS     20
+
+//
+// Same arguments as the af_lib callback, plus the ctx handed to fake_asr_init().
+//
+typedef void (*fake_asr_event_cb_t)(void *ctx, const af_lib_event_type_t eventType, const af_lib_error_t error,
+                                    const uint16_t attributeId, const uint16_t valueLen, const uint8_t *value);
+
+typedef struct {
+    uint16_t attrId;
+    af_lib_error_t error;
+    uint64_t dueMs;
+} fake_asr_pending_t;
+
+typedef struct {
+    asr_link_t           link;          // Hand &fake->link to the set tracker.
+    const profile_t     *profile;
+    fake_asr_event_cb_t  cb;
+    void                *ctx;
+    struct event        *requestTimer;
+    struct event        *responseTimer;
+    uint32_t             rng;
+    //
+    // Configuration.
+    //
+    uint32_t             periodMs;      // Mean time between set requests. 0 stops them.
+    uint32_t             latencyMs;     // From a set to its ASR_SET_RESPONSE.
+    uint16_t             failPermille;  // Sets answered with AF_ERROR_BUSY.
+    //
+    // What the device gets set requests for, and when the latest one for each was sent.
+    //
+    uint16_t             inputs[FAKE_ASR_MAX_INPUTS];
+    uint64_t             requestedUs[FAKE_ASR_MAX_INPUTS];
+    uint8_t              inputCount;
+    //
+    // Sets waiting for their response, oldest first. latencyMs is the same for all of
+    // them, so they come due in order.
+    //
+    fake_asr_pending_t   pending[FAKE_ASR_MAX_PENDING];
+    uint8_t              pendingHead;
+    uint8_t              pendingCount;
+    //
+    // Statistics.
+    //
+    uint32_t             requests;      // Set requests sent to the device.
+    uint32_t             responses;     // Set responses the device sent back.
+    uint32_t             sets;          // Sets from the device.
+    uint32_t             refused;       // Sets answered with an error, or turned away because too many were pending.
+    uint64_t             responseTotalUs;
+    uint64_t             responseMaxUs;
+} fake_asr_t;
+
+//
+// inputs are the attributes to send set requests for; ones the profile doesn't have are
+// skipped. seed makes each device's values different.
+//
+int fake_asr_init(fake_asr_t *f, struct event_base *base, const profile_t *p,
+                  const uint16_t *inputs, uint8_t inputCount, uint32_t seed,
+                  fake_asr_event_cb_t cb, void *ctx);
+
+//
+// Start sending set requests. The first one goes out at a random point in the first
+// period, so devices started together don't all fire at once.
+//
+void fake_asr_start(fake_asr_t *f);
+
+void fake_asr_free(fake_asr_t *f);
+
+#endif // FAKE_ASR_H
@@ -0,0 +1,699 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Asynchronous file reads and writes for the event loop. See file_io.h.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <event2/event.h>
+
+#include "af_log.h"
+#include "file_io.h"
+
+#ifdef APP_IO_URING
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#ifndef __NR_io_uring_setup
+#undef APP_IO_URING       // Headers know io_uring, but libc doesn't know its system calls.
+#endif
+#endif
+
+static uint64_t file_io_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+//
+// Every request ends up here, on the loop, whichever backend did it.
+//
+static void file_io_complete(file_io_t *io, file_io_req_t *req, int32_t result)
+{
+    uint64_t waitNs = file_io_now_ns() - req->queuedNs;
+
+    io->inFlight--;
+    io->slots[req->slot] = NULL;
+    io->waitTotalNs += waitNs;
+    if (waitNs > io->waitMaxNs) {
+        io->waitMaxNs = waitNs;
+    }
+    if (result < 0) {
+        io->errors++;
+    }
+    else {
+        io->bytes += (uint64_t)result;
+    }
+    req->result = result;
+    req->next   = NULL;
+    req->done(req, req->ctx);
+}
+
+#ifdef APP_IO_URING
+//
+// The rings, mapped from the kernel. We own the submission tail and the completion
+// head; the kernel owns the other two.
+//
+struct file_io_uring {
+    int                   fd;
+    void                 *sqRing;
+    size_t                sqRingSize;
+    void                 *cqRing;
+    size_t                cqRingSize;
+    struct io_uring_sqe  *sqes;
+    size_t                sqesSize;
+    unsigned             *sqHead;
+    unsigned             *sqTail;
+    unsigned             *sqMask;
+    unsigned             *sqEntries;
+    unsigned             *sqArray;
+    unsigned             *cqHead;
+    unsigned             *cqTail;
+    unsigned             *cqMask;
+    struct io_uring_cqe  *cqes;
+    unsigned              unsubmitted;  // In the ring, but the kernel hasn't taken them yet.
+};
+
+static void file_io_uring_free(struct file_io_uring *u)
+{
+    if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqesSize);
+    }
+    if (u->cqRing != NULL && u->cqRing != MAP_FAILED) {
+        munmap(u->cqRing, u->cqRingSize);
+    }
+    if (u->sqRing != NULL && u->sqRing != MAP_FAILED) {
+        munmap(u->sqRing, u->sqRingSize);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    free(u);
+}
+
+static int file_io_uring_init(file_io_t *io)
+{
+    struct io_uring_params p;
+    struct file_io_uring *u = calloc(1, sizeof(*u));
+
+    if (u == NULL) {
+        return -1;
+    }
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, FILE_IO_ENTRIES, &p);
+    if (u->fd < 0) {
+        AFLOG_INFO("my-app: io: no io_uring here (%m)");
+        free(u);
+        return -1;
+    }
+
+    u->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqesSize   = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqRing = mmap(NULL, u->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    u->cqRing = mmap(NULL, u->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_CQ_RING);
+    u->sqes   = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQES);
+    if (u->sqRing == MAP_FAILED || u->cqRing == MAP_FAILED || u->sqes == MAP_FAILED) {
+        AFLOG_WARNING("my-app: io: can't map the io_uring rings (%m)");
+        file_io_uring_free(u);
+        return -1;
+    }
+    u->sqHead    = (unsigned *)((char *)u->sqRing + p.sq_off.head);
+    u->sqTail    = (unsigned *)((char *)u->sqRing + p.sq_off.tail);
+    u->sqMask    = (unsigned *)((char *)u->sqRing + p.sq_off.ring_mask);
+    u->sqEntries = (unsigned *)((char *)u->sqRing + p.sq_off.ring_entries);
+    u->sqArray   = (unsigned *)((char *)u->sqRing + p.sq_off.array);
+    u->cqHead    = (unsigned *)((char *)u->cqRing + p.cq_off.head);
+    u->cqTail    = (unsigned *)((char *)u->cqRing + p.cq_off.tail);
+    u->cqMask    = (unsigned *)((char *)u->cqRing + p.cq_off.ring_mask);
+    u->cqes      = (struct io_uring_cqe *)((char *)u->cqRing + p.cq_off.cqes);
+
+    //
+    // Completions wake the loop through our eventfd. Kernels before 5.2 can't do this.
+    //
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_EVENTFD, &io->eventFd, 1) != 0) {
+        AFLOG_INFO("my-app: io: io_uring can't signal an eventfd here (%m)");
+        file_io_uring_free(u);
+        return -1;
+    }
+    io->uring = u;
+    return 0;
+}
+
+//
+// Put the queued requests in the submission ring and send the lot with one system call.
+//
+static void file_io_uring_flush(file_io_t *io)
+{
+    struct file_io_uring *u = io->uring;
+    unsigned tail = *u->sqTail;
+    unsigned head = __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE);
+    file_io_req_t *req;
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+    int n;
+
+    while (io->queued != NULL && tail - head < *u->sqEntries) {
+        req = io->queued;
+        io->queued = req->next;
+        io->queuedCount--;
+
+        idx = tail & *u->sqMask;
+        sqe = &u->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = req->op == FILE_IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->fd        = req->fd;
+        sqe->addr      = (uint64_t)(uintptr_t)&req->iov;
+        sqe->len       = 1;
+        sqe->off       = req->offset;
+        sqe->user_data = (uint64_t)(uintptr_t)req;
+        u->sqArray[idx] = idx;
+        tail++;
+        u->unsubmitted++;
+        io->inFlight++;
+    }
+    if (io->queued == NULL) {
+        io->queuedTail = &io->queued;
+    }
+    __atomic_store_n(u->sqTail, tail, __ATOMIC_RELEASE);
+
+    if (u->unsubmitted == 0) {
+        return;
+    }
+    n = (int)syscall(__NR_io_uring_enter, u->fd, u->unsubmitted, 0, 0, NULL, 0);
+    if (n < 0) {
+        //
+        // They stay in the ring, and file_io_flush() tries again shortly.
+        //
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+            AFLOG_ERR("my-app: io: io_uring_enter failed: %m");
+        }
+        return;
+    }
+    u->unsubmitted -= (unsigned)n;
+}
+
+static void file_io_uring_reap(file_io_t *io)
+{
+    struct file_io_uring *u = io->uring;
+    unsigned head = *u->cqHead;
+    struct io_uring_cqe *cqe;
+    file_io_req_t *req;
+    int32_t res;
+
+    while (head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+        cqe = &u->cqes[head & *u->cqMask];
+        req = (file_io_req_t *)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+        head++;
+        __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+        file_io_complete(io, req, res);
+    }
+}
+#endif // APP_IO_URING
+
+//
+// The fallback: worker threads doing ordinary blocking I/O where it doesn't matter.
+//
+struct file_io_pool {
+    pthread_t        threads[FILE_IO_THREADS];
+    unsigned         threadCount;
+    pthread_mutex_t  lock;
+    pthread_cond_t   work;
+    file_io_req_t   *todo;
+    file_io_req_t  **todoTail;
+    file_io_req_t   *done;
+    file_io_req_t  **doneTail;
+    int              stopping;
+    int              abandoned;      // By file_io_free(); the last thread out frees the pool.
+    unsigned         threadsLeft;
+    int              eventFd;
+};
+
+static void file_io_pool_destroy(struct file_io_pool *pool)
+{
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static void *file_io_pool_thread(void *arg)
+{
+    struct file_io_pool *pool = (struct file_io_pool *)arg;
+    file_io_req_t *req;
+    sigset_t all;
+    uint64_t one = 1;
+    ssize_t n;
+    int32_t result;
+    int last;
+
+    //
+    // Signals are the main loop's business.
+    //
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->todo == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->todo == NULL) {
+            break;
+        }
+        req = pool->todo;
+        pool->todo = req->next;
+        if (pool->todo == NULL) {
+            pool->todoTail = &pool->todo;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        do {
+            if (req->op == FILE_IO_READ) {
+                n = pread(req->fd, req->iov.iov_base, req->iov.iov_len, (off_t)req->offset);
+            }
+            else {
+                n = pwrite(req->fd, req->iov.iov_base, req->iov.iov_len, (off_t)req->offset);
+            }
+        } while (n < 0 && errno == EINTR);
+        result = n < 0 ? -errno : (int32_t)n;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->abandoned) {
+            continue;  // The request was cancelled and is the caller's again; the eventfd may be gone too.
+        }
+        req->result = result;
+        req->next = NULL;
+        *pool->doneTail = req;
+        pool->doneTail = &req->next;
+        if (write(pool->eventFd, &one, sizeof(one)) < 0) {
+            // Only fails if the counter is about to overflow; the loop will be along.
+        }
+    }
+    last = pool->abandoned && --pool->threadsLeft == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (last) {
+        file_io_pool_destroy(pool);
+    }
+    return NULL;
+}
+
+static void file_io_pool_free(struct file_io_pool *pool)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->threadCount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    file_io_pool_destroy(pool);
+}
+
+//
+// Stop without waiting for a worker stuck in pread() or pwrite(). Nothing not yet started
+// will be, nothing finished is handed back, and the threads clean up after themselves.
+// The pool mustn't be touched after this.
+//
+static void file_io_pool_abandon(struct file_io_pool *pool)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->threadCount; i++) {
+        pthread_detach(pool->threads[i]);
+    }
+    pool->todo        = NULL;
+    pool->todoTail    = &pool->todo;
+    pool->done        = NULL;
+    pool->doneTail    = &pool->done;
+    pool->stopping    = 1;
+    pool->abandoned   = 1;
+    pool->threadsLeft = pool->threadCount;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static int file_io_pool_init(file_io_t *io)
+{
+    struct file_io_pool *pool = calloc(1, sizeof(*pool));
+
+    if (pool == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pool->todoTail = &pool->todo;
+    pool->doneTail = &pool->done;
+    pool->eventFd  = io->eventFd;
+    for (pool->threadCount = 0; pool->threadCount < FILE_IO_THREADS; pool->threadCount++) {
+        if (pthread_create(&pool->threads[pool->threadCount], NULL, file_io_pool_thread, pool) != 0) {
+            break;
+        }
+    }
+    if (pool->threadCount == 0) {
+        AFLOG_ERR("my-app: io: can't start any I/O threads");
+        file_io_pool_free(pool);
+        return -1;
+    }
+    io->pool = pool;
+    return 0;
+}
+
+//
+// The whole batch goes over with one lock and one wakeup.
+//
+static void file_io_pool_flush(file_io_t *io)
+{
+    struct file_io_pool *pool = io->pool;
+
+    if (io->queued == NULL) {
+        return;
+    }
+    io->inFlight += io->queuedCount;
+    pthread_mutex_lock(&pool->lock);
+    *pool->todoTail = io->queued;
+    pool->todoTail  = io->queuedTail;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    io->queued      = NULL;
+    io->queuedTail  = &io->queued;
+    io->queuedCount = 0;
+}
+
+static void file_io_pool_reap(file_io_t *io)
+{
+    struct file_io_pool *pool = io->pool;
+    file_io_req_t *req;
+    file_io_req_t *next;
+
+    pthread_mutex_lock(&pool->lock);
+    req = pool->done;
+    pool->done     = NULL;
+    pool->doneTail = &pool->done;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (; req != NULL; req = next) {
+        next = req->next;
+        file_io_complete(io, req, req->result);
+    }
+}
+
+//
+// Requests we've put in the submission ring that the kernel hasn't taken yet, because
+// io_uring_enter() failed or took only some of them.
+//
+static unsigned file_io_unsubmitted(const file_io_t *io)
+{
+#ifdef APP_IO_URING
+    if (io->uring) {
+        return io->uring->unsubmitted;
+    }
+#endif
+    return 0;
+}
+
+void file_io_flush(file_io_t *io)
+{
+    unsigned batch = io->queuedCount;
+    struct timeval retry = { 0, FILE_IO_RETRY_MS * 1000 };
+
+    if (batch == 0 && file_io_unsubmitted(io) == 0) {
+        return;
+    }
+    switch (io->backend) {
+#ifdef APP_IO_URING
+        case FILE_IO_URING:
+            file_io_uring_flush(io);
+            break;
+#endif
+        case FILE_IO_POOL:
+            file_io_pool_flush(io);
+            break;
+        default:
+            return;
+    }
+    if (batch > 0) {
+        io->batches++;
+        if (batch > io->maxBatch) {
+            io->maxBatch = batch;
+        }
+    }
+    //
+    // Nothing else may come along to send what's left, so come back for it ourselves.
+    //
+    if (io->queuedCount > 0 || file_io_unsubmitted(io) > 0) {
+        evtimer_add(io->flushEv, &retry);
+    }
+}
+
+static void file_io_reap(file_io_t *io)
+{
+    uint64_t count;
+
+    if (read(io->eventFd, &count, sizeof(count)) < 0) {
+        // EAGAIN: already read along with an earlier completion.
+    }
+    switch (io->backend) {
+#ifdef APP_IO_URING
+        case FILE_IO_URING:
+            file_io_uring_reap(io);
+            break;
+#endif
+        case FILE_IO_POOL:
+            file_io_pool_reap(io);
+            break;
+        default:
+            break;
+    }
+}
+
+static void file_io_flush_cb(evutil_socket_t fd, short what, void *arg)
+{
+    file_io_flush((file_io_t *)arg);
+}
+
+static void file_io_complete_cb(evutil_socket_t fd, short what, void *arg)
+{
+    file_io_reap((file_io_t *)arg);
+}
+
+static int file_io_queue(file_io_t *io, file_io_req_t *req, file_io_op_t op, int fd, void *buf,
+                         uint32_t len, uint64_t offset, file_io_done_t done, void *ctx)
+{
+    struct timeval now = { 0, 0 };
+
+    if (io->closed || io->backend == FILE_IO_NONE ||
+        io->queuedCount + io->inFlight >= FILE_IO_ENTRIES) {
+        io->refused++;
+        return -1;
+    }
+    //
+    // There's a free slot, since fewer than FILE_IO_ENTRIES are out.
+    //
+    while (io->slots[io->nextSlot] != NULL) {
+        io->nextSlot = (io->nextSlot + 1) & (FILE_IO_ENTRIES - 1);
+    }
+    io->slots[io->nextSlot] = req;
+    req->slot         = io->nextSlot;
+    req->op           = op;
+    req->fd           = fd;
+    req->iov.iov_base = buf;
+    req->iov.iov_len  = len;
+    req->offset       = offset;
+    req->result       = 0;
+    req->done         = done;
+    req->ctx          = ctx;
+    req->queuedNs     = file_io_now_ns();
+    req->next         = NULL;
+    *io->queuedTail = req;
+    io->queuedTail  = &req->next;
+    io->requests++;
+    //
+    // The first request of a batch arranges for the batch to go at the end of this pass.
+    //
+    if (io->queuedCount++ == 0) {
+        evtimer_add(io->flushEv, &now);
+    }
+    return 0;
+}
+
+int file_io_read(file_io_t *io, file_io_req_t *req, int fd, void *buf, uint32_t len,
+                 uint64_t offset, file_io_done_t done, void *ctx)
+{
+    return file_io_queue(io, req, FILE_IO_READ, fd, buf, len, offset, done, ctx);
+}
+
+int file_io_write(file_io_t *io, file_io_req_t *req, int fd, const void *buf, uint32_t len,
+                  uint64_t offset, file_io_done_t done, void *ctx)
+{
+    return file_io_queue(io, req, FILE_IO_WRITE, fd, (void *)buf, len, offset, done, ctx);
+}
+
+int file_io_init(file_io_t *io, struct event_base *base)
+{
+    memset(io, 0, sizeof(*io));
+    io->base       = base;
+    io->backend    = FILE_IO_NONE;
+    io->queuedTail = &io->queued;
+    io->freeTimeoutMs = FILE_IO_FREE_TIMEOUT_MS;
+    io->eventFd    = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->eventFd < 0) {
+        AFLOG_ERR("my-app: io: can't create an eventfd: %m");
+        return -1;
+    }
+    io->completionEv = event_new(base, io->eventFd, EV_READ | EV_PERSIST, file_io_complete_cb, io);
+    io->flushEv      = evtimer_new(base, file_io_flush_cb, io);
+    if (io->completionEv == NULL || io->flushEv == NULL || event_add(io->completionEv, NULL) != 0) {
+        AFLOG_ERR("my-app: io: can't allocate events");
+        file_io_free(io);
+        return -1;
+    }
+
+#ifdef APP_IO_URING
+    if (file_io_uring_init(io) == 0) {
+        io->backend = FILE_IO_URING;
+    }
+#endif
+    if (io->backend == FILE_IO_NONE) {
+        if (file_io_pool_init(io) != 0) {
+            file_io_free(io);
+            return -1;
+        }
+        io->backend = FILE_IO_POOL;
+    }
+    AFLOG_INFO("my-app: io: %s, %d requests at most", file_io_backend_name(io), FILE_IO_ENTRIES);
+    return 0;
+}
+
+const char *file_io_backend_name(const file_io_t *io)
+{
+    switch (io->backend) {
+        case FILE_IO_URING: return "io_uring";
+        case FILE_IO_POOL:  return "threads";
+        default:            return "none";
+    }
+}
+
+void file_io_log_stats(const file_io_t *io)
+{
+    uint32_t completed = io->requests - io->queuedCount - io->inFlight;
+
+    AFLOG_INFO("my-app: io: %s requests=%u batches=%u max_batch=%u refused=%u errors=%u bytes=%llu "
+               "wait avg=%lluus max=%lluus",
+               file_io_backend_name(io), io->requests, io->batches, io->maxBatch, io->refused,
+               io->errors, (unsigned long long)io->bytes,
+               (unsigned long long)(completed ? io->waitTotalNs / completed / 1000 : 0),
+               (unsigned long long)(io->waitMaxNs / 1000));
+}
+
+//
+// file_io_free() has waited long enough. Whatever is still out is taken back from the
+// backend, which won't hand it to us again, logged, and completed with -ECANCELED.
+//
+static void file_io_cancel(file_io_t *io)
+{
+    file_io_req_t *req;
+    uint64_t nowNs = file_io_now_ns();
+    unsigned i;
+
+    AFLOG_WARNING("my-app: io: %s: giving up on %u requests after %ums", file_io_backend_name(io),
+                  io->queuedCount + io->inFlight, io->freeTimeoutMs);
+#ifdef APP_IO_URING
+    if (io->uring) {
+        file_io_uring_free(io->uring);  // Closing the ring cancels whatever the kernel still has.
+        io->uring = NULL;
+    }
+#endif
+    if (io->pool) {
+        file_io_pool_abandon(io->pool);
+        io->pool = NULL;
+    }
+    io->inFlight   += io->queuedCount;
+    io->queued      = NULL;
+    io->queuedTail  = &io->queued;
+    io->queuedCount = 0;
+    for (i = 0; i < FILE_IO_ENTRIES; i++) {
+        req = io->slots[i];
+        if (req != NULL) {
+            AFLOG_WARNING("my-app: io: cancelled %s of %u bytes at %llu in fd %d, queued %llums ago",
+                          req->op == FILE_IO_READ ? "read" : "write", (unsigned)req->iov.iov_len,
+                          (unsigned long long)req->offset, req->fd,
+                          (unsigned long long)((nowNs - req->queuedNs) / 1000000));
+            file_io_complete(io, req, -ECANCELED);
+        }
+    }
+}
+
+void file_io_free(file_io_t *io)
+{
+    uint64_t deadlineNs = file_io_now_ns() + (uint64_t)io->freeTimeoutMs * 1000000;
+    uint64_t nowNs;
+    uint64_t waitMs;
+    struct pollfd pfd;
+
+    //
+    // Finish what's been started. Callbacks may queue follow-up requests; those are
+    // finished too, until the deadline.
+    //
+    while (io->backend != FILE_IO_NONE && (io->queuedCount > 0 || io->inFlight > 0)) {
+        nowNs = file_io_now_ns();
+        if (nowNs >= deadlineNs) {
+            break;
+        }
+        file_io_flush(io);
+        pfd.fd      = io->eventFd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (io->inFlight > 0) {
+            waitMs = (deadlineNs - nowNs + 999999) / 1000000;
+            if (io->queuedCount > 0 || file_io_unsubmitted(io) > 0) {
+                waitMs = waitMs < FILE_IO_RETRY_MS ? waitMs : FILE_IO_RETRY_MS;  // Soon to be sent again.
+            }
+            poll(&pfd, 1, waitMs < 100 ? (int)waitMs : 100);
+        }
+        file_io_reap(io);
+    }
+    io->closed = 1;
+    if (io->queuedCount > 0 || io->inFlight > 0) {
+        file_io_cancel(io);  // Their callbacks can't queue anything more now.
+    }
+
+#ifdef APP_IO_URING
+    if (io->uring) {
+        file_io_uring_free(io->uring);
+        io->uring = NULL;
+    }
+#endif
+    if (io->pool) {
+        file_io_pool_free(io->pool);
+        io->pool = NULL;
+    }
+    if (io->flushEv) {
+        event_free(io->flushEv);
+        io->flushEv = NULL;
+    }
+    if (io->completionEv) {
+        event_free(io->completionEv);
+        io->completionEv = NULL;
+    }
+    if (io->eventFd >= 0) {
+        close(io->eventFd);
+        io->eventFd = -1;
+    }
+    io->backend = FILE_IO_NONE;
+}
@@ -0,0 +1,160 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Asynchronous file reads and writes for the event loop.
+
+   Handlers run on the event loop, so a read that has to wait for the disk holds up
+   every event behind it, the watchdog keepalives included. file_io_read() and
+   file_io_write() don't wait: they queue the request and return, and its callback runs
+   on the same loop once the data has been read or written. Everything queued during
+   one pass of the loop goes to the kernel together at the end of the pass, so a
+   handler can queue a whole batch without a system call for each one.
+   file_io_flush() sends them right away instead.
+
+   There are two ways the I/O gets done:
+
+     io_uring   The kernel does it. Requests go into the submission ring, one
+                io_uring_enter() sends the batch, and the kernel signals completions
+                on an eventfd the loop watches. Needs Linux 5.2 or later.
+     threads    FILE_IO_THREADS worker threads do pread()/pwrite() and signal the
+                same kind of eventfd. Used when the kernel has no io_uring or won't let
+                us have one, and when built with -DAPP_NO_IO_URING or without
+                <linux/io_uring.h>.
+
+   Callers can't tell which one they got, apart from the logs.
+
+   A file_io_t belongs to one event loop and is only used from it. Requests belong to
+   the caller and must stay put until their callback has run. There is no file
+   position; every request says where in the file it goes. Opening and closing files
+   is still up to the caller.
+
+   file_io_free() waits for what's outstanding, but not forever: a read from a pipe
+   nobody writes to, or from a disk that's gone away, would keep the app from ever
+   exiting. After freeTimeoutMs whatever is left is logged and completed with
+   -ECANCELED. A read the kernel or a worker was still doing may yet land in its buffer
+   after that, so a caller about to exit is the only kind that should rely on this.
+*/
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <event2/event.h>
+
+#if !defined(APP_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define APP_IO_URING 1
+#endif
+#endif
+
+#define FILE_IO_ENTRIES   64   // Requests queued or in flight at most. Power of two.
+#define FILE_IO_THREADS   2    // Workers when there's no io_uring.
+#define FILE_IO_FREE_TIMEOUT_MS  2000  // Default for freeTimeoutMs.
+#define FILE_IO_RETRY_MS  1    // Before sending again what the kernel didn't take.
+
+typedef enum {
+    FILE_IO_READ,
+    FILE_IO_WRITE,
+} file_io_op_t;
+
+typedef enum {
+    FILE_IO_NONE,
+    FILE_IO_URING,
+    FILE_IO_POOL,
+} file_io_backend_t;
+
+typedef struct file_io_req file_io_req_t;
+
+//
+// req->result is the number of bytes read or written, which can be short, or -errno.
+// The request is the caller's again, and can be reused, once this is called.
+//
+typedef void (*file_io_done_t)(file_io_req_t *req, void *ctx);
+
+struct file_io_req {
+    file_io_op_t     op;
+    int              fd;
+    struct iovec     iov;
+    uint64_t         offset;
+    int32_t          result;
+    file_io_done_t   done;
+    void            *ctx;
+    //
+    // Ours while the request is queued or in flight.
+    //
+    uint64_t         queuedNs;
+    file_io_req_t   *next;
+    unsigned         slot;          // Where it is in file_io_t's slots.
+};
+
+struct file_io_uring;
+struct file_io_pool;
+
+typedef struct {
+    struct event_base    *base;
+    file_io_backend_t     backend;
+    int                   eventFd;        // Completions are signalled here.
+    struct event         *completionEv;
+    struct event         *flushEv;
+    struct file_io_uring *uring;
+    struct file_io_pool  *pool;
+    //
+    // Requests not yet handed to the backend, oldest first.
+    //
+    file_io_req_t        *queued;
+    file_io_req_t       **queuedTail;
+    unsigned              queuedCount;
+    unsigned              inFlight;
+    int                   closed;
+    //
+    // Every request queued or in flight, so file_io_free() can find the ones that never
+    // came back. nextSlot is where to start looking for a free one.
+    //
+    file_io_req_t        *slots[FILE_IO_ENTRIES];
+    unsigned              nextSlot;
+    uint32_t              freeTimeoutMs;  // How long file_io_free() waits. Can be changed after file_io_init().
+    //
+    // Statistics.
+    //
+    uint32_t              requests;
+    uint32_t              batches;        // Times requests were handed to the backend.
+    uint32_t              maxBatch;
+    uint32_t              refused;        // Queue full, or closed.
+    uint32_t              errors;         // Requests that completed with -errno.
+    uint64_t              bytes;
+    uint64_t              waitTotalNs;    // Queued to callback.
+    uint64_t              waitMaxNs;
+} file_io_t;
+
+//
+// Set up on base, with io_uring if we can and threads otherwise. Fails only if neither
+// can be had.
+//
+int file_io_init(file_io_t *io, struct event_base *base);
+
+//
+// Queue a read of len bytes at offset in fd into buf, or a write of them from buf.
+// Returns -1 if FILE_IO_ENTRIES requests are already queued or in flight, or after
+// file_io_free(); done is not called then.
+//
+int file_io_read(file_io_t *io, file_io_req_t *req, int fd, void *buf, uint32_t len,
+                 uint64_t offset, file_io_done_t done, void *ctx);
+int file_io_write(file_io_t *io, file_io_req_t *req, int fd, const void *buf, uint32_t len,
+                  uint64_t offset, file_io_done_t done, void *ctx);
+
+//
+// Send whatever is queued now rather than at the end of this pass of the loop.
+//
+void file_io_flush(file_io_t *io);
+
+const char *file_io_backend_name(const file_io_t *io);
+
+void file_io_log_stats(const file_io_t *io);
+
+//
+// Wait for everything queued or in flight and run its callbacks, which may queue more,
+// then tear down. Whatever isn't done after freeTimeoutMs is completed with -ECANCELED.
+// The loop must not be running.
+//
+void file_io_free(file_io_t *io);
+
+#endif // FILE_IO_H
@@ -0,0 +1,771 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Attribute history recorder. See history.h.
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "af_log.h"
+#include "device-description.h"
+#include "memo_cache.h"
+#include "history.h"
+
+//
+// Record tags. The top bit is the direction.
+//
+#define HISTORY_TAG_OUT        0x80
+#define HISTORY_TAG_INT        1   // zigzag varint delta from the attribute's previous value
+#define HISTORY_TAG_STR        2   // varint length, then the bytes
+#define HISTORY_TAG_BYTES      3
+#define HISTORY_TAG_STR_REF    4   // varint offset of an earlier STR record's length in this block
+#define HISTORY_TAG_BYTES_REF  5
+#define HISTORY_TAG_KIND       0x7f
+
+#define HISTORY_MAX_HEADER     (1 + 10 + 3 + 3)   // Tag, time delta, ID, length or offset.
+#define HISTORY_MAX_VALUE      (HISTORY_BLOCK_SIZE - HISTORY_MAX_HEADER)
+#define HISTORY_MAX_REQUEST    256
+
+static uint64_t history_ms(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint8_t *history_put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+//
+// Returns NULL if the varint runs past end.
+//
+static const uint8_t *history_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (p < end && shift < 64) {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+static uint64_t history_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t history_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+//
+// Profile slot of an integer attribute, or -1 for anything we don't delta-encode.
+//
+static int history_int_slot(const history_t *h, uint16_t attrId, uint16_t len)
+{
+    const profile_attr_t *a = profile_lookup(h->profile, attrId);
+
+    if (a == NULL || a->type < ATTRIBUTE_TYPE_BOOLEAN || a->type > ATTRIBUTE_TYPE_SINT64 ||
+        (len != 1 && len != 2 && len != 4 && len != 8)) {
+        return -1;
+    }
+    return (int)profile_slot(h->profile, attrId);
+}
+
+static int64_t history_decode_int(const void *value, uint16_t len)
+{
+    int8_t  v8;
+    int16_t v16;
+    int32_t v32;
+    int64_t v64;
+
+    switch (len) {
+        case 1:
+            memcpy(&v8, value, sizeof(v8));
+            return v8;
+        case 2:
+            memcpy(&v16, value, sizeof(v16));
+            return v16;
+        case 4:
+            memcpy(&v32, value, sizeof(v32));
+            return v32;
+        default:
+            memcpy(&v64, value, sizeof(v64));
+            return v64;
+    }
+}
+
+//
+// Move on to the next block, dropping the oldest one if the ring has come around.
+//
+static void history_next_block(history_t *h, uint64_t now)
+{
+    history_block_t *b;
+
+    b = (h->cur == NULL) ? h->blocks : h->blocks + ((h->cur - h->blocks) + 1) % HISTORY_BLOCKS;
+    if (b->seq != 0) {
+        h->recycled++;
+    }
+    b->seq     = h->nextSeq++;
+    b->used    = 0;
+    b->records = 0;
+    b->monoMs  = now;
+    b->realMs  = history_ms(CLOCK_REALTIME);
+    h->cur     = b;
+    h->lastMs  = now;
+}
+
+void history_record(history_t *h, int dir, uint16_t attrId, const void *value, uint16_t len)
+{
+    const profile_attr_t *a;
+    history_block_t *b;
+    history_str_t *s;
+    uint64_t now;
+    uint64_t hash = 0;
+    uint8_t *p;
+    uint8_t *start;
+    uint8_t tag;
+    int slot;
+    int64_t v = 0;
+
+    if (h->blocks == NULL) {
+        return;
+    }
+    if (value == NULL) {
+        len = 0;
+    }
+    if (len > HISTORY_MAX_VALUE) {
+        len = HISTORY_MAX_VALUE;
+        h->truncated++;
+    }
+    now = history_ms(CLOCK_MONOTONIC);
+
+    b = h->cur;
+    if (b == NULL || b->used + HISTORY_MAX_HEADER + (len > 10 ? len : 10) > HISTORY_BLOCK_SIZE) {
+        history_next_block(h, now);
+        b = h->cur;
+    }
+
+    start = p = b->data + b->used;
+    slot = history_int_slot(h, attrId, len);
+    if (slot >= 0) {
+        tag = HISTORY_TAG_INT;
+        v = history_decode_int(value, len);
+    }
+    else {
+        a = profile_lookup(h->profile, attrId);
+        tag = (a != NULL && a->type == ATTRIBUTE_TYPE_UTF8S) ? HISTORY_TAG_STR : HISTORY_TAG_BYTES;
+        //
+        // The same value already in this block? Then point at it instead.
+        //
+        hash = memo_hash(value, len);
+        s = &h->strs[hash & (HISTORY_STR_SLOTS - 1)];
+        if (s->blockSeq == b->seq && s->hash == hash && s->len == len) {
+            uint64_t l;
+            const uint8_t *copy = history_get_varint(b->data + s->offset, b->data + b->used, &l);
+
+            if (copy != NULL && l == len && memcmp(copy, value, len) == 0) {
+                tag = (tag == HISTORY_TAG_STR) ? HISTORY_TAG_STR_REF : HISTORY_TAG_BYTES_REF;
+            }
+        }
+    }
+
+    *p++ = tag | (dir == HISTORY_OUT ? HISTORY_TAG_OUT : 0);
+    p = history_put_varint(p, now - h->lastMs);
+    p = history_put_varint(p, attrId);
+    switch (tag) {
+        case HISTORY_TAG_INT:
+            p = history_put_varint(p, history_zigzag((int64_t)((uint64_t)v -
+                                   (uint64_t)(h->lastBlock[slot] == b->seq ? h->lastValue[slot] : 0))));
+            h->lastValue[slot] = v;
+            h->lastBlock[slot] = b->seq;
+            break;
+        case HISTORY_TAG_STR_REF:
+        case HISTORY_TAG_BYTES_REF:
+            p = history_put_varint(p, h->strs[hash & (HISTORY_STR_SLOTS - 1)].offset);
+            h->strRefs++;
+            break;
+        default:
+            s = &h->strs[hash & (HISTORY_STR_SLOTS - 1)];
+            s->hash     = hash;
+            s->blockSeq = b->seq;
+            s->offset   = (uint32_t)(p - b->data);
+            s->len      = len;
+            p = history_put_varint(p, len);
+            memcpy(p, value, len);
+            p += len;
+            break;
+    }
+
+    b->used += (uint32_t)(p - start);
+    b->records++;
+    h->lastMs = now;
+    h->records++;
+    h->bytes += (uint64_t)(p - start);
+    h->rawBytes += len;
+}
+
+static void history_print_value(FILE *out, uint8_t kind, const uint8_t *v, uint64_t len)
+{
+    uint64_t i;
+
+    if (kind == HISTORY_TAG_STR) {
+        fputc('"', out);
+        for (i = 0; i < len; i++) {
+            if (v[i] == '"' || v[i] == '\\') {
+                fprintf(out, "\\%c", v[i]);
+            }
+            else if (v[i] < 0x20 || v[i] >= 0x7f) {
+                fprintf(out, "\\x%02x", v[i]);
+            }
+            else {
+                fputc(v[i], out);
+            }
+        }
+        fputc('"', out);
+    }
+    else {
+        for (i = 0; i < len; i++) {
+            fprintf(out, "%02x", v[i]);
+        }
+        if (len == 0) {
+            fputs("-", out);
+        }
+    }
+}
+
+//
+// Decode one block. Integer deltas are undone with the decoder's own copy of the last
+// values, which starts from zero at every block just like the encoder's.
+//
+static uint32_t history_query_block(const history_t *h, const history_block_t *b, FILE *out, int attrId,
+                                    uint64_t fromMs, uint64_t toMs, int64_t *last, uint32_t *lastBlock)
+{
+    const uint8_t *p = b->data;
+    const uint8_t *end = b->data + b->used;
+    const uint8_t *v;
+    uint64_t t = b->monoMs;
+    uint64_t dt, id, x, len, realMs;
+    uint32_t n = 0;
+    uint32_t slot;
+    uint8_t tag, kind;
+    int64_t value = 0;
+
+    while (p < end) {
+        tag = *p++;
+        kind = tag & HISTORY_TAG_KIND;
+        if ((p = history_get_varint(p, end, &dt)) == NULL || (p = history_get_varint(p, end, &id)) == NULL ||
+            (p = history_get_varint(p, end, &x)) == NULL) {
+            break;
+        }
+        t += dt;
+        v = NULL;
+        len = 0;
+        switch (kind) {
+            case HISTORY_TAG_INT:
+                slot = profile_slot(h->profile, (uint16_t)id);
+                value = (int64_t)((uint64_t)(lastBlock[slot] == b->seq ? last[slot] : 0) +
+                                  (uint64_t)history_unzigzag(x));
+                last[slot] = value;
+                lastBlock[slot] = b->seq;
+                break;
+            case HISTORY_TAG_STR:
+            case HISTORY_TAG_BYTES:
+                len = x;
+                v = p;
+                p += len;
+                break;
+            case HISTORY_TAG_STR_REF:
+            case HISTORY_TAG_BYTES_REF:
+                kind -= HISTORY_TAG_STR_REF - HISTORY_TAG_STR;
+                if (x >= b->used || (v = history_get_varint(b->data + x, end, &len)) == NULL) {
+                    return n;
+                }
+                break;
+            default:
+                return n;  // Can't happen unless the block is corrupt.
+        }
+        if (p > end || (v != NULL && v + len > end)) {
+            break;
+        }
+
+        realMs = b->realMs + (t - b->monoMs);
+        if ((attrId >= 0 && id != (uint64_t)attrId) || realMs < fromMs || realMs > toMs) {
+            continue;
+        }
+        fprintf(out, "%llu %s %u ", (unsigned long long)realMs, (tag & HISTORY_TAG_OUT) ? "out" : "in", (unsigned)id);
+        if (kind == HISTORY_TAG_INT) {
+            fprintf(out, "%lld", (long long)value);
+        }
+        else {
+            history_print_value(out, kind, v, len);
+        }
+        fputc('\n', out);
+        n++;
+    }
+    return n;
+}
+
+uint32_t history_query(history_t *h, FILE *out, int attrId, uint64_t fromMs, uint64_t toMs)
+{
+    int64_t *last;
+    uint32_t *lastBlock;
+    uint32_t n = 0;
+    int i;
+    int first;
+
+    if (h->cur == NULL) {
+        return 0;
+    }
+    last      = calloc(h->profile->hdr->slotCount, sizeof(*last));
+    lastBlock = calloc(h->profile->hdr->slotCount, sizeof(*lastBlock));
+    if (last == NULL || lastBlock == NULL) {
+        free(last);
+        free(lastBlock);
+        return 0;
+    }
+    //
+    // Oldest block first: the one after the current block, around to the current one.
+    //
+    first = (int)((h->cur - h->blocks) + 1) % HISTORY_BLOCKS;
+    for (i = 0; i < HISTORY_BLOCKS; i++) {
+        const history_block_t *b = &h->blocks[(first + i) % HISTORY_BLOCKS];
+
+        if (b->seq != 0) {
+            n += history_query_block(h, b, out, attrId, fromMs, toMs, last, lastBlock);
+        }
+    }
+    free(last);
+    free(lastBlock);
+    return n;
+}
+
+static void history_write_stats(const history_t *h, FILE *out)
+{
+    const history_block_t *oldest = NULL;
+    int i;
+
+    if (h->blocks == NULL) {
+        return;
+    }
+    for (i = 0; i < HISTORY_BLOCKS; i++) {
+        if (h->blocks[i].seq != 0 && (oldest == NULL || h->blocks[i].seq < oldest->seq)) {
+            oldest = &h->blocks[i];
+        }
+    }
+    fprintf(out, "records=%llu bytes=%llu (%.1f per record, values alone %llu) string_refs=%u "
+            "blocks_recycled=%u truncated=%u covers=%llus\n",
+            (unsigned long long)h->records, (unsigned long long)h->bytes,
+            h->records ? (double)h->bytes / h->records : 0.0, (unsigned long long)h->rawBytes,
+            h->strRefs, h->recycled, h->truncated,
+            (unsigned long long)(oldest ? (history_ms(CLOCK_MONOTONIC) - oldest->monoMs) / 1000 : 0));
+}
+
+//
+// A copy of the blocks for rendering away from the live ones, which keep changing.
+//
+typedef struct {
+    history_t        view;                    // Just enough for history_query() to read blocks.
+    int             *running;                 // Cleared when a SIGUSR1 dump is written.
+    history_block_t  blocks[HISTORY_BLOCKS];
+} history_snapshot_t;
+
+static history_snapshot_t *history_snapshot(const history_t *h)
+{
+    history_snapshot_t *snap = malloc(sizeof(*snap));
+    int i;
+
+    if (snap == NULL) {
+        return NULL;
+    }
+    memset(&snap->view, 0, sizeof(snap->view));
+    snap->view.profile = h->profile;
+    snap->view.blocks  = snap->blocks;
+    snap->view.cur     = h->cur ? snap->blocks + (h->cur - h->blocks) : NULL;
+    snap->running      = NULL;
+    for (i = 0; i < HISTORY_BLOCKS; i++) {
+        memcpy(&snap->blocks[i], &h->blocks[i], offsetof(history_block_t, data) + h->blocks[i].used);
+    }
+    return snap;
+}
+
+//
+// The local interface. One request line per connection. stats is answered on the spot;
+// dump and query render from a copy of the blocks taken when they ask, one block each
+// time the socket has taken the last, so no pass of the event loop renders more than a
+// block.
+//
+typedef struct {
+    history_snapshot_t *snap;
+    struct bufferevent *bev;
+    struct event       *more;       // Goes on to the next block when one had nothing to send.
+    int                 attrId;
+    uint64_t            fromMs;
+    uint64_t            toMs;
+    int                 first;      // Oldest block.
+    int                 next;       // Blocks rendered so far.
+    int64_t            *last;       // history_query_block()'s integer state.
+    uint32_t           *lastBlock;
+} history_stream_t;
+
+static void history_stream_free(history_stream_t *st)
+{
+    bufferevent_free(st->bev);
+    if (st->more) {
+        event_free(st->more);
+    }
+    free(st->last);
+    free(st->lastBlock);
+    free(st->snap);
+    free(st);
+}
+
+static void history_stream_next(history_stream_t *st)
+{
+    struct evbuffer *outBuf = bufferevent_get_output(st->bev);
+    const history_block_t *b;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out;
+
+    while (st->next < HISTORY_BLOCKS) {
+        b = &st->snap->blocks[(st->first + st->next++) % HISTORY_BLOCKS];
+        if (b->seq == 0) {
+            continue;
+        }
+        out = open_memstream(&text, &len);
+        if (out == NULL) {
+            history_stream_free(st);
+            return;
+        }
+        history_query_block(&st->snap->view, b, out, st->attrId, st->fromMs, st->toMs, st->last, st->lastBlock);
+        fclose(out);
+        if (len > 0) {
+            evbuffer_add(outBuf, text, len);  // The write callback brings us back for the next.
+        }
+        else {
+            event_active(st->more, EV_TIMEOUT, 0);
+        }
+        free(text);
+        return;
+    }
+    if (evbuffer_get_length(outBuf) == 0) {
+        history_stream_free(st);
+    }
+}
+
+static void history_stream_write_cb(struct bufferevent *bev, void *arg)
+{
+    history_stream_next((history_stream_t *)arg);
+}
+
+static void history_stream_more_cb(evutil_socket_t fd, short what, void *arg)
+{
+    history_stream_next((history_stream_t *)arg);
+}
+
+static void history_stream_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) {
+        history_stream_free((history_stream_t *)arg);
+    }
+}
+
+//
+// Takes over bev. Returns -1, leaving bev alone, if there's no memory for it.
+//
+static int history_stream_start(history_t *h, struct bufferevent *bev, int attrId, uint64_t fromMs, uint64_t toMs)
+{
+    history_stream_t *st = calloc(1, sizeof(*st));
+
+    if (st == NULL) {
+        return -1;
+    }
+    st->bev       = bev;
+    st->attrId    = attrId;
+    st->fromMs    = fromMs;
+    st->toMs      = toMs;
+    st->snap      = history_snapshot(h);
+    st->more      = event_new(bufferevent_get_base(bev), -1, 0, history_stream_more_cb, st);
+    st->last      = calloc(h->profile->hdr->slotCount, sizeof(*st->last));
+    st->lastBlock = calloc(h->profile->hdr->slotCount, sizeof(*st->lastBlock));
+    if (st->snap == NULL || st->more == NULL || st->last == NULL || st->lastBlock == NULL) {
+        if (st->more) {
+            event_free(st->more);
+        }
+        free(st->last);
+        free(st->lastBlock);
+        free(st->snap);
+        free(st);
+        return -1;
+    }
+    st->first = st->snap->view.cur ? (int)((st->snap->view.cur - st->snap->blocks) + 1) % HISTORY_BLOCKS : 0;
+    bufferevent_setcb(bev, NULL, history_stream_write_cb, history_stream_event_cb, st);
+    history_stream_next(st);
+    return 0;
+}
+
+static void history_client_done_cb(struct bufferevent *bev, void *arg)
+{
+    bufferevent_free(bev);
+}
+
+static void history_client_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) {
+        bufferevent_free(bev);
+    }
+}
+
+static void history_client_read_cb(struct bufferevent *bev, void *arg)
+{
+    history_t *h = (history_t *)arg;
+    struct evbuffer *in = bufferevent_get_input(bev);
+    char *line;
+    char *resp = NULL;
+    size_t respLen = 0;
+    size_t n;
+    char what[16];
+    char attr[16];
+    unsigned long long from = 0;
+    unsigned long long to = UINT64_MAX;
+    FILE *out;
+    int fields;
+
+    line = evbuffer_readln(in, &n, EVBUFFER_EOL_ANY);
+    if (line == NULL) {
+        if (evbuffer_get_length(in) > HISTORY_MAX_REQUEST) {
+            bufferevent_free(bev);
+        }
+        return;
+    }
+    fields = sscanf(line, "%15s %15s %llu %llu", what, attr, &from, &to);
+    free(line);
+    if (fields >= 1 && (strcmp(what, "dump") == 0 || (fields >= 2 && strcmp(what, "query") == 0))) {
+        bufferevent_disable(bev, EV_READ);
+        if (strcmp(what, "dump") == 0) {
+            from = 0;
+            to = UINT64_MAX;
+        }
+        if (history_stream_start(h, bev, strcmp(what, "dump") == 0 || strcmp(attr, "*") == 0 ? -1 : atoi(attr),
+                                 from, to) != 0) {
+            AFLOG_ERR("my-app: history: out of memory for a query");
+            bufferevent_free(bev);
+        }
+        return;
+    }
+
+    out = open_memstream(&resp, &respLen);
+    if (out == NULL) {
+        bufferevent_free(bev);
+        return;
+    }
+    if (fields >= 1 && strcmp(what, "stats") == 0) {
+        history_write_stats(h, out);
+    }
+    else {
+        fprintf(out, "error: expected query <attrId|*> [<from> [<to>]], dump or stats\n");
+    }
+    fclose(out);
+
+    bufferevent_disable(bev, EV_READ);
+    bufferevent_setcb(bev, NULL, history_client_done_cb, history_client_event_cb, h);
+    if (respLen == 0) {
+        free(resp);
+        bufferevent_free(bev);
+        return;
+    }
+    evbuffer_add(bufferevent_get_output(bev), resp, respLen);
+    free(resp);
+}
+
+static void history_accept_cb(struct evconnlistener *l, evutil_socket_t fd, struct sockaddr *sa, int len, void *arg)
+{
+    history_t *h = (history_t *)arg;
+    struct bufferevent *bev;
+    struct timeval tv = { 5, 0 };
+
+    bev = bufferevent_socket_new(evconnlistener_get_base(l), fd, BEV_OPT_CLOSE_ON_FREE);
+    if (bev == NULL) {
+        close(fd);
+        return;
+    }
+    bufferevent_setcb(bev, history_client_read_cb, NULL, history_client_event_cb, h);
+    bufferevent_set_timeouts(bev, &tv, &tv);
+    bufferevent_enable(bev, EV_READ);
+}
+
+//
+// SIGUSR1. Rendering the whole history takes far longer than a handler should hold up
+// the loop, so the loop only copies the blocks and a thread of its own writes the copy.
+//
+
+static void *history_dump_thread(void *arg)
+{
+    history_snapshot_t *snap = (history_snapshot_t *)arg;
+    FILE *out = fopen(HISTORY_DUMP_PATH ".tmp", "w");
+    uint32_t n;
+
+    if (out == NULL) {
+        AFLOG_ERR("my-app: history: can't write %s: %m", HISTORY_DUMP_PATH ".tmp");
+    }
+    else {
+        n = history_query(&snap->view, out, -1, 0, UINT64_MAX);
+        if (fclose(out) != 0 || rename(HISTORY_DUMP_PATH ".tmp", HISTORY_DUMP_PATH) != 0) {
+            AFLOG_ERR("my-app: history: can't write %s: %m", HISTORY_DUMP_PATH);
+        }
+        else {
+            AFLOG_INFO("my-app: history: dumped %u records to %s", n, HISTORY_DUMP_PATH);
+        }
+    }
+    __atomic_store_n(snap->running, 0, __ATOMIC_RELEASE);
+    free(snap);
+    return NULL;
+}
+
+static void history_dump_cb(evutil_socket_t sig, short what, void *arg)
+{
+    history_t *h = (history_t *)arg;
+    history_snapshot_t *snap;
+
+    if (__atomic_load_n(&h->dumpRunning, __ATOMIC_ACQUIRE)) {
+        AFLOG_INFO("my-app: history: still writing the last dump");
+        return;
+    }
+    if (h->dumpStarted) {
+        pthread_join(h->dumpThread, NULL);
+        h->dumpStarted = 0;
+    }
+    snap = history_snapshot(h);
+    if (snap == NULL) {
+        AFLOG_ERR("my-app: history: out of memory for a dump");
+        return;
+    }
+    snap->running = &h->dumpRunning;
+
+    h->dumpRunning = 1;
+    if (pthread_create(&h->dumpThread, NULL, history_dump_thread, snap) != 0) {
+        AFLOG_ERR("my-app: history: can't start the dump thread");
+        h->dumpRunning = 0;
+        free(snap);
+        return;
+    }
+    h->dumpStarted = 1;
+}
+
+static void history_listen(history_t *h, struct event_base *base)
+{
+    struct sockaddr_un sa;
+    char dir[sizeof(sa.sun_path)];
+    char *slash;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, HISTORY_SOCKET_PATH, sizeof(sa.sun_path) - 1);
+    strncpy(dir, HISTORY_SOCKET_PATH, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    slash = strrchr(dir, '/');
+    if (slash != NULL && slash != dir) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            AFLOG_WARNING("my-app: history: can't create %s: %m", dir);
+        }
+    }
+    unlink(HISTORY_SOCKET_PATH);  // Left over from the last run.
+
+    h->listener = evconnlistener_new_bind(base, history_accept_cb, h, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC,
+                                          4, (struct sockaddr *)&sa, sizeof(sa));
+    if (h->listener == NULL) {
+        AFLOG_WARNING("my-app: history: can't listen on %s: %m", HISTORY_SOCKET_PATH);
+        return;
+    }
+    chmod(HISTORY_SOCKET_PATH, 0600);
+}
+
+int history_init(history_t *h, struct event_base *base, const profile_t *p)
+{
+    memset(h, 0, sizeof(*h));
+    h->profile   = p;
+    h->nextSeq   = 1;
+    h->blocks    = calloc(HISTORY_BLOCKS, sizeof(*h->blocks));
+    h->lastValue = calloc(p->hdr->slotCount, sizeof(*h->lastValue));
+    h->lastBlock = calloc(p->hdr->slotCount, sizeof(*h->lastBlock));
+    if (h->blocks == NULL || h->lastValue == NULL || h->lastBlock == NULL) {
+        AFLOG_ERR("my-app: history: out of memory");
+        history_free(h);
+        return -1;
+    }
+
+    history_listen(h, base);
+    h->dumpSignal = evsignal_new(base, SIGUSR1, history_dump_cb, h);
+    if (h->dumpSignal != NULL) {
+        evsignal_add(h->dumpSignal, NULL);
+    }
+    AFLOG_INFO("my-app: history: %u KB in %d blocks", (unsigned)(HISTORY_BLOCKS * sizeof(history_block_t) / 1024),
+               HISTORY_BLOCKS);
+    return 0;
+}
+
+void history_free(history_t *h)
+{
+    if (h->listener) {
+        evconnlistener_free(h->listener);
+        unlink(HISTORY_SOCKET_PATH);
+    }
+    if (h->dumpSignal) {
+        event_free(h->dumpSignal);
+    }
+    if (h->dumpStarted) {
+        pthread_join(h->dumpThread, NULL);  // A dump being written is finished first.
+    }
+    free(h->blocks);
+    free(h->lastValue);
+    free(h->lastBlock);
+    memset(h, 0, sizeof(*h));
+}
+
+void history_log_stats(const history_t *h)
+{
+    char *line = NULL;
+    size_t len = 0;
+    FILE *out;
+
+    if (h->blocks == NULL || (out = open_memstream(&line, &len)) == NULL) {
+        return;
+    }
+    history_write_stats(h, out);
+    fclose(out);
+    if (len > 0) {
+        line[len - 1] = '\0';  // No newline in the log.
+    }
+    AFLOG_INFO("my-app: history: %s", line);
+    free(line);
+}
@@ -0,0 +1,132 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Attribute history recorder.
+
+   When something goes wrong in the field, the current attribute values rarely tell
+   the whole story. The history keeps every attribute value that came in from the Cloud
+   or the ASR and every value we sent out, with when it happened, in a fixed amount of
+   memory (HISTORY_BLOCKS * HISTORY_BLOCK_SIZE, 256KB by default). When it's full, the
+   oldest block of history goes.
+
+   To make that memory last, records are packed:
+
+     - times, attribute IDs and lengths are varints; a record's time is the number of
+       milliseconds since the record before it
+     - integer attributes store the zigzag varint of the difference from the attribute's
+       previous value, which for counters and sensors is usually one byte
+     - a string or byte value that is already in the block (the same reversed string
+       sent again, say) is stored as a reference to the earlier copy
+
+   Records only refer back within their own block and every block starts from scratch,
+   so dropping the oldest block never breaks anything that comes after it. A typical
+   integer update is 4 or 5 bytes, so the default size holds hours of history.
+
+   Recording is meant for the event path: a clock read, a hash lookup and a few bytes of
+   encoding. Strings also cost a hash of the value.
+
+   The history can be read over a Unix socket, HISTORY_SOCKET_PATH, one request per
+   connection:
+
+     query <attrId|*> [<from> [<to>]]   records for one attribute, or all of them, with
+                                        times in ms since the epoch
+     dump                               everything
+     stats                              how full it is
+
+   for example: echo "query 7" | socat - UNIX-CONNECT:/run/af-app/history.sock
+
+   Each record comes back as a line "<ms since epoch> <in|out> <attrId> <value>". A
+   query or dump answers from a copy of the blocks taken when it came in, rendered a
+   block at a time as the client reads, so a big answer doesn't hold up the event loop.
+   SIGUSR1 dumps everything to HISTORY_DUMP_PATH in the same format. The event loop only
+   takes a copy of the blocks for that; a thread renders and writes it, and a second
+   SIGUSR1 while it's busy is ignored.
+*/
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include "profile.h"
+
+#define HISTORY_BLOCK_SIZE    8192   // Must fit the largest value plus a record header.
+#define HISTORY_BLOCKS        32
+#define HISTORY_STR_SLOTS     64     // Recent strings remembered for dedup. Power of two.
+#define HISTORY_SOCKET_PATH   "/run/af-app/history.sock"
+#define HISTORY_DUMP_PATH     "/tmp/af-app-history.txt"
+
+#define HISTORY_IN            0      // From the Cloud or the ASR.
+#define HISTORY_OUT           1      // Sent by us, once the ASR confirmed it.
+
+typedef struct {
+    uint32_t seq;          // Blocks are numbered as they're started; 0 means never used.
+    uint32_t used;         // Bytes of records.
+    uint32_t records;
+    uint64_t monoMs;       // CLOCK_MONOTONIC when the block was started, record times count from here.
+    uint64_t realMs;       // CLOCK_REALTIME at the same moment, for reporting.
+    uint8_t  data[HISTORY_BLOCK_SIZE];
+} history_block_t;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t blockSeq;     // Block the copy is in; stale when that's not the current block.
+    uint32_t offset;       // Of the record holding the copy.
+    uint16_t len;
+} history_str_t;
+
+typedef struct {
+    const profile_t  *profile;
+    history_block_t  *blocks;
+    history_block_t  *cur;
+    uint32_t          nextSeq;
+    uint64_t          lastMs;       // Time of the last record in cur.
+    //
+    // Per profile slot: the previous integer value and the block it was recorded in.
+    //
+    int64_t          *lastValue;
+    uint32_t         *lastBlock;
+    history_str_t     strs[HISTORY_STR_SLOTS];
+    //
+    // The local interface.
+    //
+    struct evconnlistener *listener;
+    struct event          *dumpSignal;
+    pthread_t              dumpThread;
+    int                    dumpStarted;   // dumpThread has yet to be joined.
+    int                    dumpRunning;   // And is still writing. Atomic.
+    //
+    // Statistics.
+    //
+    uint64_t          records;
+    uint64_t          bytes;        // Encoded, including blocks since recycled.
+    uint64_t          rawBytes;     // What the values alone would have taken.
+    uint32_t          strRefs;      // Strings stored as a reference to an earlier copy.
+    uint32_t          recycled;     // Blocks dropped to make room.
+    uint32_t          truncated;    // Values too big for a block, cut short.
+} history_t;
+
+//
+// Allocate the history and start listening on HISTORY_SOCKET_PATH. The socket is
+// optional; if it can't be set up the history still records. Returns -1 only if the
+// memory can't be had.
+//
+int history_init(history_t *h, struct event_base *base, const profile_t *p);
+
+void history_free(history_t *h);
+
+//
+// Record a value. dir is HISTORY_IN or HISTORY_OUT.
+//
+void history_record(history_t *h, int dir, uint16_t attrId, const void *value, uint16_t len);
+
+//
+// Write the records for attrId (-1 for all) between fromMs and toMs, in ms since the
+// epoch, inclusive, one line each. Returns how many were written.
+//
+uint32_t history_query(history_t *h, FILE *out, int attrId, uint64_t fromMs, uint64_t toMs);
+
+void history_log_stats(const history_t *h);
+
+#endif // HISTORY_H
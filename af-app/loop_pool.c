@@ -0,0 +1,98 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Event loops for gateway mode. See loop_pool.h.
+*/
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <event2/event.h>
+
+#include "af_log.h"
+#include "loop_pool.h"
+
+static void *loop_pool_thread(void *arg)
+{
+    struct event_base *base = (struct event_base *)arg;
+    sigset_t all;
+
+    //
+    // Signals are loop 0's business.
+    //
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY);
+    return NULL;
+}
+
+//
+// Run on the loop itself, so it can't be missed: a loopbreak from outside before the
+// thread has got into event_base_loop() is forgotten once it does.
+//
+static void loop_pool_break_cb(evutil_socket_t fd, short what, void *arg)
+{
+    event_base_loopbreak((struct event_base *)arg);
+}
+
+int loop_pool_init(loop_pool_t *lp, struct event_base *main, unsigned count)
+{
+    memset(lp, 0, sizeof(*lp));
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > LOOP_POOL_MAX) {
+        count = LOOP_POOL_MAX;
+    }
+    lp->bases[0] = main;
+    for (lp->count = 1; lp->count < count; lp->count++) {
+        lp->bases[lp->count] = event_base_new();
+        if (lp->bases[lp->count] == NULL) {
+            AFLOG_ERR("my-app: loops: can't allocate event base %u", lp->count);
+            loop_pool_free(lp);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int loop_pool_start(loop_pool_t *lp)
+{
+    for (lp->running = 1; lp->running < lp->count; lp->running++) {
+        if (pthread_create(&lp->threads[lp->running], NULL, loop_pool_thread,
+                           lp->bases[lp->running]) != 0) {
+            AFLOG_ERR("my-app: loops: can't start loop %u", lp->running);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void loop_pool_stop(loop_pool_t *lp)
+{
+    struct timeval now = { 0, 0 };
+    unsigned i;
+
+    for (i = 1; i < lp->running; i++) {
+        if (event_base_once(lp->bases[i], -1, EV_TIMEOUT, loop_pool_break_cb, lp->bases[i], &now) != 0) {
+            AFLOG_ERR("my-app: loops: can't queue a stop for loop %u", i);
+            event_base_loopbreak(lp->bases[i]);  // Works if it's running already.
+        }
+    }
+    for (i = 1; i < lp->running; i++) {
+        pthread_join(lp->threads[i], NULL);
+    }
+    lp->running = 1;
+}
+
+void loop_pool_free(loop_pool_t *lp)
+{
+    unsigned i;
+
+    loop_pool_stop(lp);
+    for (i = 1; i < lp->count; i++) {
+        if (lp->bases[i]) {
+            event_base_free(lp->bases[i]);
+            lp->bases[i] = NULL;
+        }
+    }
+    lp->count = 1;
+}
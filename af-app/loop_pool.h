@@ -0,0 +1,55 @@
+/**
+   Copyright 2019 Afero, Inc.
+   A small pool of event loops for gateway mode.
+
+   One event loop keeps up with a good many virtual devices, since each one is idle most
+   of the time. When one core isn't enough, the devices are spread over a few loops,
+   each running on its own thread. Loop 0 is the app's own sEventBase, run by main() as
+   always; it keeps the signals, the systemd watchdog and everything else that belongs to
+   the process. The others only ever run device events.
+
+   A device lives on one loop for good, so nothing a device owns needs locking. Only what
+   the devices share does.
+*/
+#ifndef LOOP_POOL_H
+#define LOOP_POOL_H
+
+#include <pthread.h>
+#include <event2/event.h>
+
+#define LOOP_POOL_MAX   16
+
+typedef struct {
+    unsigned            count;
+    unsigned            running;          // Threads started.
+    struct event_base  *bases[LOOP_POOL_MAX];
+    pthread_t           threads[LOOP_POOL_MAX];
+} loop_pool_t;
+
+//
+// Loop 0 is main; count - 1 more bases are created. Returns -1 if they can't be.
+//
+int loop_pool_init(loop_pool_t *lp, struct event_base *main, unsigned count);
+
+//
+// Start a thread for every loop but 0. Devices should be set up on their loops first.
+//
+int loop_pool_start(loop_pool_t *lp);
+
+//
+// Stop the threads and wait for them, even ones that have only just been started. Loop 0
+// is left alone; stop it the usual way.
+//
+void loop_pool_stop(loop_pool_t *lp);
+
+//
+// Free the bases loop_pool_init() created, after everything on them has been freed.
+//
+void loop_pool_free(loop_pool_t *lp);
+
+static inline struct event_base *loop_pool_base(const loop_pool_t *lp, unsigned i)
+{
+    return lp->bases[i % lp->count];
+}
+
+#endif // LOOP_POOL_H
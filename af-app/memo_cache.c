@@ -0,0 +1,218 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Memoization cache for the pure transform handlers. See memo_cache.h.
+*/
+#include <stdint.h>
+#include <string.h>
+
+#include "af_log.h"
+#include "memo_cache.h"
+
+#define MEMO_K1  0x9e3779b97f4a7c15ULL
+#define MEMO_K2  0xbf58476d1ce4e5b9ULL
+#define MEMO_K3  0x94d049bb133111ebULL
+#define MEMO_K4  0xd6e8feb86659fd93ULL   // Seed for the check hash.
+
+static inline uint64_t memo_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+//
+// Eight bytes per round, then a splitmix64 style finalizer so that short inputs
+// (most of ours are 1 to 4 bytes) still spread over all the sets.
+//
+static uint64_t memo_hash_seeded(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t h = seed ^ ((uint64_t)len * MEMO_K2);
+    uint64_t k;
+
+    while (len >= 8) {
+        memcpy(&k, p, 8);  // Unaligned-safe load; the compiler turns it into a single move.
+        h ^= memo_rotl(k * MEMO_K2, 31) * MEMO_K3;
+        h = memo_rotl(h, 27) * MEMO_K1;
+        p += 8;
+        len -= 8;
+    }
+    k = 0;
+    if (len) {
+        memcpy(&k, p, len);
+        h ^= memo_rotl(k * MEMO_K2, 31) * MEMO_K3;
+    }
+
+    h ^= h >> 30;
+    h *= MEMO_K2;
+    h ^= h >> 27;
+    h *= MEMO_K3;
+    h ^= h >> 31;
+    return h;
+}
+
+uint64_t memo_hash(const void *data, size_t len)
+{
+    return memo_hash_seeded(data, len, MEMO_K1);
+}
+
+void memo_key(memo_key_t *key, const void *data, size_t len)
+{
+    key->hash  = memo_hash(data, len);
+    key->check = 0;
+    if (len <= sizeof(key->check)) {
+        memcpy(&key->check, data, len);
+    }
+    else {
+        key->check = memo_hash_seeded(data, len, MEMO_K4);
+    }
+}
+
+static inline int memo_key_equal(const memo_key_t *a, const memo_key_t *b)
+{
+    return a->hash == b->hash && a->check == b->check;
+}
+
+void memo_cache_init(memo_cache_t *mc)
+{
+    memset(mc, 0, sizeof(*mc));
+}
+
+static inline memo_entry_t *memo_set_for(memo_cache_t *mc, uint16_t attrId, const memo_key_t *inKey)
+{
+    return mc->sets[(inKey->hash ^ attrId) & (MEMO_CACHE_SETS - 1)];
+}
+
+const memo_entry_t *memo_cache_lookup(memo_cache_t *mc, uint16_t attrId,
+                                      const uint8_t *in, uint16_t inLen, memo_key_t *inKey)
+{
+    memo_entry_t *set;
+    int way;
+
+    memo_key(inKey, in, inLen);
+    set = memo_set_for(mc, attrId, inKey);
+
+    mc->lookups++;
+    for (way = 0; way < MEMO_CACHE_WAYS; way++) {
+        if (set[way].attrId == attrId && set[way].inLen == inLen && memo_key_equal(&set[way].inKey, inKey)) {
+            set[way].lastUsed = ++mc->tick;
+            mc->hits++;
+            return &set[way];
+        }
+    }
+    return NULL;
+}
+
+void memo_cache_store(memo_cache_t *mc, uint16_t attrId, uint16_t inLen, const memo_key_t *inKey,
+                      const uint8_t *out, uint16_t outLen)
+{
+    memo_entry_t *set = memo_set_for(mc, attrId, inKey);
+    memo_entry_t *victim = &set[0];
+    int way;
+
+    //
+    // Reuse the way if this input is already there, otherwise take an empty way,
+    // otherwise evict the least recently used one.
+    //
+    for (way = 0; way < MEMO_CACHE_WAYS; way++) {
+        if (set[way].attrId == attrId && set[way].inLen == inLen && memo_key_equal(&set[way].inKey, inKey)) {
+            victim = &set[way];
+            break;
+        }
+        if (set[way].attrId == 0) {
+            victim = &set[way];
+            break;
+        }
+        if (set[way].lastUsed < victim->lastUsed) {
+            victim = &set[way];
+        }
+    }
+
+    victim->attrId   = attrId;
+    victim->inLen    = inLen;
+    victim->inKey    = *inKey;
+    victim->outLen   = outLen;
+    memo_key(&victim->outKey, out, outLen);
+    victim->lastUsed = ++mc->tick;
+    if (outLen <= MEMO_INLINE_MAX) {
+        memcpy(victim->out, out, outLen);
+    }
+}
+
+static memo_published_t *memo_published_slot(memo_cache_t *mc, uint16_t outAttrId, int create)
+{
+    int i;
+
+    for (i = 0; i < MEMO_PUBLISHED_SLOTS; i++) {
+        if (mc->published[i].attrId == outAttrId) {
+            return &mc->published[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    for (i = 0; i < MEMO_PUBLISHED_SLOTS; i++) {
+        if (mc->published[i].attrId == 0) {
+            mc->published[i].attrId = outAttrId;
+            return &mc->published[i];
+        }
+    }
+    //
+    // Out of slots. Not fatal, we just won't be able to skip sets for this attribute.
+    //
+    AFLOG_WARNING("my-app: memo: no published slot for attrId=%d", outAttrId);
+    return NULL;
+}
+
+int memo_published_matches_key(memo_cache_t *mc, uint16_t outAttrId, uint16_t len, const memo_key_t *key)
+{
+    memo_published_t *slot = memo_published_slot(mc, outAttrId, 0);
+
+    if (slot == NULL || slot->len != len || !memo_key_equal(&slot->key, key)) {
+        return 0;
+    }
+    mc->setsSkipped++;
+    return 1;
+}
+
+int memo_published_matches(memo_cache_t *mc, uint16_t outAttrId, const uint8_t *value, uint16_t len)
+{
+    memo_key_t key;
+
+    memo_key(&key, value, len);
+    return memo_published_matches_key(mc, outAttrId, len, &key);
+}
+
+void memo_note_published_key(memo_cache_t *mc, uint16_t outAttrId, uint16_t len, const memo_key_t *key)
+{
+    memo_published_t *slot = memo_published_slot(mc, outAttrId, 1);
+
+    if (slot != NULL) {
+        slot->len = len;
+        slot->key = *key;
+    }
+}
+
+void memo_note_published(memo_cache_t *mc, uint16_t outAttrId, const uint8_t *value, uint16_t len)
+{
+    memo_key_t key;
+
+    memo_key(&key, value, len);
+    memo_note_published_key(mc, outAttrId, len, &key);
+}
+
+void memo_forget_published(memo_cache_t *mc, uint16_t outAttrId)
+{
+    memo_published_t *slot = memo_published_slot(mc, outAttrId, 0);
+
+    if (slot != NULL) {
+        memset(slot, 0, sizeof(*slot));
+        slot->attrId = outAttrId;
+    }
+}
+
+void memo_cache_log_stats(const memo_cache_t *mc)
+{
+    uint32_t pct = mc->lookups ? (uint32_t)(((uint64_t)mc->hits * 100) / mc->lookups) : 0;
+
+    AFLOG_INFO("my-app: memo: lookups=%u hits=%u (%u%%) sets_skipped=%u",
+               mc->lookups, mc->hits, pct, mc->setsSkipped);
+}
@@ -0,0 +1,126 @@
+/**
+   Copyright 2019 Afero, Inc.
+   A small, fixed-size memoization cache for the transform handlers in my_app.c.
+
+   AF_GETDOUBLED, AF_GETROTATED, AF_COUNTBITSOFTHIS and AF_GETREVERSED are pure
+   functions of the value the Cloud sends us. Cloud retries and mobile app refreshes
+   very often resend exactly the same value, so we remember what we computed the last
+   few times, keyed by (attribute ID, hash of the payload), and we also remember what we
+   last published for each output attribute. That lets a handler skip both the
+   computation and the outbound af_lib_set_attribute_* call when nothing would change.
+
+   Nothing but keys are compared, never the payloads themselves, so a key has to tell
+   values apart. A memo_key_t is a 64-bit hash plus a check word: for values of up to
+   eight bytes the check word is the value itself, so those keys are exact; for longer
+   ones it is a second hash with a different seed. Two different long strings would
+   have to collide in both to be mistaken for each other, about one chance in 2^128.
+*/
+#ifndef MEMO_CACHE_H
+#define MEMO_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Geometry of the cache. 16 sets of 4 ways is 64 entries, which is plenty for a
+// handful of transform attributes and keeps the whole thing around 4KB.
+//
+#define MEMO_CACHE_SETS        16   // Must be a power of two.
+#define MEMO_CACHE_WAYS        4
+//
+// Outputs up to this many bytes are kept in the entry itself (two uint32_t's for the
+// rotate handler is the biggest). Larger outputs, like the 1536 byte reversed string,
+// only keep their key. For those a hit still saves the outbound set when the value is
+// already published, which is where the real cost is.
+//
+#define MEMO_INLINE_MAX        8
+//
+// Number of output attributes whose last published value we track.
+//
+#define MEMO_PUBLISHED_SLOTS   16
+
+//
+// What the cache knows a value by. See above.
+//
+typedef struct {
+    uint64_t hash;                   // memo_hash() of the value. Picks the set.
+    uint64_t check;                  // The value itself up to 8 bytes, else a second hash.
+} memo_key_t;
+
+typedef struct {
+    memo_key_t inKey;                // Key of the input payload.
+    memo_key_t outKey;               // Key of the output, whether or not it is inline.
+    uint32_t lastUsed;               // Tick of the last hit or store, for LRU replacement.
+    uint16_t attrId;                 // Input attribute ID. Zero means the way is empty.
+    uint16_t inLen;                  // Length of the input payload.
+    uint16_t outLen;                 // Length of the output.
+    uint8_t  out[MEMO_INLINE_MAX];   // The output itself when outLen <= MEMO_INLINE_MAX.
+} memo_entry_t;
+
+typedef struct {
+    uint16_t   attrId;               // Output attribute ID. Zero means the slot is empty.
+    uint16_t   len;                  // Length of the value we last published.
+    memo_key_t key;                  // Key of the value we last published.
+} memo_published_t;
+
+typedef struct {
+    memo_entry_t     sets[MEMO_CACHE_SETS][MEMO_CACHE_WAYS];
+    memo_published_t published[MEMO_PUBLISHED_SLOTS];
+    uint32_t tick;
+    //
+    // Statistics, reported with memo_cache_log_stats() when the app stops.
+    //
+    uint32_t lookups;
+    uint32_t hits;
+    uint32_t setsSkipped;            // Outbound sets skipped because the value was already published.
+} memo_cache_t;
+
+//
+// Fast 64-bit hash, eight bytes at a time. Not cryptographic, just well mixed.
+//
+uint64_t memo_hash(const void *data, size_t len);
+
+//
+// The key for a value.
+//
+void memo_key(memo_key_t *key, const void *data, size_t len);
+
+void memo_cache_init(memo_cache_t *mc);
+
+//
+// Look up the output for attrId/in/inLen. The key of the input is always returned in
+// *inKey so the caller can hand it back to memo_cache_store() on a miss without hashing
+// the payload twice. Returns NULL on a miss.
+//
+const memo_entry_t *memo_cache_lookup(memo_cache_t *mc, uint16_t attrId,
+                                      const uint8_t *in, uint16_t inLen, memo_key_t *inKey);
+
+//
+// Remember the output computed for an input. Outputs larger than MEMO_INLINE_MAX only
+// have their key remembered.
+//
+void memo_cache_store(memo_cache_t *mc, uint16_t attrId, uint16_t inLen, const memo_key_t *inKey,
+                      const uint8_t *out, uint16_t outLen);
+
+//
+// Returns 1 if the given value is what we last successfully published for outAttrId.
+// Counts a skipped set when it does. The _key variant takes memo_key() of the value,
+// which for large outputs is already sitting in the memo_entry_t.
+//
+int memo_published_matches(memo_cache_t *mc, uint16_t outAttrId, const uint8_t *value, uint16_t len);
+int memo_published_matches_key(memo_cache_t *mc, uint16_t outAttrId, uint16_t len, const memo_key_t *key);
+
+//
+// Record a value we successfully published for outAttrId.
+//
+void memo_note_published(memo_cache_t *mc, uint16_t outAttrId, const uint8_t *value, uint16_t len);
+void memo_note_published_key(memo_cache_t *mc, uint16_t outAttrId, uint16_t len, const memo_key_t *key);
+
+//
+// Forget what we published for outAttrId, e.g. when a set for it failed.
+//
+void memo_forget_published(memo_cache_t *mc, uint16_t outAttrId);
+
+void memo_cache_log_stats(const memo_cache_t *mc);
+
+#endif // MEMO_CACHE_H
@@ -27,6 +27,11 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 //
 // And of course, the includes that are Afero specific:
@@ -48,10 +53,80 @@
 // the UI layout or the UI elements used.
 // The file only denotes a few key items such as data sizes, data types, and attribute ID-to-name mappings.
 //
+// You no longer have to rebuild the app every time the profile changes, though. The handlers below
+// are bound at startup to the attribute IDs in a compiled copy of device-description.json (see
+// profilec.py), matched up by the names you gave the attributes. device-description.h is still
+// used for the size of our buffers and as the builtin profile when no compiled one is installed.
+//
 #include "device-description.h" 
+#include "profile.h"
+#include "app_attrs.h"
+//
+// Remembers what the transform handlers computed and published so that repeated
+// values from the Cloud don't cost us a recomputation and another trip to the Cloud.
+//
+#include "memo_cache.h"
+//
+// Follows every set we send to the Cloud until the ASR says it landed. See set_tracker.h.
+//
+#include "set_tracker.h"
+//
+// Running totals and windowed sums, averages, minimums, maximums, counts and rates of
+// numeric attributes, set up in the device profile. See window_agg.h.
+//
+#include "window_agg.h"
+//
+// Readiness and watchdog keepalives for systemd, and how long startup took. See service.h.
+//
+#include "service.h"
+//
+// A copy of our attributes in shared memory for other processes on the gateway to read.
+// See attr_mirror.h.
+//
+#include "attr_mirror.h"
+//
+// Events from af_lib wait here and are handled most urgent first. See event_queue.h.
+//
+#include "event_queue.h"
+//
+// Every attribute value in and out, with timestamps, for when something goes wrong in
+// the field. See history.h.
+//
+#include "history.h"
+//
+// Static probes and, built with APP_TRACE_RING, a ring of recent trace events dumped
+// for chrome://tracing on SIGUSR2, following each event through the app. See trace.h.
+//
+#include "trace.h"
+//
+// Gateway mode: many virtual devices in one process, each talking to a simulated ASR,
+// spread over a few event loops. See fake_asr.h and loop_pool.h. READY=1 and the time
+// to first attribute are device 0's alone; see service.h.
+//
+#include "asr_link.h"
+#include "fake_asr.h"
+#include "loop_pool.h"
+//
+// Reading and writing files without holding up the event loop. See file_io.h.
+//
+#include "file_io.h"
 
 af_lib_t          *sAf_lib    = NULL;  // Handle used to get and set attributes in the Afero library.
 struct event_base *sEventBase = NULL;  // Event base for the event handler and callback.
+profile_t          sProfile;           // The device profile, mapped at startup.
+app_attrs_t        sAttrs;             // Our handlers bound to the attribute IDs in sProfile.
+service_t          sService;           // Our side of the systemd unit.
+attr_mirror_t      sMirror;            // Current attribute values for local readers.
+history_t          sHistory;           // Recent attribute values, in and out.
+asr_link_aflib_t   sAfLink;            // The way to the real ASR, through sAf_lib.
+loop_pool_t        sLoops;             // Event loops; just sEventBase unless there are virtual devices.
+file_io_t          sIo[LOOP_POOL_MAX]; // File I/O, one for each event loop.
+unsigned           sIoCount;
+
+//
+// Shorthand for the attribute ID a role is bound to. As cheap as the old AF_ #defines.
+//
+#define ATTR_ID(role)  APP_ATTR_ID(&sAttrs, role)
 
 
 
@@ -70,33 +145,340 @@ struct event_base *sEventBase = NULL;  // Event base for the event handler and c
 //#define DEBUG_ROTATES 1     // Comment out to disble logging successes.
 //#define DEBUG_BIT_COUNTS 1
 
-uint16_t  getdoubled     = 0; // Value that will get doubled, given to me by the Cloud.
-uint32_t  doubled        = 0; // Value that will get pushed back to the Cloud and where the doubling is deposited.
-uint32_t  getrotated     = 0; // Value that will get rotated right, given to us by the Cloud.
-uint32_t  rotate         = 0; // Value to be rotated, which was given to us by the Cloud, goes here.
-uint32_t  rotatedr       = 0; // Rotated right value goes here, and then gets sent to the Cloud.
-uint32_t  rotatedl       = 0; // Rotated left value goes here, and then gets sent to the Cloud.
-uint8_t   getadded       = 0; // Added to a running sum value. Comes from the Cloud.
-uint32_t  currentsum     = 0; // Current summation value that's sent back to the Cloud. Running sum
-uint8_t   readvarlog     = 0; // Used as a bool. Set by the Cloud. Response is to read var log and send last line.
-uint32_t countbitsofthis = 0; // 32-bit integer from the Cloud goes here. We will count how many of the bits in the value are set to '1'.
-uint8_t  numberofbits    = 0; // Result of counting bits in countbitsofthis. This gets sent to the Cloud.
-unsigned char lastlineofvarlog[1536]; // Big ole string buffer to respond with.
-unsigned char getreversed[1536]; // String sent to us from the Cloud. Must be reversed and sent back.
-unsigned char reversed[1536];    // Reversed string that is then sent back to the Cloud.
+//
+// Everything that belongs to one device. Normally there's just the one, the device on
+// this board, talking to the real ASR through af_lib. In gateway mode (-n) there are
+// many virtual devices instead, each with a simulated ASR of its own (see fake_asr.h),
+// so every piece of state a handler touches lives in here rather than in a global.
+// What the devices can share, like the profile and its bindings in sAttrs, stays global.
+//
+typedef struct {
+    unsigned       index;          // Which device, 0 being the first.
+    asr_link_t    *link;           // Where sets and set responses go. See asr_link.h.
+    memo_cache_t   memo;           // Memoization cache for the pure transform handlers.
+    set_tracker_t  sets;           // Outbound sets that haven't been confirmed yet.
+    agg_engine_t   agg;            // The profile's aggregates, AF_CURRENTSUM among them.
+    event_queue_t  events;         // Events waiting to be handled.
+    history_t     *history;        // Recent attribute values, or NULL. Only the real device keeps them.
+    attr_mirror_t *mirror;         // Current attribute values for local readers, or NULL. Likewise.
+    file_io_t     *io;             // File I/O on the device's event loop.
+    fake_asr_t     fake;           // The simulated ASR, for virtual devices.
+    uint16_t  getdoubled;          // Value that will get doubled, given to me by the Cloud.
+    uint32_t  doubled;             // Value that will get pushed back to the Cloud and where the doubling is deposited.
+    uint32_t  getrotated;          // Value that will get rotated right, given to us by the Cloud.
+    uint32_t  rotatedr;            // Rotated right value goes here, and then gets sent to the Cloud.
+    uint32_t  rotatedl;            // Rotated left value goes here, and then gets sent to the Cloud.
+    uint8_t   getadded;            // Added to a running sum value. Comes from the Cloud.
+    uint8_t   readvarlog;          // Used as a bool. Set by the Cloud. Response is to read var log and send last line.
+    uint32_t  countbitsofthis;     // 32-bit integer from the Cloud goes here. We will count how many of the bits in the value are set to '1'.
+    uint8_t   numberofbits;        // Result of counting bits in countbitsofthis. This gets sent to the Cloud.
+} app_t;
+
+app_t    *sApps;      // All our devices. sApps[0] is the real one unless we're a gateway.
+unsigned  sAppCount;
+
+//
+// The big string buffers aren't kept per device. A handler runs start to finish on one
+// event loop, so the devices on a loop can take turns with the same ones; each loop
+// thread gets its own copy.
+//
+static __thread unsigned char getreversed[1536]; // String sent to us from the Cloud. Must be reversed and sent back.
+static __thread unsigned char reversed[1536];    // Reversed string that is then sent back to the Cloud.
 unsigned char default_string[50]="HEY! You forgot something!"; // Replaces a null string.
 
 //
-// I need a file handle as well since one of the things I do is read a line out of /var/log/messages
-// as an action in response to an attribute setting.
+// I need to read a line out of /var/log/messages as an action in response to an attribute
+// setting. There's only one /var/log/messages however many devices we are, so its last line
+// is shared too, and looked at by one loop at a time.
+//
+#define VARLOG_PATH      "/var/log/messages"
+#define VARLOG_CHUNK     4096   // Read this much at a time,
+#define VARLOG_BATCH     4      // this many chunks at once.
+#define VARLOG_LINE_MAX  1023   // Longest last line we keep, as fgets() with 1024 used to.
+
+uint64_t sVarLogOffset = 0;  // Where the last line of /var/log/messages started the last time we looked.
+unsigned char lastlineofvarlog[1536]; // Big ole string buffer to respond with.
+pthread_mutex_t sVarLogLock = PTHREAD_MUTEX_INITIALIZER; // Hold it while using any of the above.
+
+//
+// The log can be big and the disk slow, so it isn't read on the spot with stdio any more.
+// A scan reads it through the device's file_io_t (see file_io.h), VARLOG_BATCH chunks at a
+// time for the price of one system call, and the event loop gets on with other events
+// while they're on their way.
+//
+typedef struct {
+    app_t         *app;         // Who the line gets published for, or NULL to just find it.
+    file_io_t     *io;
+    int            fd;
+    uint64_t       size;        // How long the log was when we started.
+    uint64_t       pos;         // Where the next batch starts.
+    uint64_t       lineStart;   // Where the latest line we've seen starts.
+    uint64_t       chunkStart;  // Where what's in the last chunk came from.
+    uint32_t       chunkLen;
+    unsigned       last;        // Which chunk that is.
+    unsigned       batch;       // Chunks in this batch,
+    unsigned       pending;     // and the ones still being read.
+    file_io_req_t  req[VARLOG_BATCH];
+    char           chunk[VARLOG_BATCH][VARLOG_CHUNK];
+} varlog_scan_t;
+
+static int publish(app_t *app, uint16_t attrId, set_kind_t kind, const void *value, uint16_t len); // Further down.
+
+//
+// Send the last line we know of to the Cloud for a device.
+//
+static void publishLastLineOfVarLog(app_t *app)
+{
+  int ret;
+  size_t index;
+
+    pthread_mutex_lock(&sVarLogLock); // Other loops' devices may be rummaging too.
+    AFLOG_INFO("my-app: REQUEST: Last line %s\n", lastlineofvarlog); // This is just a log... you can remove it.
+    index = strlen( (char *)lastlineofvarlog );
+    ret = publish(app, ATTR_ID(APP_ATTR_LASTLINEOFVARLOG), SET_KIND_STR, lastlineofvarlog, index);
+    if (ret != AF_SUCCESS) {
+      AFLOG_ERR("my-app: REQUEST:af_lib_set_attribute: failed set for the test attributeId=AF_LASTLINEOFVARLOG");
+    }
+    else {
+      AFLOG_INFO("my-app: set attribute id LASTLINEOFVARLOG succeeded. set to %s",lastlineofvarlog);
+    }
+    pthread_mutex_unlock(&sVarLogLock);
+}
+
+static void varLogScanDone(varlog_scan_t *scan)
+{
+    if (scan->fd >= 0) {
+        close(scan->fd);
+    }
+    if (scan->app != NULL) {
+        publishLastLineOfVarLog(scan->app);
+    }
+    free(scan);
+}
+
+//
+// The scan found the last line; keep it for everyone.
+//
+static void varLogKeepLine(varlog_scan_t *scan, const char *line, uint32_t len)
+{
+    if (len > 0) {
+        pthread_mutex_lock(&sVarLogLock);
+        memcpy(lastlineofvarlog, line, len);
+        lastlineofvarlog[len] = '\0';
+        sVarLogOffset = scan->lineStart;  // Just remember where the latest line started.
+        pthread_mutex_unlock(&sVarLogLock);
+    }
+    varLogScanDone(scan);
+}
+
+static void varLogLineRead(file_io_req_t *req, void *ctx)
+{
+    varlog_scan_t *scan = (varlog_scan_t *)ctx;
+
+    varLogKeepLine(scan, scan->chunk[0], req->result > 0 ? (uint32_t)req->result : 0);
+}
+
+static void varLogChunkRead(file_io_req_t *req, void *ctx);
+
+//
+// Read the next batch of chunks or, once we're at the end, the last line. Usually the
+// last line is already in the last chunk and doesn't have to be read again.
+//
+static void varLogScanNext(varlog_scan_t *scan)
+{
+    uint64_t left;
+    uint64_t at;
+    uint32_t len;
+    unsigned i;
+
+    if (scan->pos < scan->size) {
+        for (i = 0, at = scan->pos; i < VARLOG_BATCH && at < scan->size; i++, at += len) {
+            left = scan->size - at;
+            len  = left < VARLOG_CHUNK ? (uint32_t)left : VARLOG_CHUNK;
+            if (file_io_read(scan->io, &scan->req[i], scan->fd, scan->chunk[i], len, at,
+                             varLogChunkRead, scan) != 0) {
+                break;
+            }
+            scan->batch++;
+            scan->pending++;
+        }
+        if (scan->batch > 0) {
+            return;
+        }
+    }
+    else {
+        left = scan->size - scan->lineStart;
+        len  = left < VARLOG_LINE_MAX ? (uint32_t)left : VARLOG_LINE_MAX;
+        if (scan->lineStart >= scan->chunkStart && scan->lineStart + len <= scan->chunkStart + scan->chunkLen) {
+            varLogKeepLine(scan, scan->chunk[scan->last] + (scan->lineStart - scan->chunkStart), len);
+            return;
+        }
+        if (file_io_read(scan->io, &scan->req[0], scan->fd, scan->chunk[0], len, scan->lineStart,
+                         varLogLineRead, scan) == 0) {
+            return;
+        }
+    }
+    AFLOG_WARNING("my-app: can't read %s right now; keeping the last line we had", VARLOG_PATH);
+    varLogScanDone(scan);
+}
+
+//
+// The chunks of a batch can come back in any order. Once they're all in, look through
+// them in order for where lines start.
+//
+static void varLogChunkRead(file_io_req_t *req, void *ctx)
+{
+    varlog_scan_t *scan = (varlog_scan_t *)ctx;
+    unsigned batch = scan->batch;
+    unsigned i;
+    int32_t j;
+
+    if (--scan->pending > 0) {
+        return;
+    }
+    scan->batch = 0;
+    for (i = 0; i < batch; i++) {
+        req = &scan->req[i];
+        if (req->result <= 0 || req->offset != scan->pos) {
+            varLogScanDone(scan); // Read error, or the log shrank under us. Keep whatever line we had.
+            return;
+        }
+        for (j = 0; j < req->result; j++) {
+            if (scan->chunk[i][j] == '\n' && scan->pos + j + 1 < scan->size) {
+                scan->lineStart = scan->pos + j + 1;
+            }
+        }
+        scan->chunkStart = scan->pos;
+        scan->chunkLen   = (uint32_t)req->result;
+        scan->last       = i;
+        scan->pos       += (uint64_t)req->result;
+    }
+    varLogScanNext(scan);
+}
+
+//
+// Find the last line of /var/log/messages, leave it in lastlineofvarlog and, if app isn't
+// NULL, publish it for app. Rather than reading the whole log every time, start from where
+// the last line was the last time we looked; only what was logged since has to be read. If
+// the log got shorter it was rotated and we start over from the top.
 //
+static void readLastLineOfVarLog(file_io_t *io, app_t *app)
+{
+  varlog_scan_t *scan = (varlog_scan_t *)malloc(sizeof(*scan));
+  struct stat st;
+
+    if( scan == NULL ) {
+      if( app != NULL ) {
+        publishLastLineOfVarLog(app);
+      }
+      return;
+    }
+    memset(scan, 0, sizeof(*scan));
+    scan->app = app;
+    scan->io  = io;
+    scan->fd  = open(VARLOG_PATH, O_RDONLY | O_CLOEXEC);
+    if( scan->fd < 0 || fstat(scan->fd, &st) != 0 ) {
+      varLogScanDone(scan); // Nothing to rummage through. Keep whatever line we had.
+      return;
+    }
+    scan->size = (uint64_t)st.st_size;
+    pthread_mutex_lock(&sVarLogLock);
+    scan->pos = sVarLogOffset;
+    pthread_mutex_unlock(&sVarLogLock);
+    if( scan->size < scan->pos ) {
+      scan->pos = 0;
+    }
+    scan->lineStart = scan->pos;
+    varLogScanNext(scan);
+}
 
-FILE *sync;  // Just a file pointer to use to rummage through /var/log/messages.
+//
+// Run after we've told systemd we're ready: the first scan of /var/log/messages reads
+// the whole thing, and nobody needs the answer until AF_READVARLOG is set.
+//
+static void warmVarLog(void *arg)
+{
+    readLastLineOfVarLog(&sIo[0], NULL);
+}
 
 
 //
-// This callback is executed any time ASR has information for the MCU.
-// The name of this event is defined in the afLib initialization in setup().
+// Keep local readers and the history up to date with a value that came in or went out.
+//
+static void noteAttribute(app_t *app, int dir, uint16_t attrId, const void *value, uint16_t len)
+{
+    if (app->history) {
+        history_record(app->history, dir, attrId, value, len);
+    }
+    if (app->mirror) {
+        attr_mirror_write(app->mirror, attrId, value, len);
+    }
+}
+
+//
+// Called by the set tracker once a set we published has either landed or given up.
+// Only a value the ASR confirmed goes to local readers and the history. If it never
+// made it, neither the memo cache nor the aggregates may go on believing the Cloud has
+// the value, or the next identical result would be skipped.
+//
+// This is also where you would chain follow-up work that has to wait until the Cloud
+// really has a value: pass your own callback and context to set_tracker_submit().
+//
+static void publishDone(set_tracker_t *st, const set_handle_t *h, int status, void *ctx)
+{
+    app_t *app = (app_t *)ctx;
+
+    if (status == SET_STATUS_OK) {
+        noteAttribute(app, HISTORY_OUT, h->attrId, h->value, h->len);
+    }
+    else if (status != SET_STATUS_SUPERSEDED) {
+        memo_forget_published(&app->memo, h->attrId);
+        agg_engine_forget_published(&app->agg, h->attrId);
+    }
+}
+
+//
+// Everything we send to the Cloud goes through here. The set tracker sends it as soon as
+// there's room, follows it until the ASR_SET_RESPONSE comes back and retries it if it
+// fails. The value is recorded as published right away, so a duplicate request that
+// arrives while the set is still in flight doesn't send it again.
+//
+static int publish(app_t *app, uint16_t attrId, set_kind_t kind, const void *value, uint16_t len)
+{
+    if (set_tracker_submit(&app->sets, attrId, kind, value, len, 0, publishDone, app) == NULL) {
+        memo_forget_published(&app->memo, attrId);
+        return -1;
+    }
+    memo_note_published(&app->memo, attrId, (const uint8_t *)value, len);
+    return AF_SUCCESS;
+}
+
+//
+// The aggregate engine's way to publish. ctx is the device.
+//
+static int publishAggregate(void *ctx, uint16_t attrId, set_kind_t kind, const void *value, uint16_t len)
+{
+    return publish((app_t *)ctx, attrId, kind, value, len);
+}
+
+//
+// Every set request is answered through here, so the trace shows each answer.
+//
+static void sendSetResponse(app_t *app, uint16_t attrId, bool succeeded, uint16_t len, const uint8_t *value)
+{
+    uint64_t start = trace_now();
+
+    TRACE_PROBE(set_response__start, attrId, succeeded);
+    asr_link_set_response(app->link, attrId, succeeded, len, value);
+    TRACE_PROBE(set_response__done, attrId, succeeded);
+    trace_span(TRACE_SET_RESPONSE, start, attrId, succeeded, len);
+}
+
+
+//
+// This handler is executed any time ASR has information for the MCU.
+// af_lib hands the event to attrEventCallback() below, which queues it, and it is
+// handled here when its turn comes.
 // There are several different event types that you can receive.
 // In one instance, we have an ASR notification event for things like system level changes
 // where the RSSI of the Wi-Fi changes.
@@ -106,26 +488,30 @@ FILE *sync;  // Just a file pointer to use to rummage through /var/log/messages.
 // that event handler that we manage all the MCU attributes that we have defined with
 // the Afero Profile Editor.
 //
-void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. */
-                       const af_lib_error_t error,          /* Any error that occurred. */
-                       const uint16_t attributeId,          /* The attribute ID number that is being given to us. */
-                       const uint16_t valueLen,             /* The size in bytes of the data being given for that attribute. */
-                       const uint8_t* value) /* And the actual value of the attribute. The value needs to be cast to its correct object.*/
+static void handleAttrEvent(void *ctx,                            /* The device it's for, an app_t. */
+                            const af_lib_event_type_t eventType, /* The event type. */
+                            const af_lib_error_t error,          /* Any error that occurred. */
+                            const uint16_t attributeId,          /* The attribute ID number that is being given to us. */
+                            const uint16_t valueLen,             /* The size in bytes of the data being given for that attribute. */
+                            const uint8_t* value) /* And the actual value of the attribute. The value needs to be cast to its correct object.*/
   
 {
+    app_t *app = (app_t *)ctx;
     char hexBuf[80];
     bool set_succeeded = 1;
     uint8_t  ret; 
     int count=0; // I use this to keep track of things when moving character strings around.
     int index=0; // I use this to keep track of things when moving character strings around as well.
     unsigned char *where; // I use this to keep track of the string given to me by the Cloud when the attribute is a string. 
-    printf("AttreibutID=%d, valueLen=%d, eventType=%d, error=%d\n",attributeId,valueLen,eventType,error);
+    const memo_entry_t *memo; // Cached result for this input, if we have seen it before.
+    memo_key_t inKey;         // Key of the input, handed back to the cache when we store a new result.
+    uint32_t in32;            // The input value, widened to 32 bits without reading past valueLen.
+    uint64_t handleStart = trace_now(); // For the trace, see trace.h.
+    uint64_t computeStart;
+    app_attr_t role;
+
+    TRACE_PROBE(handle__start, eventType, attributeId);
 
-    if( attributeId == 10 ){
-      index = 5;
-      index = 0;
-    }
-  
     AFLOG_INFO("eventType=%d, error=%d, attributeId=%d, valueLen=%d",eventType, error,attributeId,valueLen);
     
     memset(hexBuf, 0, sizeof(hexBuf)); // make sure the buffer is initialized
@@ -142,6 +528,9 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
       //
         case AF_LIB_EVENT_ASR_NOTIFICATION: // Non-edge attribute notify.
             AFLOG_INFO("my-app: NOTIFICATION EVENT: for attr=%d", attributeId);
+            if (app->history) {
+                history_record(app->history, HISTORY_IN, attributeId, value, valueLen);
+            }
 
             //
             // We are interested in attribute wifi rssi (65005)
@@ -154,8 +543,16 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
             break;
 
 
+        //
+        // The ASR's answer to one of our af_lib_set_attribute_* calls. The set tracker
+        // matches it to the set it belongs to, runs its completion callback, and retries it
+        // if it failed.
+        //
         case AF_LIB_EVENT_ASR_SET_RESPONSE:
-            AFLOG_INFO("my-app: ASR_SET_RESPONSE EVENT:");
+            AFLOG_INFO("my-app: ASR_SET_RESPONSE EVENT: for attr=%d error=%d", attributeId, error);
+            TRACE_PROBE(asr_response, attributeId, error);
+            trace_instant(TRACE_ASR_RESPONSE, attributeId, eventType, error);
+            set_tracker_response(&app->sets, attributeId, error);
             break;
 
 	    //
@@ -175,14 +572,17 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
             AFLOG_INFO("my-app: MCU_SET_REQUEST EVENT: for attr=%d", attributeId);
             // 
             // As stated above, let's use a case statement on the attributeId that has been sent.
-	    // We will use the lables that the Afero Profile Editor created for us in the form of #defines
-	    // to make the code more readable. These values are defined in device-description.h file.
+	    // The attributeId is first mapped back to the role it was bound to at startup, so the
+	    // case labels stay readable no matter what IDs the profile handed out. See app_attrs.h.
 	    //
-	    switch( attributeId ){
+	    role = app_attrs_role(&sAttrs, attributeId);
+	    computeStart = trace_now();
+	    TRACE_PROBE(compute__start, attributeId, role);
+	    switch( role ){
 	      //
 	      // This attribute is doubled in value, then sent back as attribute AF_DOUBLED.
 	      //
-	    case AF_GETDOUBLED:
+	    case APP_ATTR_GETDOUBLED:
 	      //
 	      // Create a log entry so that we know we got here. 
 	      AFLOG_INFO( "my-app: SET REQUEST for attrId=AF_GETDOUBLED value was=%d",(uint32_t)*value);
@@ -190,30 +590,65 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 	      // Go ahead and say we got the data. We need to give it a variable pointer that
 	      // is usually filled with the value we got from the Cloud, but that is not necessary.
 	      //
-	      af_lib_send_set_response(sAf_lib, attributeId, set_succeeded, 1, (const uint8_t *)&getdoubled);
+	      sendSetResponse(app, attributeId, set_succeeded, 1, (const uint8_t *)&app->getdoubled);
+	      //
+	      // If we've doubled this exact value before, the answer is in the memo cache.
+	      //
+	      memo = memo_cache_lookup(&app->memo, attributeId, value, valueLen, &inKey);
+	      if (memo != NULL) {
+		memcpy(&app->doubled, memo->out, sizeof(app->doubled));
+	      }
+	      else {
+		//
+		// Here I'm taking the value given by the Cloud, which is declared as a uint8_t *, and
+		// widening it to a uint32_t and then mulitplying it by 2. Only valueLen bytes are
+		// copied, since the attribute is smaller than 32 bits and anything past it isn't ours.
+		//
+		in32 = 0;
+		memcpy(&in32, value, valueLen < sizeof(in32) ? valueLen : sizeof(in32));
+		app->doubled = in32 * 2;
+		memo_cache_store(&app->memo, attributeId, valueLen, &inKey, (const uint8_t *)&app->doubled, sizeof(app->doubled));
+	      }
 	      //
-	      // Here I'm taking the value given by the Cloud, which is declared as a uint8_t *, and I am
-	      // casting it to a uint32_t * (because that's what it actually is) and then mulitplying it by 2.
+	      // No point in telling the Cloud what it already knows.
 	      //
-	      doubled = (*(uint32_t *)value * 2);
+	      if (memo_published_matches(&app->memo, ATTR_ID(APP_ATTR_DOUBLED), (const uint8_t *)&app->doubled, sizeof(app->doubled))) {
+		AFLOG_INFO("my-app: REQUEST: AF_DOUBLED is already %d, set skipped",app->doubled);
+		break;
+	      }
 	      
-	      AFLOG_INFO( "my-app: SET REQUEST for id AF_DOUBLED to %d attempted",doubled);
-	      ret = af_lib_set_attribute_32(sAf_lib, AF_DOUBLED, doubled, AF_LIB_SET_REASON_LOCAL_CHANGE);
+	      AFLOG_INFO( "my-app: SET REQUEST for id AF_DOUBLED to %d attempted",app->doubled);
+	      ret = publish(app, ATTR_ID(APP_ATTR_DOUBLED), SET_KIND_32, &app->doubled, sizeof(app->doubled));
                if (ret != AF_SUCCESS) {
                    AFLOG_ERR("my-app: af_lib_set_attribute: failed set for the test attributeId=2");
-               }else
-		 AFLOG_INFO("my-app: REQUEST: attrib ute id AF_DOUBLED set to %d",doubled);
+               }else {
+		 AFLOG_INFO("my-app: REQUEST: attrib ute id AF_DOUBLED set to %d",app->doubled);
+	       }
 	      
 	      break;
 
-	    case AF_GETROTATED:
+	    case APP_ATTR_GETROTATED:
 	      AFLOG_INFO( "my-app: SET REQUEST for attrId=%d value was=%d",attributeId,*(uint32_t *)value);
-	      getrotated = *(uint32_t *)value; // Secure the sent data item.
-	      rotatedr = (uint32_t)getrotated >> (uint32_t)1; // Rotate the bits right by one.
-	      getrotated = *(uint32_t *)value; // Secure the sent data item.
-	      rotatedl = (uint32_t)getrotated << (uint32_t)1; // And to the left.
+	      app->getrotated = *(uint32_t *)value; // Secure the sent data item.
+	      memo = memo_cache_lookup(&app->memo, attributeId, value, valueLen, &inKey);
+	      if (memo != NULL) {
+		//
+		// Seen it before. The cache holds right and then left, back to back.
+		//
+		memcpy(&app->rotatedr, &memo->out[0], sizeof(app->rotatedr));
+		memcpy(&app->rotatedl, &memo->out[sizeof(app->rotatedr)], sizeof(app->rotatedl));
+	      }
+	      else {
+		uint8_t both[sizeof(app->rotatedr) + sizeof(app->rotatedl)];
+
+		app->rotatedr = (uint32_t)app->getrotated >> (uint32_t)1; // Rotate the bits right by one.
+		app->rotatedl = (uint32_t)app->getrotated << (uint32_t)1; // And to the left.
+		memcpy(&both[0], &app->rotatedr, sizeof(app->rotatedr));
+		memcpy(&both[sizeof(app->rotatedr)], &app->rotatedl, sizeof(app->rotatedl));
+		memo_cache_store(&app->memo, attributeId, valueLen, &inKey, both, sizeof(both));
+	      }
 	      // Then say that we received the value.
-	      af_lib_send_set_response(sAf_lib, attributeId, set_succeeded, 1,(const uint8_t *) &getrotated);
+	      sendSetResponse(app, attributeId, set_succeeded, 1,(const uint8_t *) &app->getrotated);
 	      //
 	      // Doing a name scramble here. Cloud name in the Profile Edidtor is ROTATED,
 	      //'rotate' is the copy I got from the Afero stack, and then I just 
@@ -225,21 +660,31 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 	      // NOTE: See if this results in two writes in rapid succession to the Cloud or if only the last one
 	      // happens.
 
-	      ret = af_lib_set_attribute_32(sAf_lib, AF_ROTATEDR , (uint32_t)rotatedr, AF_LIB_SET_REASON_LOCAL_CHANGE);
+	      if (memo_published_matches(&app->memo, ATTR_ID(APP_ATTR_ROTATEDR), (const uint8_t *)&app->rotatedr, sizeof(app->rotatedr))) {
+		AFLOG_INFO("my-app: REQUEST: AF_ROTATEDR is already %d, set skipped.",app->rotatedr);
+	      }
+	      else {
+	      ret = publish(app, ATTR_ID(APP_ATTR_ROTATEDR), SET_KIND_32, &app->rotatedr, sizeof(app->rotatedr));
                if (ret != AF_SUCCESS) {
                    AFLOG_ERR("my-app: REQUEST:af_lib_set_attribute: failed set for the test attributeId=AF_ROTATEDR");
                }
 	       else {
-		 AFLOG_ERR("my-app: REQUEST: set attribute id AF_ROTATEDR succeeded value = %d.",rotatedr);
+		 AFLOG_ERR("my-app: REQUEST: set attribute id AF_ROTATEDR succeeded value = %d.",app->rotatedr);
 	       }
+	      }
 		 
-	       ret = af_lib_set_attribute_32(sAf_lib, AF_ROTATEL , (uint32_t)rotatedl, AF_LIB_SET_REASON_LOCAL_CHANGE);
+	      if (memo_published_matches(&app->memo, ATTR_ID(APP_ATTR_ROTATEL), (const uint8_t *)&app->rotatedl, sizeof(app->rotatedl))) {
+		AFLOG_INFO("my-app: REQUEST: AF_ROTATEL is already %d, set skipped.",app->rotatedl);
+	      }
+	      else {
+	       ret = publish(app, ATTR_ID(APP_ATTR_ROTATEL), SET_KIND_32, &app->rotatedl, sizeof(app->rotatedl));
                if (ret != AF_SUCCESS) {
                    AFLOG_ERR("my-app: REQUEST:af_lib_set_attribute: failed set for the test attributeId=AG_ROTATEL");
                }
 	       else {
-		 AFLOG_INFO("my-app: REQUEST: set attribute id AF_ROTATEL succeeded value = %d ",rotatedl);
+		 AFLOG_INFO("my-app: REQUEST: set attribute id AF_ROTATEL succeeded value = %d ",app->rotatedl);
 	       }
+	      }
 	      break;
 
 	      //	    case AF_TOGGLELED:
@@ -247,56 +692,36 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 	      //                af_lib_send_set_response(sAf_lib, attributeId, set_succeeded, 1, (const uint8_t *)&getadded); 
 	      //	      break;
 
-	    case AF_GETADDED:
+	    case APP_ATTR_GETADDED:
 	      AFLOG_INFO( "my-app: SET REQUEST for attrId=%d value was=%d",attributeId,*(uint8_t *)value);
-	      getadded = *(uint8_t *)value; // grab the data given to us.
-                af_lib_send_set_response(sAf_lib, attributeId, set_succeeded, 1, (const uint8_t *)&getadded);
-		// Okay, let's use that value.
-		currentsum = currentsum + (uint32_t)getadded; // Keep it as a running summation.
+	      app->getadded = *(uint8_t *)value; // grab the data given to us.
+                sendSetResponse(app, attributeId, set_succeeded, 1, (const uint8_t *)&app->getadded);
 		//
-		//And send a copy to the Cloud!
+		// Okay, let's use that value. The running sum in AF_CURRENTSUM is an aggregate in
+		// the profile now, so the aggregate engine adds it up and sends a copy to the Cloud.
+		// Add more aggregates to aggregates.json and they are kept up the same way.
 		//
-		ret = af_lib_set_attribute_32(sAf_lib, AF_CURRENTSUM, (uint32_t)currentsum, AF_LIB_SET_REASON_LOCAL_CHANGE);
-               if (ret != AF_SUCCESS) {
-                   AFLOG_ERR("my-app: REQUEST:af_lib_set_attribute: failed set for the test attributeId=AF_GETADDED");
-               }
-	       else {
-		 AFLOG_INFO("my-app: REQUEST: set attribute id AF_GETADDED succeeded, set to %d.",currentsum);
-	       }
+		if (agg_engine_update(&app->agg, attributeId, value, valueLen) == 0) {
+                   AFLOG_ERR("my-app: REQUEST: the profile has no aggregate for AF_GETADDED");
+		}
 	      break;
 
-	    case AF_READVARLOG:
+	    case APP_ATTR_READVARLOG:
 	      AFLOG_INFO( "my-app: SET REQUEST for attrId=READVARLOG value was=%d",*(uint8_t *)value);
-	      readvarlog = *(uint8_t *)value;
-	      af_lib_send_set_response(sAf_lib, attributeId, set_succeeded, (const uint16_t)1, (const uint8_t *)&readvarlog); 
-		sync = fopen("/var/log/messages", "r");
-		if( sync ) { // exists! Let's rummage.
-		  while( fgets(lastlineofvarlog, 1024, sync) !=NULL ) {
-		    // Just search for the latest line, do nothing in the loop.
-		  } 
-		  AFLOG_INFO("my-app: REQUEST: Last line %s\n", lastlineofvarlog); // This is just a log... you can remove it.
-		}
-		index = strlen( lastlineofvarlog );
-		ret = af_lib_set_attribute_str( sAf_lib, AF_LASTLINEOFVARLOG, index ,(const unsigned char *)lastlineofvarlog, AF_LIB_SET_REASON_LOCAL_CHANGE);
-		if (ret != AF_SUCCESS) {
-		   AFLOG_ERR("my-app: REQUEST:af_lib_set_attribute: failed set for the test attributeId=AF_LASTLINEOFVARLOG");
-		  }
-		  else {
-		    AFLOG_INFO("my-app: set attribute id LASTLINEOFVARLOG succeeded. set to %s",lastlineofvarlog);
-		  }
-		  fclose(sync);
+	      app->readvarlog = *(uint8_t *)value;
+	      sendSetResponse(app, attributeId, set_succeeded, (const uint16_t)1, (const uint8_t *)&app->readvarlog); 
+		readLastLineOfVarLog(app->io, app); // Let's rummage. The line is published once it's been found.
 
 		break;
 
-	    case AF_GETREVERSED:
+	    case APP_ATTR_GETREVERSED:
 	      // This will take a string that is passed in by the attribute AF_GETREVERSED
 	      // and reverse the ordering of the characters in the string and then write it back
 	      // to the attribute AF_REVERSED.
 	      count=valueLen; // Get the length of the string we are working with.
 	      //
 	      // Now, if the length of the string is null, let's remind them they need to give us
-	      // something to reverse! NOTE: This code is still being debugged, so the null string
-	      // case is not currently handled correctly.
+	      // something to reverse!
 	      //
 	      if( count == 1 && value[0] == '\0' )
 		{
@@ -308,7 +733,7 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 		  // We need to let the Cloud know we got the string even if it was a zero-length string.
 		  // Respond by saying it succeeded, the data size is one byte, and point to the null character in the string.
 		  //
-		  af_lib_send_set_response(sAf_lib, attributeId, set_succeeded, 1, (const uint8_t *)getreversed);
+		  sendSetResponse(app, attributeId, set_succeeded, 1, (const uint8_t *)getreversed);
 		  //
 		  // Log a Gentle reminder that we just got a null string.
 		  //
@@ -316,7 +741,7 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 		  //
 		  // Then send the string "Hey! You forgot something!" so that it's seen that the string received was null.
 		  //
-		  ret = af_lib_set_attribute_str( sAf_lib, AF_REVERSED, strlen(default_string) ,(const unsigned char *)default_string, AF_LIB_SET_REASON_LOCAL_CHANGE);
+		  ret = publish(app, ATTR_ID(APP_ATTR_REVERSED), SET_KIND_STR, default_string, strlen(default_string));
 		  //
 		  // Then log the outcome of the send.
 		  //
@@ -324,13 +749,13 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 		    AFLOG_ERR("my-app: REQUEST:af_lib_set_attribute: failed set for the test attributeId=AF_GETREVERSED");
 		  }
 		  else {
-		    AFLOG_INFO("my-app: REQUEST: set attribute id AF_REVERSED succeeded. set to %s",reversed);
+		    AFLOG_INFO("my-app: REQUEST: set attribute id AF_REVERSED succeeded. set to %s",default_string);
 		  }
 		}
-	      else
+	      else {
 		
 	      where = value;  // And copy the address of the string being handed to us.
-	      AFLOG_INFO( "my-app: SET REQUEST for attrId=%d value was=%s",attributeId,(unsigned char *)value);
+	      AFLOG_INFO( "my-app: SET REQUEST for attrId=%d value was=%.*s",attributeId,valueLen,(const char *)value);
 	      //
 	      // Now let's get the string. Copy the number of characters we were told by
 	      // the Cloud that it delivered with "valueLen". NOTE: This count does NOT include the
@@ -340,7 +765,18 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 	      //
 	      // Then report back to the Cloud that we have received the attribute.
 	      //
-              af_lib_send_set_response(sAf_lib, attributeId, set_succeeded, 1, (const uint8_t *)getreversed);
+              sendSetResponse(app, attributeId, set_succeeded, 1, (const uint8_t *)getreversed);
+	      //
+	      // Cloud retries and app refreshes love to send the same string again. If we've reversed
+	      // this one before and AF_REVERSED still holds the result, there's nothing left to do.
+	      // Only the key of a string this big is cached, so when it isn't already published we
+	      // reverse it again below, which is cheap next to sending 1536 bytes to the Cloud.
+	      //
+	      memo = memo_cache_lookup(&app->memo, attributeId, value, valueLen, &inKey);
+	      if (memo != NULL && memo_published_matches_key(&app->memo, ATTR_ID(APP_ATTR_REVERSED), memo->outLen, &memo->outKey)) {
+		AFLOG_INFO("my-app: REQUEST: AF_REVERSED already holds this string reversed, set skipped");
+		break;
+	      }
 	      //
 	      // Get the size of the sent string again, not including the null at the end of the string.
 	      //
@@ -355,18 +791,22 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 	      //
 	      while( count )reversed[index++] = getreversed[--count];
 	      reversed[index++]='\0'; // then properly terminate the string.
+	      if (memo == NULL) {
+		memo_cache_store(&app->memo, attributeId, valueLen, &inKey, reversed, index);
+	      }
 	      // Then send the reversed string to the Cloud.
-	      ret = af_lib_set_attribute_str( sAf_lib, AF_REVERSED, index ,(const unsigned char *)reversed, AF_LIB_SET_REASON_LOCAL_CHANGE);
+	      ret = publish(app, ATTR_ID(APP_ATTR_REVERSED), SET_KIND_STR, reversed, index);
 	      if (ret != AF_SUCCESS) {
 		AFLOG_ERR("my-app: REQUEST:af_lib_set_attribute: failed set for the test attributeId=AF_GETREVERSED");
 	      }
 	      else {
 		AFLOG_INFO("my-app: REQUEST: set attribute id AF_REVERSED succeeded. set to %s",reversed);
+	      }
 	      }
 
 		break;
 
-	    case AF_COUNTBITSOFTHIS:
+	    case APP_ATTR_COUNTBITSOFTHIS:
 	      // This attribute will have the number of bits that are set to '1' counted, and then returned in the
 	      // attribute named "AF_NUMNBEROFBITS". If there is an error in setting the number of bits attribute,
 	      // an error message will be logged. An info message will be logged when it succeeds.
@@ -377,28 +817,39 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 	      // it's likely that the casting was not done correctly.
 	      AFLOG_INFO( "my-app: SET REQUEST for attrId=AF_COUNTBITSOFTHIS value was=%d",*(uint32_t *)value);
 		// Okay, let's use that value.
-	      countbitsofthis = *(uint32_t *)value; // keep it in countbitsofthis for a while...
+	      app->countbitsofthis = *(uint32_t *)value; // keep it in countbitsofthis for a while...
 	      // Let the Cloud know we got the attribute.
-              af_lib_send_set_response(sAf_lib, attributeId, set_succeeded, 1, (const uint8_t *)&countbitsofthis); 
-	      numberofbits = 0; // reset the bit counter.
+              sendSetResponse(app, attributeId, set_succeeded, 1, (const uint8_t *)&app->countbitsofthis); 
+	      memo = memo_cache_lookup(&app->memo, attributeId, value, valueLen, &inKey);
+	      if (memo != NULL) {
+		app->numberofbits = memo->out[0]; // Counted these bits before.
+	      }
+	      else {
+	      app->numberofbits = 0; // reset the bit counter.
 		//
 		// Do the count.
 		//
-		while( countbitsofthis ) // As long as it's not zero.
+		while( app->countbitsofthis ) // As long as it's not zero.
 		  {
-		    if( countbitsofthis & 1 ) numberofbits++;  // If bit one is set, then increment the counter. 
-		    countbitsofthis = countbitsofthis >> 1;    // Then rotate-right the thing we are counting bits of.
+		    if( app->countbitsofthis & 1 ) app->numberofbits++;  // If bit one is set, then increment the counter. 
+		    app->countbitsofthis = app->countbitsofthis >> 1;    // Then rotate-right the thing we are counting bits of.
 		  }
+		memo_cache_store(&app->memo, attributeId, valueLen, &inKey, &app->numberofbits, sizeof(app->numberofbits));
+	      }
+	      if (memo_published_matches(&app->memo, ATTR_ID(APP_ATTR_NUMBEROFBITS), &app->numberofbits, sizeof(app->numberofbits))) {
+		AFLOG_INFO("my-app: AF_NUMBEROFBITS is already %d, set skipped",app->numberofbits);
+		break;
+	      }
 		//
 		// And send a copy of the result to the Cloud!
 		//
-	      ret = af_lib_set_attribute_8(sAf_lib, AF_NUMBEROFBITS, numberofbits, AF_LIB_SET_REASON_LOCAL_CHANGE);
+	      ret = publish(app, ATTR_ID(APP_ATTR_NUMBEROFBITS), SET_KIND_8, &app->numberofbits, sizeof(app->numberofbits));
 	      // Then log the results to the /var/log/messages log.
 	      if (ret != AF_SUCCESS) {
                    AFLOG_ERR("my-app: failed set for the test attributeId=AF_NUMBEROFBITS");
                }
 	       else {
-		 AFLOG_INFO("my-app: set attribute id AF_NUMBEROFBITS succeeded. set to %d",numberofbits);
+		 AFLOG_INFO("my-app: set attribute id AF_NUMBEROFBITS succeeded. set to %d",app->numberofbits);
 	       }
 	      break;
 
@@ -411,11 +862,26 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 	      // processing the ones that need "something done" with them.
 	      // The rest of them are results that are sent back and displayed on the mobile app.
 	      //
+	      // Attributes that only feed aggregates in the profile don't need a handler of
+	      // their own; the aggregate engine takes the value and we accept the set.
+	      //
+	      if (agg_engine_update(&app->agg, attributeId, value, valueLen) > 0) {
+                sendSetResponse(app, attributeId, set_succeeded, valueLen, value);
+                break;
+	      }
 	      AFLOG_INFO( "my-app: MCU_SET_REQUEST EVENT UNHANDLED for attr=%d",attributeId);
                 set_succeeded = 0;  // Failed the set.
-                af_lib_send_set_response(sAf_lib, attributeId, set_succeeded, valueLen, value);
+                sendSetResponse(app, attributeId, set_succeeded, valueLen, value);
 
 	    }
+	    TRACE_PROBE(compute__done, attributeId, role);
+	    trace_span(TRACE_COMPUTE, computeStart, attributeId, role, valueLen);
+            if (set_succeeded) {
+              noteAttribute(app, HISTORY_IN, attributeId, value, valueLen); // What the Cloud gave us, for local readers and the history.
+            }
+            if (app->index == 0) {
+              service_attribute_handled(&sService, attributeId); // For the time-to-first-attribute log.
+            }
             break;
 
 
@@ -464,6 +930,233 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
            break; 
 
     } // End switch.
+
+    TRACE_PROBE(handle__done, eventType, attributeId);
+    trace_span(TRACE_HANDLE, handleStart, attributeId, eventType, error);
+}
+
+//
+// A set request that was still waiting in the queue when a newer value for the same
+// attribute came in. The newer value is what gets handled; this one is acknowledged as
+// if it had been handled and immediately overwritten.
+//
+static void ackCollapsedSet(void *ctx, uint16_t attributeId, uint16_t valueLen, const uint8_t *value)
+{
+    sendSetResponse((app_t *)ctx, attributeId, 1, valueLen, value);
+}
+
+//
+// This is the callback we give af_lib. All it does is queue the event, so a ToggleLED
+// doesn't have to wait for a string reversal that came in just before it; the event
+// queue hands it to handleAttrEvent() above when its turn comes.
+//
+void attrEventCallback(const af_lib_event_type_t eventType, const af_lib_error_t error,
+                       const uint16_t attributeId, const uint16_t valueLen, const uint8_t* value)
+{
+    TRACE_PROBE(callback, eventType, attributeId);
+    trace_instant(TRACE_CALLBACK, attributeId, eventType, error);
+    event_queue_push(&sApps[0].events, eventType, error, attributeId, valueLen, value);
+}
+
+//
+// The same for a virtual device, whose events come from its simulated ASR.
+//
+static void virtualEventCallback(void *ctx, const af_lib_event_type_t eventType, const af_lib_error_t error,
+                                 const uint16_t attributeId, const uint16_t valueLen, const uint8_t *value)
+{
+    app_t *app = (app_t *)ctx;
+
+    TRACE_PROBE(callback, eventType, attributeId);
+    trace_instant(TRACE_CALLBACK, attributeId, eventType, error);
+    event_queue_push(&app->events, eventType, error, attributeId, valueLen, value);
+}
+
+//
+// Set up everything a device keeps for itself, on the event loop it will run on. The
+// link must be usable by the time the loop runs.
+//
+static int appInit(app_t *app, unsigned index, struct event_base *base, asr_link_t *link,
+                   unsigned maxInFlight)
+{
+    app->index = index;
+    app->link  = link;
+
+    //
+    // Start with an empty memo cache. Nothing has been computed or published yet.
+    //
+    memo_cache_init(&app->memo);
+
+    //
+    // Set up the event queue. String attributes are already bulk work, but so is reading
+    // /var/log/messages, and the LED is what people are waiting to see change.
+    //
+    if (event_queue_init(&app->events, base, &sProfile, handleAttrEvent, ackCollapsedSet, app) != 0) {
+        return -1;
+    }
+    event_queue_set_class(&app->events, ATTR_ID(APP_ATTR_TOGGLELED), EVQ_CLASS_CONTROL);
+    event_queue_set_class(&app->events, ATTR_ID(APP_ATTR_READVARLOG), EVQ_CLASS_BULK);
+
+    //
+    // And the set tracker, which sends everything over the link.
+    //
+    if (set_tracker_init(&app->sets, base, link) != 0) {
+        return -1;
+    }
+    app->sets.maxInFlight = maxInFlight;
+
+    //
+    // And the aggregates, which publish through the set tracker like everything else.
+    //
+    if (agg_engine_init(&app->agg, base, &sProfile, publishAggregate, app) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+//
+// What a device did, in the log.
+//
+static void appLogStats(app_t *app)
+{
+    event_queue_log_stats(&app->events);      // How long events waited for their turn.
+    memo_cache_log_stats(&app->memo);         // And how much work the memo cache saved us.
+    set_tracker_log_stats(&app->sets);        // And how our sets fared.
+    agg_engine_log_stats(&app->agg);          // And how busy the aggregates were.
+}
+
+//
+// Anything still queued is handled first, so no set request goes unanswered. Its event
+// loop must not be running.
+//
+static void appFree(app_t *app)
+{
+    event_queue_free(&app->events);
+    agg_engine_free(&app->agg);
+    set_tracker_shutdown(&app->sets);
+    fake_asr_free(&app->fake);
+}
+
+//
+// Gateway mode. The simulated ASRs send set requests for the attributes with a handler
+// worth exercising; AF_READVARLOG is left out, since hundreds of devices reading
+// /var/log/messages would only measure the disk.
+//
+static const app_attr_t sVirtualInputs[] = {
+    APP_ATTR_GETDOUBLED, APP_ATTR_GETROTATED, APP_ATTR_GETADDED,
+    APP_ATTR_GETREVERSED, APP_ATTR_COUNTBITSOFTHIS,
+};
+
+//
+// How much memory we're using right now, in KB, from the kernel's point of view.
+//
+static long residentKb(void)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[128];
+    long kb = 0;
+
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+//
+// -d ran out. Every loop stops here, not just ours, so the devices on the other loops
+// don't keep going while main() logs their stats and tears them down.
+//
+static void gatewayTimeUp(evutil_socket_t fd, short what, void *arg)
+{
+    AFLOG_INFO("my-app: gateway: time's up");
+    loop_pool_stop(&sLoops);
+    event_base_loopexit(sEventBase, NULL);
+}
+
+//
+// Set up devices virtual devices spread over the loops in sLoops, and log what each
+// one costs us.
+//
+static int gatewayInit(unsigned devices, uint32_t periodMs, unsigned maxInFlight)
+{
+    uint16_t inputs[sizeof(sVirtualInputs) / sizeof(sVirtualInputs[0])];
+    long before = residentKb();
+    long after;
+    unsigned i;
+
+    for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        inputs[i] = ATTR_ID(sVirtualInputs[i]);
+    }
+
+    sApps = calloc(devices, sizeof(*sApps));
+    if (sApps == NULL) {
+        AFLOG_ERR("my-app: gateway: can't allocate %u devices", devices);
+        return -1;
+    }
+    sAppCount = devices;
+
+    for (i = 0; i < devices; i++) {
+        app_t *app = &sApps[i];
+        struct event_base *base = loop_pool_base(&sLoops, i);
+
+        app->io = &sIo[i % sIoCount];
+        if (fake_asr_init(&app->fake, base, &sProfile, inputs, sizeof(inputs) / sizeof(inputs[0]),
+                          i + 1, virtualEventCallback, app) != 0 ||
+            appInit(app, i, base, &app->fake.link, maxInFlight) != 0) {
+            return -1;
+        }
+        app->fake.periodMs = periodMs;
+        app->sets.nextSeq  = (i << 16) | 1;  // Keeps the devices' sets apart in the trace.
+    }
+
+    after = residentKb();
+    AFLOG_INFO("my-app: gateway: %u devices on %u loops, %zu bytes of state each, %ld KB resident, %.2f KB per device",
+               devices, sLoops.count, sizeof(app_t), after,
+               devices ? (double)(after - before) / devices : 0.0);
+
+    for (i = 0; i < devices; i++) {
+        fake_asr_start(&sApps[i].fake);
+    }
+    return 0;
+}
+
+//
+// What all the virtual devices did, added up.
+//
+static void gatewayLogStats(void)
+{
+    unsigned long long requests = 0, responses = 0, totalUs = 0, maxUs = 0;
+    unsigned long long sets = 0, refused = 0, succeeded = 0, failed = 0, retries = 0, timeouts = 0;
+    unsigned long long lookups = 0, hits = 0;
+    unsigned i;
+
+    for (i = 0; i < sAppCount; i++) {
+        const app_t *app = &sApps[i];
+
+        requests  += app->fake.requests;
+        responses += app->fake.responses;
+        totalUs   += app->fake.responseTotalUs;
+        if (app->fake.responseMaxUs > maxUs) {
+            maxUs = app->fake.responseMaxUs;
+        }
+        sets      += app->fake.sets;
+        refused   += app->fake.refused;
+        succeeded += app->sets.succeeded;
+        failed    += app->sets.failed;
+        retries   += app->sets.retries;
+        timeouts  += app->sets.timeouts;
+        lookups   += app->memo.lookups;
+        hits      += app->memo.hits;
+    }
+    AFLOG_INFO("my-app: gateway: %u devices: requests=%llu answered=%llu avg=%lluus max=%lluus memo hits=%llu/%llu",
+               sAppCount, requests, responses, responses ? totalUs / responses : 0, maxUs, hits, lookups);
+    AFLOG_INFO("my-app: gateway: sets=%llu confirmed=%llu failed=%llu retries=%llu timeouts=%llu refused=%llu",
+               sets, succeeded, failed, retries, timeouts, refused);
 }
 
     //
@@ -473,6 +1166,53 @@ void attrEventCallback(const af_lib_event_type_t eventType, /* The event type. *
 int main(int argc, char *argv[])
 {
   int retVal = AF_SUCCESS;  // Useful return value for when we are done.
+  const char *profilePath = PROFILE_DEFAULT_PATH; // Where the compiled profile lives, unless told otherwise.
+  unsigned maxInFlight = SET_TRACKER_MAX_IN_FLIGHT; // How many sets may wait for the ASR at once.
+  unsigned devices = 0;     // Virtual devices to host. 0 is the usual single device on af_lib.
+  unsigned loops = 1;       // Event loops to spread them over.
+  uint32_t periodMs = FAKE_ASR_PERIOD_MS; // Mean time between a virtual device's set requests.
+  unsigned seconds = 0;     // How long to run in gateway mode. 0 is until we're told to stop.
+  unsigned i;
+  int opt;
+
+    service_mark_start(&sService); // Startup is timed from here.
+
+    //
+    // -p <file> loads the compiled profile from somewhere other than PROFILE_DEFAULT_PATH.
+    // -s <n> lets up to n outbound sets be in flight at the same time.
+    // -n <n> is gateway mode: host n virtual devices instead of talking to af_lib, and
+    //        -l <n> spreads them over n event loops, -r <ms> is how often each one gets
+    //        a set request on average, and -d <s> stops after s seconds.
+    //
+    while ((opt = getopt(argc, argv, "p:s:n:l:r:d:")) != -1) {
+        switch (opt) {
+            case 'p':
+                profilePath = optarg;
+                break;
+            case 's':
+                maxInFlight = (unsigned)atoi(optarg);
+                if (maxInFlight == 0) {
+                    maxInFlight = 1;
+                }
+                break;
+            case 'n':
+                devices = (unsigned)atoi(optarg);
+                break;
+            case 'l':
+                loops = (unsigned)atoi(optarg);
+                break;
+            case 'r':
+                periodMs = (uint32_t)atoi(optarg);
+                break;
+            case 'd':
+                seconds = (unsigned)atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p profile.bin] [-s max-sets-in-flight]"
+                                " [-n virtual-devices [-l loops] [-r request-ms] [-d seconds]]\n", argv[0]);
+                return (-1);
+        }
+    }
 
    /* Enable pthreads. */
     evthread_use_pthreads();
@@ -486,7 +1226,15 @@ int main(int argc, char *argv[])
       //
       AFLOG_ERR("my-app: main_event_base_new::can't allocate event base");
       retVal = -1;
-      return (retVal);
+      goto err_exit;
+    }
+
+    //
+    // Find out whether systemd is waiting to hear from us.
+    //
+    if (service_init(&sService, sEventBase) != 0) {
+      retVal = -1;
+      goto err_exit;
     }
 
     //
@@ -495,33 +1243,138 @@ int main(int argc, char *argv[])
     AFLOG_INFO("my-app: EDGE: start");
 
     //
-    // Register the Afero library's getting us data with the event system.
+    // Map the compiled profile and bind our handlers to it. If there isn't one installed
+    // we fall back on what device-description.h said when the app was built.
     //
-    retVal = af_lib_set_event_base(sEventBase);
-    if (retVal != AF_SUCCESS) {
-        AFLOG_ERR("my-app: main_set_event_base::set event base failed");
+    if (profile_load(&sProfile, profilePath) != 0 && profile_load_builtin(&sProfile) != 0) {
+        AFLOG_ERR("my-app: main: no usable device profile");
+        retVal = -1;
         goto err_exit;
     }
- 
-    //
-    // Another logging message to keep track of where we are.
-    //
-    AFLOG_INFO("my-app: EDGE: call af_lib_create_with_unified_callback");
+    if (app_attrs_bind(&sAttrs, &sProfile) < 0) {
+        retVal = -1;
+        goto err_exit;
+    }
+
+    if (devices == 0) {
+        //
+        // Lay out the shared-memory mirror from the profile. Local readers are nice to have,
+        // so if it can't be created we carry on without it.
+        //
+        attr_mirror_create(&sMirror, &sProfile);
+
+        //
+        // And the history. See history.h for how to query it.
+        //
+        if (history_init(&sHistory, sEventBase, &sProfile) != 0) {
+            retVal = -1;
+            goto err_exit;
+        }
+    }
+
     //
-    //   Now create the event and point to our callback function when that event
-    //   occurs. Note that this function, af_lib_create_with_unified_callback, will
-    //   automatically subscribe you to attributes 1 - 1023, and several Wi-Fi, WAN, and Ethernet 
-    //   attributes as well as the Profile change attribute.
+    // And the tracer. Built with APP_TRACE_RING, kill -USR2 the app to get a trace of
+    // what it did lately.
     //
-    sAf_lib = af_lib_create_with_unified_callback(attrEventCallback, NULL);
+    trace_init(sEventBase);
+
     //
-    // Make sure the event base was allocated or we will basically be dead in the water.
+    // And the event loops. Only gateway mode needs more than sEventBase.
     //
-    if (sAf_lib == NULL) {
-      AFLOG_ERR("my-app: main_event_base_new::can't allocate event base"); // And if not, complain about it in the log files.
+    if (loop_pool_init(&sLoops, sEventBase, devices ? loops : 1) != 0) {
         retVal = -1;
         goto err_exit;
     }
+
+    //
+    // And file I/O for each of them.
+    //
+    for (sIoCount = 0; sIoCount < sLoops.count; sIoCount++) {
+        if (file_io_init(&sIo[sIoCount], sLoops.bases[sIoCount]) != 0) {
+            retVal = -1;
+            goto err_exit;
+        }
+    }
+
+    if (devices > 0) {
+        //
+        // Gateway mode. No af_lib here; every device has a simulated ASR instead.
+        //
+        if (gatewayInit(devices, periodMs, maxInFlight) != 0) {
+            retVal = -1;
+            goto err_exit;
+        }
+        if (seconds > 0) {
+            struct timeval tv = { seconds, 0 };
+            event_base_once(sEventBase, -1, EV_TIMEOUT, gatewayTimeUp, NULL, &tv);
+        }
+        if (loop_pool_start(&sLoops) != 0) {
+            retVal = -1;
+            goto err_exit;
+        }
+    }
+    else {
+        //
+        // Just us, the device on this board. It keeps the history and the mirror, and
+        // talks to the ASR through af_lib once we have it.
+        //
+        sApps = calloc(1, sizeof(*sApps));
+        if (sApps == NULL) {
+            AFLOG_ERR("my-app: main: can't allocate the device");
+            retVal = -1;
+            goto err_exit;
+        }
+        sAppCount = 1;
+        sApps[0].history = &sHistory;
+        sApps[0].mirror  = &sMirror;
+        sApps[0].io      = &sIo[0];
+        asr_link_aflib_init(&sAfLink, NULL);
+        if (appInit(&sApps[0], 0, sEventBase, &sAfLink.link, maxInFlight) != 0) {
+            retVal = -1;
+            goto err_exit;
+        }
+
+        //
+        // Register the Afero library's getting us data with the event system.
+        //
+        retVal = af_lib_set_event_base(sEventBase);
+        if (retVal != AF_SUCCESS) {
+            AFLOG_ERR("my-app: main_set_event_base::set event base failed");
+            goto err_exit;
+        }
+
+        //
+        // Another logging message to keep track of where we are.
+        //
+        AFLOG_INFO("my-app: EDGE: call af_lib_create_with_unified_callback");
+        //
+        //   Now create the event and point to our callback function when that event
+        //   occurs. Note that this function, af_lib_create_with_unified_callback, will
+        //   automatically subscribe you to attributes 1 - 1023, and several Wi-Fi, WAN, and Ethernet
+        //   attributes as well as the Profile change attribute.
+        //
+        sAf_lib = af_lib_create_with_unified_callback(attrEventCallback, NULL);
+        //
+        // Make sure the event base was allocated or we will basically be dead in the water.
+        //
+        if (sAf_lib == NULL) {
+          AFLOG_ERR("my-app: main_event_base_new::can't allocate event base"); // And if not, complain about it in the log files.
+            retVal = -1;
+            goto err_exit;
+        }
+
+        //
+        // The set tracker can send now.
+        //
+        sAfLink.afLib = sAf_lib;
+    }
+
+    //
+    // Anything the first event doesn't need waits until we've told systemd we're ready.
+    //
+    service_defer(&sService, warmVarLog, NULL);
+    service_start(&sService);
+
     AFLOG_INFO("my-app: EDGE: dispatching event base"); 
     //
     //   Start it up! This will not return until
@@ -531,9 +1384,45 @@ int main(int argc, char *argv[])
     event_base_dispatch(sEventBase);
    
 
+    //
+    // Everything after the options comes here on the way out, whether it failed or
+    // not. Every step copes with things that were never set up.
+    //
 err_exit:
     // Done,let's close/clean up. 
     AFLOG_INFO("my-app: EDGED:  shutdown");  // A little log message so we know what's going on.
-    af_lib_shutdown();
+    service_shutdown(&sService);              // Tell systemd we're stopping.
+    loop_pool_stop(&sLoops);                  // Virtual devices on the other loops stop where they are.
+    if (devices > 0) {
+        gatewayLogStats();                    // What the virtual devices did, all together.
+    }
+    else if (sAppCount > 0) {
+        appLogStats(&sApps[0]);               // Queue waits, memo hits, sets and aggregates.
+    }
+    for (i = 0; i < sIoCount; i++) {
+        file_io_log_stats(&sIo[i]);           // And how much file I/O we did without waiting for it.
+        file_io_free(&sIo[i]);                // Reads already started finish, and get published.
+    }
+    sIoCount = 0;
+    for (i = 0; i < sAppCount; i++) {
+        appFree(&sApps[i]);                   // Anything still queued is handled first.
+    }
+    free(sApps);
+    sApps = NULL;
+    sAppCount = 0;
+    if (devices == 0) {
+        attr_mirror_log_stats(&sMirror);      // And how often local readers got something new.
+        attr_mirror_close(&sMirror);
+        history_log_stats(&sHistory);         // And how much history we kept.
+        history_free(&sHistory);
+    }
+    trace_log_stats();                        // And how much we traced.
+    trace_free();
+    loop_pool_free(&sLoops);
+    app_attrs_unbind(&sAttrs);
+    profile_unload(&sProfile);
+    if (devices == 0) {
+        af_lib_shutdown();
+    }
     return (retVal);
 }
@@ -0,0 +1,446 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Runtime device profile loader. See profile.h for the file layout and profilec.py
+   for the tool that produces it.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "af_log.h"
+#include "device-description.h"
+#include "profile.h"
+
+//
+// profilec.py walks the same multiplier sequence, so both produce the same table
+// for the same set of IDs.
+//
+#define PROFILE_HASH_TRIES     4096
+#define PROFILE_HASH_SEED      0x9e3779b9u
+#define PROFILE_MAX_SLOT_BITS  16
+
+uint32_t profile_crc32(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t crc = 0xffffffffu;
+    int bit;
+
+    //
+    // Bitwise is fine here; the whole profile is a few KB and this runs once.
+    //
+    while (len--) {
+        crc ^= *p++;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+//
+// Binary search of the validated, sorted attribute table. Used before the hash table
+// has been checked, so it can't rely on profile_lookup().
+//
+static int profile_has_id(const profile_attr_t *attrs, uint32_t count, uint16_t id)
+{
+    uint32_t lo = 0, hi = count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (attrs[mid].id == id) {
+            return 1;
+        }
+        if (attrs[mid].id < id) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return 0;
+}
+
+//
+// Check that an image is self-consistent before we trust any offset in it. This is
+// what keeps a truncated or hand-edited file from walking us off the end of the map.
+// The layout sums are done in 64 bits so that huge offsets can't wrap around into
+// something that looks in bounds.
+//
+static int profile_validate(const uint8_t *img, size_t len, const char *what)
+{
+    const profile_header_t *hdr = (const profile_header_t *)img;
+    const profile_attr_t *attrs;
+    const profile_agg_t *aggs;
+    const uint16_t *slots;
+    const char *names;
+    uint32_t i;
+
+    if (len < sizeof(*hdr)) {
+        AFLOG_ERR("my-app: profile: %s is too short (%zu bytes)", what, len);
+        return -1;
+    }
+    if (hdr->magic != PROFILE_MAGIC || hdr->version != PROFILE_VERSION ||
+        hdr->headerSize != sizeof(*hdr) || hdr->fileSize != len) {
+        AFLOG_ERR("my-app: profile: %s has a bad header (magic=0x%08x version=%d size=%u)",
+                  what, hdr->magic, hdr->version, hdr->fileSize);
+        return -1;
+    }
+    if (hdr->hashShift < 32 - PROFILE_MAX_SLOT_BITS || hdr->hashShift > 31 ||
+        hdr->slotCount != (1u << (32 - hdr->hashShift)) || hdr->attrCount == 0 ||
+        (hdr->attrsOffset | hdr->slotsOffset | hdr->namesOffset) & 3 ||
+        hdr->attrsOffset < sizeof(*hdr) ||
+        (uint64_t)hdr->attrsOffset + (uint64_t)hdr->attrCount * sizeof(profile_attr_t) > hdr->slotsOffset ||
+        (uint64_t)hdr->slotsOffset + (uint64_t)hdr->slotCount * sizeof(uint16_t) > hdr->aggsOffset ||
+        (hdr->aggsOffset & 3) ||
+        (uint64_t)hdr->aggsOffset + (uint64_t)hdr->aggCount * sizeof(profile_agg_t) > hdr->namesOffset ||
+        hdr->namesSize == 0 || (uint64_t)hdr->namesOffset + hdr->namesSize > len) {
+        AFLOG_ERR("my-app: profile: %s has a bad layout", what);
+        return -1;
+    }
+    if (profile_crc32(img + sizeof(*hdr), len - sizeof(*hdr)) != hdr->crc32) {
+        AFLOG_ERR("my-app: profile: %s failed its CRC check", what);
+        return -1;
+    }
+
+    attrs = (const profile_attr_t *)(img + hdr->attrsOffset);
+    slots = (const uint16_t *)(img + hdr->slotsOffset);
+    aggs  = (const profile_agg_t *)(img + hdr->aggsOffset);
+    names = (const char *)(img + hdr->namesOffset);
+    if (names[hdr->namesSize - 1] != '\0') {
+        AFLOG_ERR("my-app: profile: %s names are not terminated", what);
+        return -1;
+    }
+    for (i = 0; i < hdr->attrCount; i++) {
+        if (attrs[i].nameOffset >= hdr->namesSize) {
+            AFLOG_ERR("my-app: profile: %s attr %d has a bad name", what, attrs[i].id);
+            return -1;
+        }
+        //
+        // Sorted and unique. Two attributes with one ID would make the perfect hash
+        // answer for whichever of them happened to get the slot.
+        //
+        if (i > 0 && attrs[i].id <= attrs[i - 1].id) {
+            AFLOG_ERR("my-app: profile: %s attr %d is out of order or repeated", what, attrs[i].id);
+            return -1;
+        }
+    }
+    //
+    // Every occupied slot must point at an attribute that actually hashes there,
+    // otherwise profile_lookup() could answer for the wrong ID.
+    //
+    for (i = 0; i < hdr->slotCount; i++) {
+        if (slots[i] == 0) {
+            continue;
+        }
+        if (slots[i] > hdr->attrCount ||
+            (((uint32_t)attrs[slots[i] - 1].id * hdr->hashMult) >> hdr->hashShift) != i) {
+            AFLOG_ERR("my-app: profile: %s hash slot %u is inconsistent", what, i);
+            return -1;
+        }
+    }
+    //
+    // Aggregates have to be sorted by source so the engine can find all the aggregates
+    // for an attribute in one run.
+    //
+    for (i = 0; i < hdr->aggCount; i++) {
+        if (aggs[i].fn > PROFILE_AGG_FN_MAX || aggs[i].window > PROFILE_WINDOW_TIME ||
+            (aggs[i].window == PROFILE_WINDOW_NONE) != (aggs[i].fn == PROFILE_AGG_TOTAL) ||
+            (aggs[i].window != PROFILE_WINDOW_NONE && (aggs[i].capacity == 0 || aggs[i].span == 0)) ||
+            (aggs[i].window == PROFILE_WINDOW_SAMPLES && aggs[i].span != aggs[i].capacity) ||
+            (i > 0 && aggs[i].srcId < aggs[i - 1].srcId)) {
+            AFLOG_ERR("my-app: profile: %s aggregate %u is invalid", what, i);
+            return -1;
+        }
+        if (!profile_has_id(attrs, hdr->attrCount, aggs[i].srcId) ||
+            !profile_has_id(attrs, hdr->attrCount, aggs[i].outId)) {
+            AFLOG_ERR("my-app: profile: %s aggregate %u refers to an attribute it doesn't have", what, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void profile_bind_image(profile_t *p, void *img, size_t len, int builtin)
+{
+    const profile_header_t *hdr = (const profile_header_t *)img;
+
+    p->hdr        = hdr;
+    p->attrs      = (const profile_attr_t *)((const uint8_t *)img + hdr->attrsOffset);
+    p->slots      = (const uint16_t *)((const uint8_t *)img + hdr->slotsOffset);
+    p->aggs       = (const profile_agg_t *)((const uint8_t *)img + hdr->aggsOffset);
+    p->aggCount   = hdr->aggCount;
+    p->names      = (const char *)img + hdr->namesOffset;
+    p->hashMult   = hdr->hashMult;
+    p->hashShift  = hdr->hashShift;
+    p->mapping    = img;
+    p->mappingLen = len;
+    p->builtin    = builtin;
+}
+
+int profile_load(profile_t *p, const char *path)
+{
+    struct timespec t0, t1;
+    struct stat st;
+    void *img;
+    int fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        AFLOG_INFO("my-app: profile: can't open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        AFLOG_ERR("my-app: profile: can't size %s", path);
+        close(fd);
+        return -1;
+    }
+    img = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file alive.
+    if (img == MAP_FAILED) {
+        AFLOG_ERR("my-app: profile: can't map %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (profile_validate(img, (size_t)st.st_size, path) < 0) {
+        munmap(img, (size_t)st.st_size);
+        return -1;
+    }
+    profile_bind_image(p, img, (size_t)st.st_size, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    AFLOG_INFO("my-app: profile: loaded %s, %d attributes, %d aggregates, %u slots, in %ld us",
+               path, p->hdr->attrCount, p->aggCount, p->hdr->slotCount,
+               (long)((t1.tv_sec - t0.tv_sec) * 1000000L + (t1.tv_nsec - t0.tv_nsec) / 1000));
+    return 0;
+}
+
+//
+// The attributes compiled in with device-description.h, for when there is no
+// compiled profile on the device.
+//
+typedef struct {
+    uint16_t    id;
+    uint16_t    size;
+    uint8_t     type;
+    uint8_t     ops;
+    const char *name;
+} profile_builtin_t;
+
+#define RW  (PROFILE_OP_READ | PROFILE_OP_WRITE)
+#define RO  (PROFILE_OP_READ)
+
+static const profile_builtin_t sBuiltin[] = {
+    { AF_GETDOUBLED,                   AF_GETDOUBLED_SZ,                   AF_GETDOUBLED_TYPE,                   RW, "GetDoubled" },
+    { AF_DOUBLED,                      AF_DOUBLED_SZ,                      AF_DOUBLED_TYPE,                      RW, "Doubled" },
+    { AF_GETROTATED,                   AF_GETROTATED_SZ,                   AF_GETROTATED_TYPE,                   RW, "GetRotated" },
+    { AF_ROTATE,                       AF_ROTATE_SZ,                       AF_ROTATE_TYPE,                       RW, "Rotate" },
+    { AF_TOGGLELED,                    AF_TOGGLELED_SZ,                    AF_TOGGLELED_TYPE,                    RW, "ToggleLED" },
+    { AF_GETADDED,                     AF_GETADDED_SZ,                     AF_GETADDED_TYPE,                     RW, "GetAdded" },
+    { AF_CURRENTSUM,                   AF_CURRENTSUM_SZ,                   AF_CURRENTSUM_TYPE,                   RW, "CurrentSum" },
+    { AF_READVARLOG,                   AF_READVARLOG_SZ,                   AF_READVARLOG_TYPE,                   RW, "ReadVarLog" },
+    { AF_LASTLINEOFVARLOG,             AF_LASTLINEOFVARLOG_SZ,             AF_LASTLINEOFVARLOG_TYPE,             RW, "LastLineOfVarLog" },
+    { AF_GETREVERSED,                  AF_GETREVERSED_SZ,                  AF_GETREVERSED_TYPE,                  RW, "GetReversed" },
+    { AF_REVERSED,                     AF_REVERSED_SZ,                     AF_REVERSED_TYPE,                     RW, "Reversed" },
+    { AF_COUNTBITSOFTHIS,              AF_COUNTBITSOFTHIS_SZ,              AF_COUNTBITSOFTHIS_TYPE,              RW, "CountBitsOfThis" },
+    { AF_NUMBEROFBITS,                 AF_NUMBEROFBITS_SZ,                 AF_NUMBEROFBITS_TYPE,                 RW, "NumberOfBits" },
+    { AF_ROTATEDR,                     AF_ROTATEDR_SZ,                     AF_ROTATEDR_TYPE,                     RO, "RotatedR" },
+    { AF_ROTATEL,                      AF_ROTATEL_SZ,                      AF_ROTATEL_TYPE,                      RO, "RotateL" },
+    { AF_APPLICATION_VERSION,          AF_APPLICATION_VERSION_SZ,          AF_APPLICATION_VERSION_TYPE,          RO, "Application Version" },
+    { AF_PROFILE_VERSION,              AF_PROFILE_VERSION_SZ,              AF_PROFILE_VERSION_TYPE,              RO, "Profile Version" },
+    { AF_HUB_VERSION,                  AF_HUB_VERSION_SZ,                  AF_HUB_VERSION_TYPE,                  RO, "Hub Version" },
+    { AF_SYSTEM_UTC_OFFSET_DATA,       AF_SYSTEM_UTC_OFFSET_DATA_SZ,       AF_SYSTEM_UTC_OFFSET_DATA_TYPE,       RW, "UTC Offset Data" },
+    { AF_SYSTEM_CONNECTED_SSID,        AF_SYSTEM_CONNECTED_SSID_SZ,        AF_SYSTEM_CONNECTED_SSID_TYPE,        RO, "Connected SSID" },
+    { AF_SYSTEM_WI_FI_BARS,            AF_SYSTEM_WI_FI_BARS_SZ,            AF_SYSTEM_WI_FI_BARS_TYPE,            RO, "Wi-Fi Bars" },
+    { AF_SYSTEM_WI_FI_STEADY_STATE,    AF_SYSTEM_WI_FI_STEADY_STATE_SZ,    AF_SYSTEM_WI_FI_STEADY_STATE_TYPE,    RO, "Wi-Fi Steady State" },
+    { AF_SYSTEM_NETWORK_TYPE,          AF_SYSTEM_NETWORK_TYPE_SZ,          AF_SYSTEM_NETWORK_TYPE_TYPE,          RO, "Network Type" },
+    { AF_SYSTEM_COMMAND,               AF_SYSTEM_COMMAND_SZ,               AF_SYSTEM_COMMAND_TYPE,               RW, "Command" },
+    { AF_SYSTEM_ASR_STATE,             AF_SYSTEM_ASR_STATE_SZ,             AF_SYSTEM_ASR_STATE_TYPE,             RO, "ASR State" },
+    { AF_SYSTEM_LINKED_TIMESTAMP,      AF_SYSTEM_LINKED_TIMESTAMP_SZ,      AF_SYSTEM_LINKED_TIMESTAMP_TYPE,      PROFILE_OP_WRITE, "Linked Timestamp" },
+    { AF_SYSTEM_REBOOT_REASON,         AF_SYSTEM_REBOOT_REASON_SZ,         AF_SYSTEM_REBOOT_REASON_TYPE,         RO, "Reboot Reason" },
+    { AF_SYSTEM_NETWORK_CAPABILITIES,  AF_SYSTEM_NETWORK_CAPABILITIES_SZ,  AF_SYSTEM_NETWORK_CAPABILITIES_TYPE,  RO, "Network Capabilities" },
+    { AF_SYSTEM_WI_FI_INTERFACE_STATE, AF_SYSTEM_WI_FI_INTERFACE_STATE_SZ, AF_SYSTEM_WI_FI_INTERFACE_STATE_TYPE, RO, "Wi-Fi Interface State" },
+    { AF_SYSTEM_WAN_INTERFACE_STATE,   AF_SYSTEM_WAN_INTERFACE_STATE_SZ,   AF_SYSTEM_WAN_INTERFACE_STATE_TYPE,   RO, "WAN Interface State" },
+    { AF_SYSTEM_DEVICE_CAPABILITY,     AF_SYSTEM_DEVICE_CAPABILITY_SZ,     AF_SYSTEM_DEVICE_CAPABILITY_TYPE,     RO, "Device Capability" },
+};
+
+#undef RW
+#undef RO
+
+#define PROFILE_BUILTIN_COUNT  (sizeof(sBuiltin) / sizeof(sBuiltin[0]))
+
+//
+// The builtin profile keeps the original demo behavior: AF_CURRENTSUM is the running
+// total of everything sent to AF_GETADDED.
+//
+static const profile_agg_t sBuiltinAggs[] = {
+    { AF_GETADDED, AF_CURRENTSUM, PROFILE_AGG_TOTAL, PROFILE_WINDOW_NONE, 0, 0, 0 },
+};
+
+#define PROFILE_BUILTIN_AGG_COUNT  (sizeof(sBuiltinAggs) / sizeof(sBuiltinAggs[0]))
+
+static uint32_t profile_align4(uint32_t n)
+{
+    return (n + 3) & ~3u;
+}
+
+//
+// Search for a multiplier that puts every ID in its own slot, growing the table
+// until one turns up. Returns the shift, or -1 if nothing fits in 2^16 slots.
+//
+static int profile_find_hash(const uint16_t *ids, int count, uint16_t *slots, uint32_t *multOut)
+{
+    int bits = 1;
+    int shift;
+    int attempt;
+    int i;
+    uint32_t mult;
+    uint32_t slot;
+
+    while ((1 << bits) < count * 2) {
+        bits++;
+    }
+    for (; bits <= PROFILE_MAX_SLOT_BITS; bits++) {
+        shift = 32 - bits;
+        mult = PROFILE_HASH_SEED;
+        for (attempt = 0; attempt < PROFILE_HASH_TRIES; attempt++) {
+            mult = (mult * 1664525u + 1013904223u) | 1u;
+            memset(slots, 0, sizeof(uint16_t) << bits);
+            for (i = 0; i < count; i++) {
+                slot = ((uint32_t)ids[i] * mult) >> shift;
+                if (slots[slot]) {
+                    break;
+                }
+                slots[slot] = (uint16_t)(i + 1);
+            }
+            if (i == count) {
+                *multOut = mult;
+                return shift;
+            }
+        }
+    }
+    return -1;
+}
+
+int profile_load_builtin(profile_t *p)
+{
+    uint16_t ids[PROFILE_BUILTIN_COUNT];
+    uint16_t *slots;
+    profile_header_t *hdr;
+    profile_attr_t *attrs;
+    uint8_t *img;
+    uint32_t namesSize = 0;
+    uint32_t slotCount;
+    uint32_t mult;
+    uint32_t off;
+    uint32_t len;
+    int shift;
+    size_t i;
+
+    //
+    // The table above is already sorted by ID, which is what the file format wants.
+    //
+    for (i = 0; i < PROFILE_BUILTIN_COUNT; i++) {
+        ids[i] = sBuiltin[i].id;
+        namesSize += strlen(sBuiltin[i].name) + 1;
+    }
+
+    slots = malloc(sizeof(uint16_t) << PROFILE_MAX_SLOT_BITS);
+    if (slots == NULL) {
+        return -1;
+    }
+    shift = profile_find_hash(ids, PROFILE_BUILTIN_COUNT, slots, &mult);
+    if (shift < 0) {
+        AFLOG_ERR("my-app: profile: no perfect hash for the builtin attributes");
+        free(slots);
+        return -1;
+    }
+    slotCount = 1u << (32 - shift);
+
+    len = profile_align4(sizeof(*hdr));
+    len = profile_align4(len + PROFILE_BUILTIN_COUNT * sizeof(profile_attr_t));
+    len = profile_align4(len + slotCount * sizeof(uint16_t));
+    len = profile_align4(len + PROFILE_BUILTIN_AGG_COUNT * sizeof(profile_agg_t));
+    len = len + profile_align4(namesSize);
+    img = calloc(1, len);
+    if (img == NULL) {
+        free(slots);
+        return -1;
+    }
+
+    hdr = (profile_header_t *)img;
+    hdr->magic       = PROFILE_MAGIC;
+    hdr->version     = PROFILE_VERSION;
+    hdr->headerSize  = sizeof(*hdr);
+    hdr->fileSize    = len;
+    hdr->hashMult    = mult;
+    hdr->hashShift   = (uint8_t)shift;
+    hdr->attrCount   = PROFILE_BUILTIN_COUNT;
+    hdr->slotCount   = slotCount;
+    hdr->attrsOffset = profile_align4(sizeof(*hdr));
+    hdr->slotsOffset = profile_align4(hdr->attrsOffset + PROFILE_BUILTIN_COUNT * sizeof(profile_attr_t));
+    hdr->aggsOffset  = profile_align4(hdr->slotsOffset + slotCount * sizeof(uint16_t));
+    hdr->aggCount    = PROFILE_BUILTIN_AGG_COUNT;
+    hdr->namesOffset = profile_align4(hdr->aggsOffset + PROFILE_BUILTIN_AGG_COUNT * sizeof(profile_agg_t));
+    hdr->namesSize   = profile_align4(namesSize);
+
+    attrs = (profile_attr_t *)(img + hdr->attrsOffset);
+    off = 0;
+    for (i = 0; i < PROFILE_BUILTIN_COUNT; i++) {
+        attrs[i].id         = sBuiltin[i].id;
+        attrs[i].size       = sBuiltin[i].size;
+        attrs[i].type       = sBuiltin[i].type;
+        attrs[i].ops        = sBuiltin[i].ops;
+        attrs[i].nameOffset = (uint16_t)off;
+        strcpy((char *)img + hdr->namesOffset + off, sBuiltin[i].name);
+        off += strlen(sBuiltin[i].name) + 1;
+    }
+    memcpy(img + hdr->slotsOffset, slots, slotCount * sizeof(uint16_t));
+    memcpy(img + hdr->aggsOffset, sBuiltinAggs, sizeof(sBuiltinAggs));
+    free(slots);
+    hdr->crc32 = profile_crc32(img + sizeof(*hdr), len - sizeof(*hdr));
+
+    //
+    // Run it through the same checks as a file would get. Cheap insurance.
+    //
+    if (profile_validate(img, len, "builtin profile") < 0) {
+        free(img);
+        return -1;
+    }
+    profile_bind_image(p, img, len, 1);
+    AFLOG_INFO("my-app: profile: using builtin profile, %d attributes, %u slots",
+               hdr->attrCount, slotCount);
+    return 0;
+}
+
+void profile_unload(profile_t *p)
+{
+    if (p->mapping == NULL) {
+        return;
+    }
+    if (p->builtin) {
+        free(p->mapping);
+    }
+    else {
+        munmap(p->mapping, p->mappingLen);
+    }
+    memset(p, 0, sizeof(*p));
+}
+
+const profile_attr_t *profile_find_by_name(const profile_t *p, const char *name)
+{
+    uint16_t i;
+
+    for (i = 0; i < p->hdr->attrCount; i++) {
+        if (strcmp(profile_name(p, &p->attrs[i]), name) == 0) {
+            return &p->attrs[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,164 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Runtime device profile.
+
+   Instead of compiling device-description.h into the app, the attribute table can be
+   loaded at startup from a compiled, memory-mappable form of device-description.json
+   (see profilec.py). Loading is an mmap plus a validation pass; no JSON is parsed on
+   the device. Attribute lookups go through a perfect hash built by profilec.py, so
+   finding an attribute by ID is a multiply, a shift and one compare.
+
+   File layout (all fields little-endian, everything 4-byte aligned):
+
+     profile_header_t
+     profile_attr_t   attrs[attrCount]     sorted by ID
+     uint16_t         slots[slotCount]     attrs index + 1, or 0 for an empty slot
+     profile_agg_t    aggs[aggCount]       sorted by source ID
+     char             names[namesSize]     NUL-terminated semantic type names
+
+   The CRC32 in the header covers everything after the header.
+*/
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PROFILE_MAGIC          0x50464641   // "AFFP" on disk.
+#define PROFILE_VERSION        2
+#define PROFILE_DEFAULT_PATH   "/etc/af-app/device-profile.bin"
+
+//
+// Attribute operations, one bit per entry in the JSON "operations" array.
+//
+#define PROFILE_OP_READ          0x01
+#define PROFILE_OP_WRITE         0x02
+#define PROFILE_OP_MCU           0x04
+#define PROFILE_OP_PASS_THROUGH  0x08
+
+//
+// Windowed aggregates. Each one follows a numeric source attribute and publishes a
+// derived value to an output attribute. See window_agg.h.
+//
+#define PROFILE_AGG_TOTAL        0   // Running total since startup. No window.
+#define PROFILE_AGG_SUM          1
+#define PROFILE_AGG_AVG          2
+#define PROFILE_AGG_MIN          3
+#define PROFILE_AGG_MAX          4
+#define PROFILE_AGG_COUNT        5
+#define PROFILE_AGG_RATE         6   // Sum per second.
+#define PROFILE_AGG_FN_MAX       PROFILE_AGG_RATE
+
+#define PROFILE_WINDOW_NONE      0   // Only valid with PROFILE_AGG_TOTAL.
+#define PROFILE_WINDOW_SAMPLES   1   // The last span samples.
+#define PROFILE_WINDOW_TIME      2   // The last span milliseconds.
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t fileSize;
+    uint32_t crc32;
+    uint32_t hashMult;     // slot = (uint32_t)(id * hashMult) >> hashShift
+    uint8_t  hashShift;
+    uint8_t  reserved[3];
+    uint16_t attrCount;
+    uint16_t reserved2;
+    uint32_t slotCount;    // Always 1 << (32 - hashShift).
+    uint32_t attrsOffset;
+    uint32_t slotsOffset;
+    uint32_t namesOffset;
+    uint32_t namesSize;
+    uint32_t aggsOffset;
+    uint16_t aggCount;
+    uint16_t reserved3;
+} profile_header_t;
+
+typedef struct {
+    uint16_t id;
+    uint16_t size;         // Maximum length in bytes.
+    uint8_t  type;         // ATTRIBUTE_TYPE_* from device-description.h.
+    uint8_t  ops;          // PROFILE_OP_* bits.
+    uint16_t nameOffset;   // Into the names table.
+} profile_attr_t;
+
+typedef struct {
+    uint16_t srcId;        // Attribute whose values are aggregated.
+    uint16_t outId;        // Attribute the result is published to.
+    uint8_t  fn;           // PROFILE_AGG_*
+    uint8_t  window;       // PROFILE_WINDOW_*
+    uint16_t capacity;     // Most samples kept. For sample windows this equals span.
+    uint32_t span;         // Window length in samples or milliseconds.
+    uint32_t intervalMs;   // Minimum time between publishes of the output, 0 for every change.
+} profile_agg_t;
+
+typedef struct {
+    const profile_header_t *hdr;
+    const profile_attr_t   *attrs;
+    const uint16_t         *slots;
+    const char             *names;
+    const profile_agg_t    *aggs;
+    uint16_t                aggCount;
+    uint32_t                hashMult;
+    uint8_t                 hashShift;
+    //
+    // Where the image lives, so profile_unload() knows how to give it back.
+    //
+    void                   *mapping;
+    size_t                  mappingLen;
+    int                     builtin;   // 1 if the image was built from device-description.h.
+} profile_t;
+
+//
+// Map and validate a compiled profile. Returns 0 on success, -1 on failure with the
+// reason logged; in that case *p is left untouched.
+//
+int profile_load(profile_t *p, const char *path);
+
+//
+// Build the profile in memory from the attributes compiled in with device-description.h.
+// Used when no compiled profile is installed, so existing devices keep working.
+//
+int profile_load_builtin(profile_t *p);
+
+void profile_unload(profile_t *p);
+
+//
+// Perfect hash slot for an attribute ID. The slot may be empty or hold another
+// attribute; profile_lookup() does that check.
+//
+static inline uint32_t profile_slot(const profile_t *p, uint16_t id)
+{
+    return ((uint32_t)id * p->hashMult) >> p->hashShift;
+}
+
+//
+// Find an attribute by ID. Returns NULL if the profile doesn't have it.
+//
+static inline const profile_attr_t *profile_lookup(const profile_t *p, uint16_t id)
+{
+    uint16_t idx = p->slots[profile_slot(p, id)];
+
+    if (idx == 0 || p->attrs[idx - 1].id != id) {
+        return NULL;
+    }
+    return &p->attrs[idx - 1];
+}
+
+static inline const char *profile_name(const profile_t *p, const profile_attr_t *a)
+{
+    return &p->names[a->nameOffset];
+}
+
+//
+// Find an attribute by its semantic type name, e.g. "GetDoubled". This is a linear
+// scan meant for binding at startup, not for the event path.
+//
+const profile_attr_t *profile_find_by_name(const profile_t *p, const char *name);
+
+//
+// CRC32 (IEEE 802.3, the same as zlib's crc32) as used in the header.
+//
+uint32_t profile_crc32(const void *data, size_t len);
+
+#endif // PROFILE_H
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Afero, Inc.
+#
+# Compile the device-description.json written by the Afero Profile Editor into the
+# binary profile the app maps at startup (see profile.h for the layout). Run it on the
+# build host whenever the profile changes and install the result as
+# /etc/af-app/device-profile.bin; the app itself does not need to be rebuilt.
+#
+#   profilec.py device-description.json device-profile.bin [aggregates.json]
+#
+# The optional aggregates.json adds windowed aggregates (see window_agg.h). Attributes
+# are named by the semantic type you gave them in the Profile Editor:
+#
+#   { "aggregates": [
+#       { "source": "GetAdded", "output": "CurrentSum", "function": "total" },
+#       { "source": "Temperature", "output": "AvgTemperature", "function": "avg",
+#         "window": "time", "span": 60000, "capacity": 600, "interval": 1000 }
+#   ] }
+#
+# function is one of total, sum, avg, min, max, count or rate (sum per second).
+# window is "samples" (the last span values) or "time" (the last span milliseconds,
+# keeping at most capacity values); total takes no window. interval is the minimum
+# number of milliseconds between publishes of the output and defaults to 0.
+#
+import json
+import struct
+import sys
+import zlib
+
+PROFILE_MAGIC = 0x50464641
+PROFILE_VERSION = 2
+
+# Must match profile.c so both sides come up with the same table.
+PROFILE_HASH_TRIES = 4096
+PROFILE_HASH_SEED = 0x9e3779b9
+PROFILE_MAX_SLOT_BITS = 16
+
+# ATTRIBUTE_TYPE_* from device-description.h.
+DATA_TYPES = {
+    "BOOLEAN": 1,
+    "SINT8": 2,
+    "SINT16": 3,
+    "SINT32": 4,
+    "SINT64": 5,
+    "Q_15_16": 6,
+    "UTF8S": 20,
+    "BYTES": 21,
+}
+
+# PROFILE_OP_* from profile.h.
+OPERATIONS = {
+    "READ": 0x01,
+    "WRITE": 0x02,
+    "MCU": 0x04,
+    "PASS_THROUGH": 0x08,
+}
+
+# PROFILE_AGG_* and PROFILE_WINDOW_* from profile.h.
+AGG_FUNCTIONS = {
+    "total": 0,
+    "sum": 1,
+    "avg": 2,
+    "min": 3,
+    "max": 4,
+    "count": 5,
+    "rate": 6,
+}
+
+WINDOWS = {
+    "none": 0,
+    "samples": 1,
+    "time": 2,
+}
+
+INTEGER_TYPES = ("BOOLEAN", "SINT8", "SINT16", "SINT32", "SINT64")
+
+HEADER = struct.Struct("<IHHIIIB3xHHIIIIIIH2x")
+ATTR = struct.Struct("<HHBBH")
+AGG = struct.Struct("<HHBBHII")
+
+
+def align4(n):
+    return (n + 3) & ~3
+
+
+def find_hash(ids):
+    bits = 1
+    while (1 << bits) < len(ids) * 2:
+        bits += 1
+    while bits <= PROFILE_MAX_SLOT_BITS:
+        shift = 32 - bits
+        mult = PROFILE_HASH_SEED
+        for _ in range(PROFILE_HASH_TRIES):
+            mult = ((mult * 1664525 + 1013904223) & 0xffffffff) | 1
+            slots = [0] * (1 << bits)
+            for i, attr_id in enumerate(ids):
+                slot = ((attr_id * mult) & 0xffffffff) >> shift
+                if slots[slot]:
+                    break
+                slots[slot] = i + 1
+            else:
+                return mult, shift, slots
+        bits += 1
+    sys.exit("profilec: no perfect hash fits in 2^%d slots" % PROFILE_MAX_SLOT_BITS)
+
+
+def load_attributes(path):
+    with open(path) as f:
+        desc = json.load(f)
+    attrs = {}
+    for service in desc["services"]:
+        for a in service["attributes"]:
+            if a["dataType"] not in DATA_TYPES:
+                sys.exit("profilec: attribute %d has unknown type %s" % (a["id"], a["dataType"]))
+            ops = 0
+            for op in a.get("operations", []):
+                ops |= OPERATIONS.get(op, 0)
+            if a["id"] in attrs:
+                sys.exit("profilec: attribute %d appears more than once" % a["id"])
+            attrs[a["id"]] = (a["id"], a["length"], DATA_TYPES[a["dataType"]], ops, a["semanticType"])
+    return [attrs[k] for k in sorted(attrs)]
+
+
+def load_aggregates(path, attrs):
+    by_name = {}
+    for attr_id, size, dtype, ops, name in attrs:
+        by_name[name] = (attr_id, dtype)
+    integer_types = [DATA_TYPES[t] for t in INTEGER_TYPES]
+
+    with open(path) as f:
+        config = json.load(f)
+    aggs = []
+    for g in config.get("aggregates", []):
+        for end in ("source", "output"):
+            if g[end] not in by_name:
+                sys.exit("profilec: aggregate %s %s is not in the profile" % (end, g[end]))
+            if by_name[g[end]][1] not in integer_types:
+                sys.exit("profilec: aggregate %s %s is not numeric" % (end, g[end]))
+        fn = AGG_FUNCTIONS[g["function"]]
+        window = WINDOWS[g.get("window", "none")]
+        span = g.get("span", 0)
+        capacity = g.get("capacity", span if window == WINDOWS["samples"] else 0)
+        if (window == WINDOWS["none"]) != (fn == AGG_FUNCTIONS["total"]):
+            sys.exit("profilec: only total goes without a window (%s)" % g["output"])
+        if window != WINDOWS["none"] and (span <= 0 or not 0 < capacity <= 0xffff):
+            sys.exit("profilec: %s needs a span and a capacity up to 65535" % g["output"])
+        if window == WINDOWS["samples"] and capacity != span:
+            sys.exit("profilec: %s: a sample window keeps exactly span samples" % g["output"])
+        aggs.append((by_name[g["source"]][0], by_name[g["output"]][0], fn, window,
+                     capacity, span, g.get("interval", 0)))
+    return sorted(aggs, key=lambda a: a[0])
+
+
+def compile_profile(attrs, aggs):
+    ids = [a[0] for a in attrs]
+    mult, shift, slots = find_hash(ids)
+
+    names = b""
+    attr_blob = b""
+    for attr_id, size, dtype, ops, name in attrs:
+        attr_blob += ATTR.pack(attr_id, size, dtype, ops, len(names))
+        names += name.encode("utf-8") + b"\0"
+    if len(names) > 0xffff:
+        sys.exit("profilec: attribute names don't fit in 64KB")
+    names += b"\0" * (align4(len(names)) - len(names))
+
+    agg_blob = b"".join(AGG.pack(*g) for g in aggs)
+
+    attrs_off = align4(HEADER.size)
+    slots_off = align4(attrs_off + len(attr_blob))
+    aggs_off = align4(slots_off + 2 * len(slots))
+    names_off = align4(aggs_off + len(agg_blob))
+    file_size = names_off + len(names)
+
+    body = bytearray(file_size - HEADER.size)
+    body[attrs_off - HEADER.size:attrs_off - HEADER.size + len(attr_blob)] = attr_blob
+    slot_blob = struct.pack("<%dH" % len(slots), *slots)
+    body[slots_off - HEADER.size:slots_off - HEADER.size + len(slot_blob)] = slot_blob
+    body[aggs_off - HEADER.size:aggs_off - HEADER.size + len(agg_blob)] = agg_blob
+    body[names_off - HEADER.size:] = names
+
+    header = HEADER.pack(PROFILE_MAGIC, PROFILE_VERSION, HEADER.size, file_size,
+                         zlib.crc32(bytes(body)) & 0xffffffff, mult, shift,
+                         len(attrs), 0, len(slots), attrs_off, slots_off, names_off, len(names),
+                         aggs_off, len(aggs))
+    return header + bytes(body)
+
+
+def main(argv):
+    if len(argv) not in (3, 4):
+        sys.exit("usage: profilec.py device-description.json device-profile.bin [aggregates.json]")
+    attrs = load_attributes(argv[1])
+    aggs = load_aggregates(argv[3], attrs) if len(argv) == 4 else []
+    image = compile_profile(attrs, aggs)
+    with open(argv[2], "wb") as f:
+        f.write(image)
+    print("profilec: %d attributes, %d aggregates, %d bytes" % (len(attrs), len(aggs), len(image)))
+
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -0,0 +1,215 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Running under systemd. See service.h.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <event2/event.h>
+
+#include "af_log.h"
+#include "service.h"
+
+static uint64_t service_ms(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void service_notify(service_t *s, const char *msg)
+{
+    if (s->notifyFd < 0) {
+        return;
+    }
+    if (send(s->notifyFd, msg, strlen(msg), MSG_NOSIGNAL) < 0) {
+        AFLOG_WARNING("my-app: service: sd_notify \"%s\" failed: %m", msg);
+    }
+}
+
+static int service_connect(const char *path)
+{
+    struct sockaddr_un sa;
+    size_t len = strlen(path);
+    int fd;
+
+    //
+    // An '@' means a socket in the abstract namespace, which starts with a NUL instead.
+    //
+    if ((path[0] != '/' && path[0] != '@') || len >= sizeof(sa.sun_path)) {
+        AFLOG_ERR("my-app: service: unusable NOTIFY_SOCKET %s", path);
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path, len);
+    if (path[0] == '@') {
+        sa.sun_path[0] = '\0';
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        AFLOG_ERR("my-app: service: socket: %m");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&sa, offsetof(struct sockaddr_un, sun_path) + len) < 0) {
+        AFLOG_ERR("my-app: service: can't connect to NOTIFY_SOCKET %s: %m", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void service_watchdog_cb(evutil_socket_t fd, short what, void *arg)
+{
+    service_t *s = (service_t *)arg;
+
+    service_notify(s, "WATCHDOG=1");
+    s->keepalives++;
+}
+
+static void service_deferred_cb(evutil_socket_t fd, short what, void *arg)
+{
+    service_t *s = (service_t *)arg;
+    struct timeval now = { 0, 0 };
+    unsigned i = s->deferredNext++;
+
+    s->deferred[i].fn(s->deferred[i].arg);
+    if (s->deferredNext < s->deferredCount) {
+        //
+        // A zero timeout rather than event_active(), so the loop polls for events before
+        // the next piece.
+        //
+        evtimer_add(s->deferredEv, &now);
+    }
+    else {
+        AFLOG_INFO("my-app: service: deferred startup work done %llu ms after start",
+                   (unsigned long long)(service_ms(CLOCK_MONOTONIC) - s->startMs));
+    }
+}
+
+static void service_ready_cb(evutil_socket_t fd, short what, void *arg)
+{
+    service_t *s = (service_t *)arg;
+    struct timeval now = { 0, 0 };
+    char status[96];
+
+    s->readyMs = service_ms(CLOCK_MONOTONIC);
+    snprintf(status, sizeof(status), "READY=1\nSTATUS=Ready in %llu ms",
+             (unsigned long long)(s->readyMs - s->startMs));
+    service_notify(s, status);
+    AFLOG_INFO("my-app: service: ready %llu ms after start, %llu ms after boot",
+               (unsigned long long)(s->readyMs - s->startMs),
+               (unsigned long long)(s->startBootMs + (s->readyMs - s->startMs)));
+
+    if (s->deferredCount > 0) {
+        evtimer_add(s->deferredEv, &now);
+    }
+}
+
+void service_mark_start(service_t *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->notifyFd    = -1;
+    s->startMs     = service_ms(CLOCK_MONOTONIC);
+    s->startBootMs = service_ms(CLOCK_BOOTTIME);
+}
+
+int service_init(service_t *s, struct event_base *base)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    const char *usec = getenv("WATCHDOG_USEC");
+    const char *pid  = getenv("WATCHDOG_PID");
+    struct timeval tv;
+
+    s->base = base;
+    s->deferredEv = evtimer_new(base, service_deferred_cb, s);
+    if (s->deferredEv == NULL) {
+        AFLOG_ERR("my-app: service: can't allocate events");
+        return -1;
+    }
+    if (path == NULL) {
+        return 0;  // Not started by systemd, or not as Type=notify.
+    }
+    s->notifyFd = service_connect(path);
+
+    //
+    // WATCHDOG_PID is there so a child doesn't answer for its parent.
+    //
+    if (usec != NULL && (pid == NULL || (pid_t)atol(pid) == getpid())) {
+        s->watchdogUsec = strtoull(usec, NULL, 10);
+    }
+    if (s->watchdogUsec > 0 && s->notifyFd >= 0) {
+        //
+        // Twice per period, as systemd recommends, so one late timer isn't fatal.
+        //
+        s->watchdog = event_new(base, -1, EV_PERSIST, service_watchdog_cb, s);
+        if (s->watchdog == NULL) {
+            AFLOG_ERR("my-app: service: can't allocate events");
+            return -1;
+        }
+        tv.tv_sec  = (s->watchdogUsec / 2) / 1000000;
+        tv.tv_usec = (s->watchdogUsec / 2) % 1000000;
+        evtimer_add(s->watchdog, &tv);
+        AFLOG_INFO("my-app: service: watchdog keepalive every %llu ms",
+                   (unsigned long long)(s->watchdogUsec / 2000));
+    }
+    return 0;
+}
+
+int service_defer(service_t *s, service_deferred_fn_t fn, void *arg)
+{
+    if (s->deferredCount == SERVICE_MAX_DEFERRED) {
+        fn(arg);
+        return -1;
+    }
+    s->deferred[s->deferredCount].fn  = fn;
+    s->deferred[s->deferredCount].arg = arg;
+    s->deferredCount++;
+    return 0;
+}
+
+void service_start(service_t *s)
+{
+    struct timeval now = { 0, 0 };
+
+    event_base_once(s->base, -1, EV_TIMEOUT, service_ready_cb, s, &now);
+}
+
+void service_first_attribute(service_t *s, uint16_t attrId)
+{
+    char status[96];
+
+    s->firstAttrMs = service_ms(CLOCK_MONOTONIC);
+    snprintf(status, sizeof(status), "STATUS=First attribute handled %llu ms after start",
+             (unsigned long long)(s->firstAttrMs - s->startMs));
+    service_notify(s, status);
+    AFLOG_INFO("my-app: service: first attribute (attrId=%d) handled %llu ms after start, %llu ms after boot",
+               attrId, (unsigned long long)(s->firstAttrMs - s->startMs),
+               (unsigned long long)(s->startBootMs + (s->firstAttrMs - s->startMs)));
+}
+
+void service_shutdown(service_t *s)
+{
+    service_notify(s, "STOPPING=1");
+    AFLOG_INFO("my-app: service: %u watchdog keepalives sent", s->keepalives);
+    if (s->watchdog) {
+        event_free(s->watchdog);
+        s->watchdog = NULL;
+    }
+    if (s->deferredEv) {
+        event_free(s->deferredEv);
+        s->deferredEv = NULL;
+    }
+    if (s->notifyFd >= 0) {
+        close(s->notifyFd);
+        s->notifyFd = -1;
+    }
+}
@@ -0,0 +1,105 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Running under systemd: readiness, watchdog and startup timing.
+
+   The unit (app.service in the recipe) is Type=notify, so systemd considers the app
+   started only once it says READY=1, and with WatchdogSec= set it restarts the app if
+   the WATCHDOG=1 keepalives stop. Both go over the sd_notify protocol, which is just a
+   datagram to the AF_UNIX socket named in $NOTIFY_SOCKET; it's spoken directly here so
+   the app doesn't need libsystemd. Run outside systemd there is no $NOTIFY_SOCKET and
+   all of this quietly does nothing, apart from the timing logs.
+
+   The keepalives are sent from a timer on the event loop, so a loop that stops
+   dispatching also stops them.
+
+   Startup is measured from the top of main() and from boot:
+
+     time to ready            main() until the event loop first runs
+     time to first attribute  main() until the first set request from the Cloud is handled
+
+   Both are loop 0's and device 0's. In gateway mode READY=1 goes out when loop 0 first
+   runs, whether or not the other loops have started, and only device 0's first set
+   request counts; the rest of the devices aren't timed.
+
+   Work the first event doesn't need can be handed to service_defer(). It runs after
+   READY=1 has gone out, one piece per pass of the event loop so events that arrive in
+   the meantime aren't held up behind it.
+*/
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <stdint.h>
+#include <event2/event.h>
+
+#define SERVICE_MAX_DEFERRED  8
+
+typedef void (*service_deferred_fn_t)(void *arg);
+
+typedef struct {
+    struct event_base *base;
+    int                notifyFd;      // -1 when not started by systemd.
+    struct event      *watchdog;
+    struct event      *deferredEv;
+    uint64_t           watchdogUsec;  // 0 when the unit has no WatchdogSec=.
+    //
+    // Work to do once we're ready.
+    //
+    struct {
+        service_deferred_fn_t fn;
+        void                 *arg;
+    } deferred[SERVICE_MAX_DEFERRED];
+    unsigned           deferredCount;
+    unsigned           deferredNext;
+    //
+    // Startup timing, in ms of CLOCK_MONOTONIC and CLOCK_BOOTTIME.
+    //
+    uint64_t           startMs;
+    uint64_t           startBootMs;
+    uint64_t           readyMs;
+    uint64_t           firstAttrMs;
+    uint32_t           keepalives;
+} service_t;
+
+//
+// Note the start time. Call this first thing in main().
+//
+void service_mark_start(service_t *s);
+
+//
+// Connect to $NOTIFY_SOCKET and set up the watchdog keepalives if systemd asked for
+// them. Only fails if libevent can't allocate; a missing or broken notify socket is
+// logged and otherwise ignored.
+//
+int service_init(service_t *s, struct event_base *base);
+
+//
+// Queue work for after readiness. Returns -1 if the queue is full, in which case the
+// work is done right away instead.
+//
+int service_defer(service_t *s, service_deferred_fn_t fn, void *arg);
+
+//
+// Call just before event_base_dispatch(). READY=1 goes out from the first pass of the
+// event loop, and then the deferred work starts.
+//
+void service_start(service_t *s);
+
+//
+// Call for every set request from the Cloud. Only the first one costs anything, in
+// service_first_attribute().
+//
+void service_first_attribute(service_t *s, uint16_t attrId);
+
+static inline void service_attribute_handled(service_t *s, uint16_t attrId)
+{
+    if (s->firstAttrMs == 0) {
+        service_first_attribute(s, attrId);
+    }
+}
+
+//
+// Tell systemd we're on the way out and free everything.
+//
+void service_shutdown(service_t *s);
+
+#endif // SERVICE_H
@@ -0,0 +1,429 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Outbound set tracking. See set_tracker.h.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+
+#include "af_log.h"
+#include "set_tracker.h"
+#include "trace.h"
+
+static uint64_t set_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void set_unlink(set_tracker_t *st, set_handle_t *h)
+{
+    if (h->prev) {
+        h->prev->next = h->next;
+    }
+    else {
+        st->head = h->next;
+    }
+    if (h->next) {
+        h->next->prev = h->prev;
+    }
+    else {
+        st->tail = h->prev;
+    }
+    h->prev = h->next = NULL;
+}
+
+//
+// Take a handle off the outstanding list and hand it to doneEv, which runs the callback
+// from the event loop.
+//
+static void set_complete(set_tracker_t *st, set_handle_t *h, int status)
+{
+    if (h->state == SET_STATE_PENDING) {
+        st->queued--;
+    }
+    else {
+        st->inFlight--;
+    }
+    if (status == SET_STATUS_OK) {
+        st->succeeded++;
+    }
+    else if (status != SET_STATUS_SUPERSEDED) {
+        st->failed++;
+        AFLOG_ERR("my-app: set: attrId=%d seq=%u failed after %d attempt(s), status=%d",
+                  h->attrId, h->seq, h->attempts, status);
+    }
+
+    set_unlink(st, h);
+    h->lastError = status;
+    if (st->doneTail) {
+        st->doneTail->next = h;
+    }
+    else {
+        st->done = h;
+    }
+    st->doneTail = h;
+    event_active(st->doneEv, EV_TIMEOUT, 0);
+}
+
+//
+// An attempt at attrId timed out; its response may turn up yet. Only one is expected per
+// attribute: an earlier one still outstanding just gets the later grace.
+//
+static void set_expect_late(set_tracker_t *st, uint16_t attrId, uint64_t now)
+{
+    unsigned i;
+
+    for (i = 0; i < st->expectLateCount; i++) {
+        if (st->expectLate[i].attrId == attrId) {
+            st->expectLateCount--;
+            memmove(&st->expectLate[i], &st->expectLate[i + 1], sizeof(st->expectLate[0]) * (st->expectLateCount - i));
+            break;
+        }
+    }
+    if (st->expectLateCount == SET_TRACKER_LATE_MAX) {
+        memmove(&st->expectLate[0], &st->expectLate[1], sizeof(st->expectLate[0]) * (SET_TRACKER_LATE_MAX - 1));
+        st->expectLateCount--;
+    }
+    st->expectLate[st->expectLateCount].attrId  = attrId;
+    st->expectLate[st->expectLateCount].untilMs = now + st->lateGraceMs;
+    st->expectLateCount++;
+}
+
+//
+// Is a response for attrId the late answer to an attempt that timed out? Forgets the
+// ones whose grace has run out on the way, and the one it finds.
+//
+static int set_take_late(set_tracker_t *st, uint16_t attrId, uint64_t now)
+{
+    unsigned i;
+    unsigned expired = 0;
+
+    while (expired < st->expectLateCount && st->expectLate[expired].untilMs <= now) {
+        expired++;
+    }
+    if (expired > 0) {
+        st->expectLateCount -= expired;
+        memmove(&st->expectLate[0], &st->expectLate[expired], sizeof(st->expectLate[0]) * st->expectLateCount);
+    }
+    for (i = 0; i < st->expectLateCount; i++) {
+        if (st->expectLate[i].attrId == attrId) {
+            st->expectLateCount--;
+            memmove(&st->expectLate[i], &st->expectLate[i + 1], sizeof(st->expectLate[0]) * (st->expectLateCount - i));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void set_fail_attempt(set_tracker_t *st, set_handle_t *h, uint64_t now)
+{
+    uint64_t backoff;
+
+    if (h->attempts >= st->maxAttempts) {
+        set_complete(st, h, h->lastError);
+        return;
+    }
+    //
+    // Exponential backoff with up to 25% jitter, so a burst of failures doesn't come
+    // back as a burst of retries.
+    //
+    backoff = (uint64_t)st->backoffMs << (h->attempts - 1);
+    if (backoff > st->backoffMaxMs) {
+        backoff = st->backoffMaxMs;
+    }
+    st->rng ^= st->rng << 13;
+    st->rng ^= st->rng >> 17;
+    st->rng ^= st->rng << 5;
+    backoff += st->rng % (backoff / 4 + 1);
+
+    h->state = SET_STATE_BACKOFF;
+    h->deadlineMs = now + backoff;
+    st->retries++;
+    AFLOG_INFO("my-app: set: attrId=%d seq=%u attempt %d failed (%d), retry in %llu ms",
+               h->attrId, h->seq, h->attempts, h->lastError, (unsigned long long)backoff);
+}
+
+static void set_send(set_tracker_t *st, set_handle_t *h, uint64_t now)
+{
+    af_lib_error_t ret;
+    uint64_t start = trace_now();
+
+    TRACE_PROBE(set__start, h->attrId, h->seq);
+    ret = asr_link_set(st->link, h->attrId, h->kind, h->value, h->len);
+
+    h->attempts++;
+    TRACE_PROBE(set__done, h->attrId, h->seq);
+    trace_span(TRACE_SET, start, h->attrId, h->seq, h->attempts);
+    trace_async_begin(TRACE_IN_FLIGHT, h->attrId, h->seq, h->attempts);
+
+    h->state = SET_STATE_IN_FLIGHT;
+    h->deadlineMs = now + h->timeoutMs;
+    h->lateTaken = 0;
+    if (ret != AF_SUCCESS) {
+        //
+        // af_lib didn't even take it. Same treatment as a failed response.
+        //
+        h->lastError = ret;
+        trace_async_end(TRACE_IN_FLIGHT, h->attrId, h->seq, ret);
+        set_fail_attempt(st, h, now);
+    }
+}
+
+//
+// Send whatever PENDING handles we can: there has to be a free in-flight slot, and no
+// older handle for the same attribute may still be outstanding.
+//
+static void set_pump(set_tracker_t *st, uint64_t now)
+{
+    set_handle_t *h;
+    set_handle_t *next;
+    set_handle_t *older;
+
+    for (h = st->head; h != NULL && st->inFlight < st->maxInFlight; h = next) {
+        next = h->next;  // h may move to the done list if af_lib refuses it for good.
+        if (h->state != SET_STATE_PENDING) {
+            continue;
+        }
+        for (older = h->prev; older != NULL; older = older->prev) {
+            if (older->attrId == h->attrId) {
+                break;
+            }
+        }
+        if (older != NULL) {
+            continue;
+        }
+        st->queued--;
+        st->inFlight++;
+        if (st->inFlight > st->peakInFlight) {
+            st->peakInFlight = st->inFlight;
+        }
+        set_send(st, h, now);
+    }
+}
+
+static void set_rearm(set_tracker_t *st, uint64_t now)
+{
+    set_handle_t *h;
+    uint64_t next = UINT64_MAX;
+    struct timeval tv;
+
+    for (h = st->head; h != NULL; h = h->next) {
+        if (h->state != SET_STATE_PENDING && h->deadlineMs < next) {
+            next = h->deadlineMs;
+        }
+    }
+    if (next == UINT64_MAX) {
+        evtimer_del(st->timer);
+        return;
+    }
+    next = next > now ? next - now : 0;
+    tv.tv_sec  = next / 1000;
+    tv.tv_usec = (next % 1000) * 1000;
+    evtimer_add(st->timer, &tv);
+}
+
+static void set_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+    set_tracker_t *st = (set_tracker_t *)arg;
+    set_handle_t *h;
+    set_handle_t *next;
+    uint64_t now = set_now_ms();
+
+    for (h = st->head; h != NULL; h = next) {
+        next = h->next;  // h may move to the done list.
+        if (h->state == SET_STATE_PENDING || h->deadlineMs > now) {
+            continue;
+        }
+        if (h->state == SET_STATE_IN_FLIGHT) {
+            st->timeouts++;
+            if (!h->lateTaken) {
+                set_expect_late(st, h->attrId, now);
+            }
+            h->lastError = SET_STATUS_TIMEOUT;
+            TRACE_PROBE(set__timeout, h->attrId, h->seq);
+            trace_async_end(TRACE_IN_FLIGHT, h->attrId, h->seq, SET_STATUS_TIMEOUT);
+            set_fail_attempt(st, h, now);
+        }
+        else {
+            set_send(st, h, now);  // Backoff is over. It still holds its slot.
+        }
+    }
+    set_pump(st, now);
+    set_rearm(st, now);
+}
+
+static void set_done_cb(evutil_socket_t fd, short what, void *arg)
+{
+    set_tracker_t *st = (set_tracker_t *)arg;
+    set_handle_t *h;
+
+    //
+    // Callbacks may submit more sets and even complete some (supersede), which pushes
+    // onto st->done again; keep going until it stays empty.
+    //
+    while ((h = st->done) != NULL) {
+        st->done = h->next;
+        if (st->done == NULL) {
+            st->doneTail = NULL;
+        }
+        if (h->cb) {
+            h->cb(st, h, h->lastError, h->ctx);
+        }
+        free(h);
+    }
+}
+
+int set_tracker_init(set_tracker_t *st, struct event_base *base, asr_link_t *link)
+{
+    memset(st, 0, sizeof(*st));
+    st->base         = base;
+    st->link         = link;
+    st->nextSeq      = 1;
+    st->rng          = (uint32_t)set_now_ms() | 1;
+    st->maxInFlight  = SET_TRACKER_MAX_IN_FLIGHT;
+    st->timeoutMs    = SET_TRACKER_TIMEOUT_MS;
+    st->maxAttempts  = SET_TRACKER_MAX_ATTEMPTS;
+    st->backoffMs    = SET_TRACKER_BACKOFF_MS;
+    st->backoffMaxMs = SET_TRACKER_BACKOFF_MAX_MS;
+    st->lateGraceMs  = SET_TRACKER_LATE_GRACE_MS;
+
+    st->timer  = evtimer_new(base, set_timer_cb, st);
+    st->doneEv = event_new(base, -1, 0, set_done_cb, st);
+    if (st->timer == NULL || st->doneEv == NULL) {
+        AFLOG_ERR("my-app: set: can't allocate tracker events");
+        set_tracker_shutdown(st);
+        return -1;
+    }
+    return 0;
+}
+
+void set_tracker_shutdown(set_tracker_t *st)
+{
+    while (st->head != NULL) {
+        set_complete(st, st->head, SET_STATUS_CANCELLED);
+    }
+    if (st->doneEv) {
+        set_done_cb(-1, 0, st);
+        event_free(st->doneEv);
+        st->doneEv = NULL;
+    }
+    if (st->timer) {
+        event_free(st->timer);
+        st->timer = NULL;
+    }
+}
+
+const set_handle_t *set_tracker_submit(set_tracker_t *st, uint16_t attrId, set_kind_t kind,
+                                       const void *value, uint16_t len, uint32_t timeoutMs,
+                                       set_done_cb_t cb, void *ctx)
+{
+    set_handle_t *h;
+    set_handle_t *last;
+    uint64_t now = set_now_ms();
+
+    h = malloc(sizeof(*h) + len);
+    if (h == NULL) {
+        AFLOG_ERR("my-app: set: out of memory queueing attrId=%d", attrId);
+        return NULL;
+    }
+    memset(h, 0, sizeof(*h));
+    h->seq         = st->nextSeq++;
+    h->attrId      = attrId;
+    h->len         = len;
+    h->kind        = kind;
+    h->state       = SET_STATE_PENDING;
+    h->timeoutMs   = timeoutMs ? timeoutMs : st->timeoutMs;
+    h->submittedMs = now;
+    h->cb          = cb;
+    h->ctx         = ctx;
+    memcpy(h->value, value, len);
+
+    //
+    // Latest value wins: an unsent set to the same attribute is pointless now.
+    //
+    for (last = st->tail; last != NULL; last = last->prev) {
+        if (last->attrId == attrId) {
+            if (last->state == SET_STATE_PENDING) {
+                set_complete(st, last, SET_STATUS_SUPERSEDED);
+            }
+            break;
+        }
+    }
+
+    h->prev = st->tail;
+    if (st->tail) {
+        st->tail->next = h;
+    }
+    else {
+        st->head = h;
+    }
+    st->tail = h;
+    st->queued++;
+    st->submitted++;
+
+    set_pump(st, now);
+    set_rearm(st, now);
+    return h;
+}
+
+void set_tracker_response(set_tracker_t *st, uint16_t attrId, af_lib_error_t error)
+{
+    set_handle_t *h;
+    uint64_t now = set_now_ms();
+
+    //
+    // Only one set per attribute is ever in flight, so the first match is the one.
+    //
+    for (h = st->head; h != NULL; h = h->next) {
+        if (h->attrId == attrId && h->state == SET_STATE_IN_FLIGHT) {
+            break;
+        }
+    }
+
+    //
+    // An attempt that timed out is answered before anything sent after it. Either way
+    // one of the two answers we were waiting for is in, so if the attempt in flight
+    // times out too it leaves nothing more to expect.
+    //
+    if (set_take_late(st, attrId, now)) {
+        if (h != NULL) {
+            h->lateTaken = 1;
+        }
+        st->unmatched++;
+        st->late++;
+        AFLOG_INFO("my-app: set: late response for attrId=%d dropped, error=%d", attrId, error);
+        return;
+    }
+    if (h == NULL) {
+        st->unmatched++;
+        AFLOG_INFO("my-app: set: response for attrId=%d with nothing in flight, error=%d", attrId, error);
+        return;
+    }
+
+    TRACE_PROBE(set__answered, attrId, error);
+    trace_async_end(TRACE_IN_FLIGHT, attrId, h->seq, error);
+    if (error == AF_SUCCESS) {
+        AFLOG_INFO("my-app: set: attrId=%d seq=%u landed in %llu ms, %d attempt(s)", attrId, h->seq,
+                   (unsigned long long)(now - h->submittedMs), h->attempts);
+        set_complete(st, h, SET_STATUS_OK);
+    }
+    else {
+        h->lastError = error;
+        set_fail_attempt(st, h, now);
+    }
+    set_pump(st, now);
+    set_rearm(st, now);
+}
+
+void set_tracker_log_stats(const set_tracker_t *st)
+{
+    AFLOG_INFO("my-app: set: submitted=%u succeeded=%u failed=%u retries=%u timeouts=%u unmatched=%u late=%u "
+               "in_flight=%u queued=%u peak_in_flight=%u",
+               st->submitted, st->succeeded, st->failed, st->retries, st->timeouts, st->unmatched,
+               st->late, st->inFlight, st->queued, st->peakInFlight);
+}
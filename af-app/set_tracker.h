@@ -0,0 +1,156 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tracks outbound attribute sets until the ASR confirms them.
+
+   On their own, the af_lib_set_attribute_* calls are fire-and-forget: the ASR answers
+   each one later with an AF_LIB_EVENT_ASR_SET_RESPONSE, which the app used to just log.
+   The set tracker gives every outbound set a handle with a completion callback and a
+   timeout, matches the ASR_SET_RESPONSE events back to the handles, and retries sets
+   that fail or time out with exponential backoff.
+
+   Many sets can be in flight at once, up to a configurable cap. Sets to the same
+   attribute are kept in order: a second set to an attribute isn't sent until the first
+   one has completed, so a retry can never land on top of a newer value and a response
+   always belongs to the oldest set in flight for its attribute.
+
+   A set that times out may still be answered later. The ASR_SET_RESPONSE doesn't say
+   which attempt it is for, so for SET_TRACKER_LATE_GRACE_MS after a timeout the next
+   response for that attribute is taken to be the late one and dropped, rather than
+   credited to the retry. At most one late response is expected per attribute. If it
+   never comes the retry's own is dropped in its place and the retry times out, but
+   that timeout expects nothing more: one of the two answers did come. The attempt after
+   it is credited with the next response, so a lost response costs one extra attempt
+   rather than the set. The same goes for the next set to an attribute whose last set
+   timed out for good.
+
+   Completion callbacks always run from the event loop, never from inside
+   set_tracker_submit(), so a handler can safely submit follow-up sets from them.
+*/
+#ifndef SET_TRACKER_H
+#define SET_TRACKER_H
+
+#include <stdint.h>
+#include <event2/event.h>
+#include "aflib.h"
+#include "asr_link.h"
+
+//
+// Defaults. All of them can be changed in the set_tracker_t after set_tracker_init().
+//
+#define SET_TRACKER_MAX_IN_FLIGHT   8
+#define SET_TRACKER_TIMEOUT_MS      5000
+#define SET_TRACKER_MAX_ATTEMPTS    4
+#define SET_TRACKER_BACKOFF_MS      250
+#define SET_TRACKER_BACKOFF_MAX_MS  8000
+#define SET_TRACKER_LATE_GRACE_MS   10000
+#define SET_TRACKER_LATE_MAX        16    // Attributes with a late response expected at once.
+
+//
+// Completion status handed to the callback. Anything else is the af_lib_error_t the
+// ASR (or af_lib itself) reported on the last attempt.
+//
+#define SET_STATUS_OK          AF_SUCCESS
+#define SET_STATUS_TIMEOUT     (-1000)
+#define SET_STATUS_CANCELLED   (-1001)
+#define SET_STATUS_SUPERSEDED  (-1002)  // A newer set to the same attribute replaced it before it was sent.
+
+typedef struct set_handle set_handle_t;
+typedef struct set_tracker set_tracker_t;
+
+typedef void (*set_done_cb_t)(set_tracker_t *st, const set_handle_t *h, int status, void *ctx);
+
+typedef enum {
+    SET_STATE_PENDING,    // Waiting for an in-flight slot or for its attribute to be free.
+    SET_STATE_IN_FLIGHT,  // Sent, waiting for ASR_SET_RESPONSE.
+    SET_STATE_BACKOFF,    // Failed, waiting to be sent again.
+} set_state_t;
+
+struct set_handle {
+    set_handle_t   *prev;
+    set_handle_t   *next;
+    uint32_t        seq;          // Unique per tracker, handy for logs.
+    uint16_t        attrId;
+    uint16_t        len;
+    set_kind_t      kind;
+    set_state_t     state;
+    uint8_t         attempts;     // Times it has been sent so far.
+    uint8_t         lateTaken;    // A late response was dropped while this attempt was in flight.
+    int             lastError;
+    uint32_t        timeoutMs;
+    uint64_t        submittedMs;  // When set_tracker_submit() was called.
+    uint64_t        deadlineMs;   // Response timeout, or end of backoff.
+    set_done_cb_t   cb;
+    void           *ctx;
+    uint8_t         value[];      // Our own copy of the value, for retries.
+};
+
+struct set_tracker {
+    struct event_base *base;
+    asr_link_t        *link;      // af_lib, or a fake ASR. See asr_link.h.
+    struct event      *timer;     // One timer for the earliest deadline of all handles.
+    struct event      *doneEv;    // Runs the completion callbacks from the event loop.
+    set_handle_t      *head;      // All outstanding handles, oldest first.
+    set_handle_t      *tail;
+    set_handle_t      *done;      // Completed handles waiting for their callback, in order.
+    set_handle_t      *doneTail;
+    uint32_t           nextSeq;
+    uint32_t           rng;       // For backoff jitter.
+    //
+    // Configuration.
+    //
+    unsigned           maxInFlight;
+    unsigned           timeoutMs;
+    unsigned           maxAttempts;
+    unsigned           backoffMs;
+    unsigned           backoffMaxMs;
+    unsigned           lateGraceMs;
+    //
+    // Attempts that timed out and may still be answered, oldest first.
+    //
+    struct {
+        uint16_t       attrId;
+        uint64_t       untilMs;
+    }                  expectLate[SET_TRACKER_LATE_MAX];
+    unsigned           expectLateCount;
+    //
+    // Statistics, reported with set_tracker_log_stats().
+    //
+    unsigned           inFlight;  // IN_FLIGHT plus BACKOFF handles.
+    unsigned           queued;    // PENDING handles.
+    unsigned           peakInFlight;
+    uint32_t           submitted;
+    uint32_t           succeeded;
+    uint32_t           failed;
+    uint32_t           retries;
+    uint32_t           timeouts;
+    uint32_t           unmatched; // Responses dropped: nothing in flight, or late.
+    uint32_t           late;      // The late ones.
+};
+
+int set_tracker_init(set_tracker_t *st, struct event_base *base, asr_link_t *link);
+
+//
+// Cancel everything still outstanding (callbacks see SET_STATUS_CANCELLED) and free
+// the tracker's resources.
+//
+void set_tracker_shutdown(set_tracker_t *st);
+
+//
+// Queue a set. The value is copied. timeoutMs of 0 uses st->timeoutMs and cb may be
+// NULL. If an earlier set to the same attribute hasn't been sent yet it is dropped in
+// favor of this one and completes with SET_STATUS_SUPERSEDED. Returns the handle, which
+// stays valid until its callback returns, or NULL if memory ran out (nothing is queued
+// and the callback will not run).
+//
+const set_handle_t *set_tracker_submit(set_tracker_t *st, uint16_t attrId, set_kind_t kind,
+                                       const void *value, uint16_t len, uint32_t timeoutMs,
+                                       set_done_cb_t cb, void *ctx);
+
+//
+// Feed an AF_LIB_EVENT_ASR_SET_RESPONSE to the tracker.
+//
+void set_tracker_response(set_tracker_t *st, uint16_t attrId, af_lib_error_t error);
+
+void set_tracker_log_stats(const set_tracker_t *st);
+
+#endif // SET_TRACKER_H
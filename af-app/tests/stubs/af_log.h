@@ -0,0 +1,25 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Stand-in for the Afero SDK's af_log.h, for the unit tests only.
+
+   The tests build for the host, where there is no SDK. Logging goes to stderr when
+   TEST_LOG is set in the environment and nowhere otherwise.
+*/
+#ifndef AF_LOG_H
+#define AF_LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_AFLOG(...) \
+    do { if (getenv("TEST_LOG")) { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } } while (0)
+
+#define AFLOG_ERR(...)      TEST_AFLOG(__VA_ARGS__)
+#define AFLOG_WARNING(...)  TEST_AFLOG(__VA_ARGS__)
+#define AFLOG_NOTICE(...)   TEST_AFLOG(__VA_ARGS__)
+#define AFLOG_INFO(...)     TEST_AFLOG(__VA_ARGS__)
+#define AFLOG_DEBUG1(...)   TEST_AFLOG(__VA_ARGS__)
+#define AFLOG_DEBUG2(...)   TEST_AFLOG(__VA_ARGS__)
+#define AFLOG_DEBUG3(...)   TEST_AFLOG(__VA_ARGS__)
+
+#endif // AF_LOG_H
@@ -0,0 +1,37 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Stand-in for the Afero SDK's aflib.h, for the unit tests only.
+
+   Just the types and constants the app's modules use. Nothing here is linked; a test
+   that needs an ASR gives the module an asr_link_t of its own.
+*/
+#ifndef AFLIB_H
+#define AFLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct af_lib af_lib_t;
+typedef int af_lib_error_t;
+
+typedef enum {
+    AF_LIB_EVENT_UNKNOWN,
+    AF_LIB_EVENT_ASR_SET_RESPONSE,
+    AF_LIB_EVENT_MCU_SET_REQ_SENT,
+    AF_LIB_EVENT_MCU_SET_REQ_REJECTED,
+    AF_LIB_EVENT_ASR_GET_REQUEST,
+    AF_LIB_EVENT_MCU_DEFAULT_NOTIFICATION,
+    AF_LIB_EVENT_ASR_NOTIFICATION,
+    AF_LIB_EVENT_MCU_SET_REQUEST,
+} af_lib_event_type_t;
+
+typedef enum {
+    AF_LIB_SET_REASON_LOCAL_CHANGE,
+    AF_LIB_SET_REASON_GET_RESPONSE,
+} af_lib_set_reason_t;
+
+#define AF_SUCCESS               0
+#define AF_ERROR_BUSY           -2
+#define AF_ERROR_NOT_SUPPORTED  -7
+
+#endif // AFLIB_H
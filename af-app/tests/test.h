@@ -0,0 +1,30 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Just enough of a test harness for make check.
+
+   Each test program checks one module and exits non-zero if any CHECK failed.
+*/
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+static int sTestChecks;
+static int sTestFailures;
+
+#define CHECK(cond) \
+    do { \
+        sTestChecks++; \
+        if (!(cond)) { \
+            sTestFailures++; \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+//
+// Return this from main().
+//
+#define TEST_DONE() \
+    (printf("%s: %d checks, %d failed\n", __FILE__, sTestChecks, sTestFailures), sTestFailures ? 1 : 0)
+
+#endif // TEST_H
@@ -0,0 +1,172 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for attr_mirror.c: the seqlock under a writer thread, and readers finding out
+   that the mirror is no good any more.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "device-description.h"
+#include "attr_mirror.h"
+#include "profile.h"
+#include "test.h"
+
+static profile_t sProfile;
+
+static attr_mirror_entry_t *entry_of(attr_mirror_t *m, uint16_t id)
+{
+    const uint32_t *slots = (const uint32_t *)((uint8_t *)m->hdr + m->hdr->slotsOffset);
+
+    return (attr_mirror_entry_t *)((uint8_t *)m->hdr + slots[profile_slot(&sProfile, id)]);
+}
+
+static void test_read_back(void)
+{
+    attr_mirror_t w, r;
+    int32_t sum = 1234, got = 0;
+    uint16_t len = 0;
+    uint64_t t = 0;
+    char buf[8];
+
+    CHECK(attr_mirror_create(&w, &sProfile) == 0);
+    CHECK(attr_mirror_open(&r) == 0);
+    CHECK(attr_mirror_read(&r, AF_CURRENTSUM, &got, sizeof(got), &len, &t) == 0 && len == 0);
+
+    attr_mirror_write(&w, AF_CURRENTSUM, &sum, sizeof(sum));
+    CHECK(attr_mirror_read(&r, AF_CURRENTSUM, &got, sizeof(got), &len, &t) == 0);
+    CHECK(got == 1234 && len == sizeof(sum) && t != 0);
+
+    // A short buffer gets what fits, and the full length.
+    attr_mirror_write(&w, AF_REVERSED, "0123456789", 10);
+    CHECK(attr_mirror_read(&r, AF_REVERSED, buf, sizeof(buf), &len, NULL) == 0);
+    CHECK(len == 10 && memcmp(buf, "01234567", 8) == 0);
+
+    errno = 0;
+    CHECK(attr_mirror_read(&r, 1000, buf, sizeof(buf), &len, NULL) == -1 && errno == ENOENT);
+
+    // Stuck halfway through a write: the read gives up.
+    entry_of(&w, AF_CURRENTSUM)->seq |= 1;
+    errno = 0;
+    CHECK(attr_mirror_read(&r, AF_CURRENTSUM, &got, sizeof(got), &len, NULL) == -1 && errno == EAGAIN);
+    entry_of(&w, AF_CURRENTSUM)->seq++;
+
+    // The app shuts down.
+    attr_mirror_close(&w);
+    errno = 0;
+    CHECK(attr_mirror_read(&r, AF_CURRENTSUM, &got, sizeof(got), &len, NULL) == -1 && errno == ESTALE);
+    attr_mirror_close(&r);
+    CHECK(attr_mirror_open(&r) == -1);
+}
+
+//
+// The app dies without shutting down; alive is still set, but nobody is behind it.
+//
+static void test_writer_gone(void)
+{
+    attr_mirror_t w, r;
+    int32_t got;
+    uint16_t len;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+        _exit(attr_mirror_create(&w, &sProfile) == 0 ? 0 : 1);
+    }
+    CHECK(pid > 0 && waitpid(pid, NULL, 0) == pid);
+    CHECK(attr_mirror_open(&r) == 0);
+    CHECK(r.hdr != NULL && r.hdr->alive == 1);
+    errno = 0;
+    CHECK(attr_mirror_read(&r, AF_CURRENTSUM, &got, sizeof(got), &len, NULL) == -1 && errno == ESTALE);
+    attr_mirror_close(&r);
+    shm_unlink(ATTR_MIRROR_NAME);
+}
+
+//
+// A slot that points past the end, by just enough to wrap in 32 bits.
+//
+static void test_open_rejects_bad_slot(void)
+{
+    attr_mirror_t w, r;
+    uint32_t *slots;
+
+    CHECK(attr_mirror_create(&w, &sProfile) == 0);
+    slots = (uint32_t *)((uint8_t *)w.hdr + w.hdr->slotsOffset);
+    slots[profile_slot(&sProfile, AF_CURRENTSUM)] = 0xfffffff8u;
+    CHECK(attr_mirror_open(&r) == -1);
+    slots[profile_slot(&sProfile, AF_CURRENTSUM)] = w.hdr->totalSize - 8;
+    CHECK(attr_mirror_open(&r) == -1);
+    attr_mirror_close(&w);
+}
+
+//
+// Every byte of the value is the same, and goes up by one with every write, so a torn
+// copy shows up as bytes that differ.
+//
+static volatile int sStop;
+
+static void *writer_thread(void *arg)
+{
+    attr_mirror_t *w = (attr_mirror_t *)arg;
+    uint8_t value[AF_REVERSED_SZ];
+    uint8_t n = 0;
+
+    while (!sStop) {
+        n++;
+        memset(value, n, sizeof(value));
+        attr_mirror_write(w, AF_REVERSED, value, (uint16_t)(sizeof(value) - n % 16));
+    }
+    return NULL;
+}
+
+static void test_seqlock(void)
+{
+    attr_mirror_t w, r;
+    pthread_t thread;
+    uint8_t buf[AF_REVERSED_SZ];
+    uint16_t len;
+    int i, j, reads = 0, torn = 0, busy = 0;
+
+    CHECK(attr_mirror_create(&w, &sProfile) == 0);
+    CHECK(attr_mirror_open(&r) == 0);
+    sStop = 0;
+    pthread_create(&thread, NULL, writer_thread, &w);
+    for (i = 0; i < 200000; i++) {
+        if (attr_mirror_read(&r, AF_REVERSED, buf, sizeof(buf), &len, NULL) != 0) {
+            busy += errno == EAGAIN;
+            continue;
+        }
+        reads++;
+        for (j = 1; j < len; j++) {
+            if (buf[j] != buf[0]) {
+                torn++;
+                break;
+            }
+        }
+        if (len > 0 && len != sizeof(buf) - buf[0] % 16) {
+            torn++;
+        }
+    }
+    sStop = 1;
+    pthread_join(thread, NULL);
+    CHECK(reads > 0 && torn == 0);
+    CHECK(reads + busy == 200000);
+    CHECK(w.writes > 0 && w.truncated == 0);
+    attr_mirror_close(&r);
+    attr_mirror_close(&w);
+}
+
+int main(void)
+{
+    CHECK(profile_load_builtin(&sProfile) == 0);
+    test_read_back();
+    test_writer_gone();
+    test_open_rejects_bad_slot();
+    test_seqlock();
+    profile_unload(&sProfile);
+    return TEST_DONE();
+}
@@ -0,0 +1,221 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for event_queue.c: the order events come out in, and collapsing.
+*/
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+
+#include "device-description.h"
+#include "event_queue.h"
+#include "profile.h"
+#include "test.h"
+
+#define LOG_MAX  (EVQ_CAPACITY * 2)
+
+typedef struct {
+    af_lib_event_type_t eventType;
+    uint16_t            attrId;
+    uint16_t            len;
+    uint8_t             first;   // First byte of the value.
+} seen_t;
+
+static struct event_base *sBase;
+static profile_t sProfile;
+static event_queue_t sQ;
+static seen_t sHandled[LOG_MAX];
+static int sHandledCount;
+static seen_t sCollapsed[LOG_MAX];
+static int sCollapsedCount;
+
+static void handler(void *ctx, const af_lib_event_type_t eventType, const af_lib_error_t error,
+                    const uint16_t attributeId, const uint16_t valueLen, const uint8_t *value)
+{
+    seen_t *s = &sHandled[sHandledCount++ % LOG_MAX];
+
+    s->eventType = eventType;
+    s->attrId    = attributeId;
+    s->len       = valueLen;
+    s->first     = valueLen ? value[0] : 0;
+}
+
+static void collapsed(void *ctx, uint16_t attributeId, uint16_t valueLen, const uint8_t *value)
+{
+    seen_t *s = &sCollapsed[sCollapsedCount++ % LOG_MAX];
+
+    s->eventType = AF_LIB_EVENT_MCU_SET_REQUEST;
+    s->attrId    = attributeId;
+    s->len       = valueLen;
+    s->first     = valueLen ? value[0] : 0;
+}
+
+static void setup(void)
+{
+    sHandledCount = sCollapsedCount = 0;
+    event_queue_init(&sQ, sBase, &sProfile, handler, collapsed, NULL);
+}
+
+static void set_request(uint16_t attrId, uint8_t v, uint16_t len)
+{
+    uint8_t value[256];
+
+    memset(value, v, sizeof(value));
+    event_queue_push(&sQ, AF_LIB_EVENT_MCU_SET_REQUEST, AF_SUCCESS, attrId, len, value);
+}
+
+static unsigned depth(void)
+{
+    unsigned n = 0;
+    int i;
+
+    for (i = 0; i < EVQ_CLASS_COUNT; i++) {
+        n += sQ.cls[i].depth;
+    }
+    return n;
+}
+
+static void drain(void)
+{
+    int i;
+
+    for (i = 0; i < 1000 && depth() > 0; i++) {
+        event_base_loop(sBase, EVLOOP_NONBLOCK);
+    }
+}
+
+//
+// Nothing is handled from inside push, and classes come out most urgent first.
+//
+static void test_priority(void)
+{
+    setup();
+    event_queue_set_class(&sQ, AF_TOGGLELED, EVQ_CLASS_CONTROL);
+    set_request(AF_REVERSED, 'r', 20);     // bulk
+    set_request(AF_GETDOUBLED, 1, 2);      // normal
+    event_queue_push(&sQ, AF_LIB_EVENT_ASR_NOTIFICATION, AF_SUCCESS, 65001, 0, NULL); // system
+    set_request(AF_TOGGLELED, 1, 1);       // control
+    CHECK(sHandledCount == 0);
+
+    drain();
+    CHECK(sHandledCount == 4);
+    CHECK(sHandled[0].attrId == AF_TOGGLELED);
+    CHECK(sHandled[1].eventType == AF_LIB_EVENT_ASR_NOTIFICATION);
+    CHECK(sHandled[2].attrId == AF_GETDOUBLED);
+    CHECK(sHandled[3].attrId == AF_REVERSED && sHandled[3].len == 20 && sHandled[3].first == 'r');
+    CHECK(sQ.cls[EVQ_CLASS_BULK].aged == 0);
+    event_queue_free(&sQ);
+}
+
+//
+// A bulk event that has waited past its age goes ahead of newer, more urgent ones.
+//
+static void test_aging(void)
+{
+    struct timespec ms = { 0, 3000000 };
+
+    setup();
+    sQ.cls[EVQ_CLASS_BULK].ageMs = 1;
+    set_request(AF_REVERSED, 'r', 4);
+    nanosleep(&ms, NULL);
+    set_request(AF_GETDOUBLED, 1, 2);
+    drain();
+    CHECK(sHandledCount == 2 && sHandled[0].attrId == AF_REVERSED && sHandled[1].attrId == AF_GETDOUBLED);
+    CHECK(sQ.cls[EVQ_CLASS_BULK].aged == 1);
+    event_queue_free(&sQ);
+}
+
+//
+// Latest value wins while a request is queued; the older ones are acknowledged as
+// collapsed. Aggregate sources and other event types are left alone.
+//
+static void test_collapse(void)
+{
+    setup();
+    set_request(AF_GETDOUBLED, 1, 2);
+    set_request(AF_REVERSED, 'a', 4);
+    set_request(AF_GETDOUBLED, 2, 2);
+    set_request(AF_REVERSED, 'b', 200);    // Outgrows the inline value.
+    set_request(AF_GETDOUBLED, 3, 2);
+    CHECK(sCollapsedCount == 3);
+    CHECK(sCollapsed[0].attrId == AF_GETDOUBLED && sCollapsed[0].first == 1);
+    CHECK(sCollapsed[1].attrId == AF_REVERSED && sCollapsed[1].first == 'a' && sCollapsed[1].len == 4);
+    CHECK(sCollapsed[2].attrId == AF_GETDOUBLED && sCollapsed[2].first == 2);
+    CHECK(sQ.cls[EVQ_CLASS_NORMAL].collapsed == 2 && sQ.cls[EVQ_CLASS_BULK].collapsed == 1);
+
+    drain();
+    CHECK(sHandledCount == 2);
+    CHECK(sHandled[0].attrId == AF_GETDOUBLED && sHandled[0].first == 3);
+    CHECK(sHandled[1].attrId == AF_REVERSED && sHandled[1].first == 'b' && sHandled[1].len == 200);
+
+    // Handled, so the next one queues afresh.
+    set_request(AF_GETDOUBLED, 4, 2);
+    CHECK(sCollapsedCount == 3);
+    drain();
+    CHECK(sHandledCount == 3 && sHandled[2].first == 4);
+
+    // Every value sent to an aggregate source counts.
+    set_request(AF_GETADDED, 5, 1);
+    set_request(AF_GETADDED, 6, 1);
+    event_queue_push(&sQ, AF_LIB_EVENT_ASR_SET_RESPONSE, AF_SUCCESS, AF_GETDOUBLED, 0, NULL);
+    event_queue_push(&sQ, AF_LIB_EVENT_ASR_SET_RESPONSE, AF_SUCCESS, AF_GETDOUBLED, 0, NULL);
+    CHECK(sCollapsedCount == 3);
+    drain();
+    CHECK(sHandledCount == 7 && sHandled[5].first == 5 && sHandled[6].first == 6);
+    event_queue_free(&sQ);
+}
+
+static uint32_t hist_total(const evq_class_state_t *c)
+{
+    uint32_t n = 0;
+    int i;
+
+    for (i = 0; i < EVQ_HIST_BUCKETS; i++) {
+        n += c->waitHist[i];
+    }
+    return n;
+}
+
+//
+// A full queue handles the next event in line to make room; the new one doesn't jump
+// ahead, and every event shows up in its class's waits. free() handles what's left.
+//
+static void test_overflow_and_free(void)
+{
+    const evq_class_state_t *sys = &sQ.cls[EVQ_CLASS_SYSTEM];
+    const evq_class_state_t *norm = &sQ.cls[EVQ_CLASS_NORMAL];
+    int i;
+
+    setup();
+    for (i = 0; i < EVQ_CAPACITY; i++) {
+        event_queue_push(&sQ, AF_LIB_EVENT_ASR_NOTIFICATION, AF_SUCCESS, (uint16_t)(65000 + i), 0, NULL);
+    }
+    CHECK(sHandledCount == 0 && sQ.overflows == 0);
+    set_request(AF_GETDOUBLED, 9, 2);
+    CHECK(sHandledCount == 1 && sQ.overflows == 1 && sHandled[0].attrId == 65000);
+    event_queue_push(&sQ, AF_LIB_EVENT_ASR_NOTIFICATION, AF_SUCCESS, (uint16_t)(65000 + EVQ_CAPACITY), 0, NULL);
+    CHECK(sHandledCount == 2 && sQ.overflows == 2 && sHandled[1].attrId == 65001);
+
+    event_queue_free(&sQ);
+    CHECK(sHandledCount == EVQ_CAPACITY + 2);
+    for (i = 0; i <= EVQ_CAPACITY; i++) {
+        CHECK(sHandled[i].attrId == 65000 + i);
+    }
+    CHECK(sHandled[EVQ_CAPACITY + 1].attrId == AF_GETDOUBLED && sHandled[EVQ_CAPACITY + 1].first == 9);
+    CHECK(sys->queued == EVQ_CAPACITY + 1 && sys->handled == EVQ_CAPACITY + 1);
+    CHECK(hist_total(sys) == EVQ_CAPACITY + 1);
+    CHECK(norm->queued == 1 && norm->handled == 1 && hist_total(norm) == 1);
+}
+
+int main(void)
+{
+    sBase = event_base_new();
+    CHECK(profile_load_builtin(&sProfile) == 0);
+    test_priority();
+    test_aging();
+    test_collapse();
+    test_overflow_and_free();
+    profile_unload(&sProfile);
+    event_base_free(sBase);
+    return TEST_DONE();
+}
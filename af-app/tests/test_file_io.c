@@ -0,0 +1,311 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for file_io.c. make check runs them twice: with io_uring if the kernel has it,
+   and as tests/test_file_io_pool, built with -DAPP_NO_IO_URING, on the worker threads.
+*/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <event2/event.h>
+
+#include "file_io.h"
+#include "test.h"
+
+typedef struct {
+    int      calls;
+    int32_t  result;
+    int      again;       // Queue another read from the callback this many more times.
+    file_io_t *io;
+    char     buf[64];
+} seen_t;
+
+static struct event_base *sBase;
+static char sPath[] = "/tmp/test_file_io.XXXXXX";
+static int sFd = -1;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+//
+// Run sBase until cond holds, for up to a second.
+//
+#define RUN_UNTIL(cond) do { \
+        struct timespec ms = { 0, 1000000 }; \
+        int tries; \
+        for (tries = 0; tries < 1000 && !(cond); tries++) { \
+            event_base_loop(sBase, EVLOOP_NONBLOCK); \
+            if (!(cond)) nanosleep(&ms, NULL); \
+        } \
+    } while (0)
+
+#ifdef APP_IO_URING
+//
+// file_io.c makes its io_uring system calls through syscall(); ours stands in for libc's
+// so the kernel can be made to turn a batch away.
+//
+static int sFailEnters;   // io_uring_enter() calls still to fail with EAGAIN.
+
+long syscall(long number, ...)
+{
+    static long (*real)(long, ...);
+    long a[6];
+    va_list ap;
+    int i;
+
+    if (real == NULL) {
+        real = (long (*)(long, ...))dlsym(RTLD_NEXT, "syscall");
+    }
+    va_start(ap, number);
+    for (i = 0; i < 6; i++) {
+        a[i] = va_arg(ap, long);
+    }
+    va_end(ap);
+    if (number == __NR_io_uring_enter && sFailEnters > 0) {
+        sFailEnters--;
+        errno = EAGAIN;
+        return -1;
+    }
+    return real(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+#endif
+
+static void seen_cb(file_io_req_t *req, void *ctx)
+{
+    seen_t *s = (seen_t *)ctx;
+
+    s->calls++;
+    s->result = req->result;
+    if (s->again > 0) {
+        s->again--;
+        if (file_io_read(s->io, req, req->fd, s->buf, sizeof(s->buf), 0, seen_cb, s) != 0) {
+            s->again = -1;   // Refused.
+        }
+    }
+}
+
+static void setup(file_io_t *io)
+{
+    CHECK(file_io_init(io, sBase) == 0);
+#ifdef APP_NO_IO_URING
+    CHECK(io->backend == FILE_IO_POOL);
+#else
+    CHECK(io->backend != FILE_IO_NONE);
+#endif
+}
+
+//
+// A batch queued in one pass goes to the backend together, and comes back.
+//
+static void test_read_write(void)
+{
+    file_io_t io;
+    file_io_req_t req[3];
+    seen_t s[3];
+    const char *text[3] = { "first ", "second ", "third" };
+    uint64_t at;
+    int i;
+
+    setup(&io);
+    memset(s, 0, sizeof(s));
+    for (i = 0, at = 0; i < 3; at += strlen(text[i]), i++) {
+        CHECK(file_io_write(&io, &req[i], sFd, text[i], strlen(text[i]), at, seen_cb, &s[i]) == 0);
+    }
+    CHECK(s[0].calls == 0);   // Never from inside the call.
+    RUN_UNTIL(s[0].calls && s[1].calls && s[2].calls);
+    for (i = 0; i < 3; i++) {
+        CHECK(s[i].calls == 1 && s[i].result == (int32_t)strlen(text[i]));
+    }
+    CHECK(io.batches == 1 && io.maxBatch == 3);
+    CHECK(io.bytes == at && io.errors == 0);
+
+    memset(s, 0, sizeof(s));
+    CHECK(file_io_read(&io, &req[0], sFd, s[0].buf, sizeof(s[0].buf), 0, seen_cb, &s[0]) == 0);
+    CHECK(file_io_read(&io, &req[1], sFd, s[1].buf, 6, 6, seen_cb, &s[1]) == 0);
+    CHECK(file_io_read(&io, &req[2], sFd, s[2].buf, 8, 1000, seen_cb, &s[2]) == 0);
+    RUN_UNTIL(s[0].calls && s[1].calls && s[2].calls);
+    CHECK(s[0].result == (int32_t)at && memcmp(s[0].buf, "first second third", at) == 0);
+    CHECK(s[1].result == 6 && memcmp(s[1].buf, "second", 6) == 0);
+    CHECK(s[2].result == 0);   // Past the end.
+    CHECK(io.requests == 6 && io.batches == 2);
+    file_io_free(&io);
+}
+
+static void test_errors(void)
+{
+    file_io_t io;
+    file_io_req_t req;
+    seen_t s = { 0 };
+
+    setup(&io);
+    CHECK(file_io_read(&io, &req, 1000, s.buf, sizeof(s.buf), 0, seen_cb, &s) == 0);
+    RUN_UNTIL(s.calls);
+    CHECK(s.calls == 1 && s.result == -EBADF);
+    CHECK(io.errors == 1);
+    file_io_free(&io);
+}
+
+static void test_full(void)
+{
+    file_io_t io;
+    file_io_req_t req[FILE_IO_ENTRIES + 1];
+    seen_t s = { 0 };
+    int i;
+
+    setup(&io);
+    for (i = 0; i < FILE_IO_ENTRIES; i++) {
+        CHECK(file_io_read(&io, &req[i], sFd, s.buf, 4, 0, seen_cb, &s) == 0);
+    }
+    CHECK(file_io_read(&io, &req[i], sFd, s.buf, 4, 0, seen_cb, &s) == -1);
+    CHECK(io.refused == 1);
+    RUN_UNTIL(s.calls == FILE_IO_ENTRIES);
+    CHECK(s.calls == FILE_IO_ENTRIES);
+    CHECK(file_io_read(&io, &req[i], sFd, s.buf, 4, 0, seen_cb, &s) == 0);   // Room again.
+    RUN_UNTIL(s.calls == FILE_IO_ENTRIES + 1);
+    file_io_free(&io);
+}
+
+//
+// file_io_free() finishes what's queued, and what the callbacks queue after it.
+//
+static void test_free_finishes(void)
+{
+    file_io_t io;
+    file_io_req_t req[4];
+    seen_t s[4];
+    int i;
+
+    setup(&io);
+    memset(s, 0, sizeof(s));
+    for (i = 0; i < 4; i++) {
+        s[i].io = &io;
+        s[i].again = i;
+        CHECK(file_io_read(&io, &req[i], sFd, s[i].buf, 5, 0, seen_cb, &s[i]) == 0);
+    }
+    file_io_free(&io);
+    for (i = 0; i < 4; i++) {
+        CHECK(s[i].calls == i + 1 && s[i].again == 0);
+    }
+    CHECK(s[0].result == 5 && s[3].result == 18);   // The follow-ups read the whole file.
+    CHECK(memcmp(s[3].buf, "first second third", 18) == 0);
+    CHECK(file_io_read(&io, &req[0], sFd, s[0].buf, 5, 0, seen_cb, &s[0]) == -1);
+}
+
+//
+// But not forever: callbacks that always queue another read are cut off at the
+// deadline, the last read with -ECANCELED.
+//
+static void test_free_gives_up(void)
+{
+    file_io_t io;
+    file_io_req_t req;
+    seen_t s = { 0 };
+    uint64_t startMs;
+
+    setup(&io);
+    io.freeTimeoutMs = 50;
+    s.io = &io;
+    s.again = 1 << 30;
+    CHECK(file_io_read(&io, &req, sFd, s.buf, sizeof(s.buf), 0, seen_cb, &s) == 0);
+    startMs = now_ms();
+    file_io_free(&io);
+    CHECK(now_ms() - startMs >= 50 && now_ms() - startMs < 1000);
+    CHECK(s.calls > 1);
+    CHECK(s.result == -ECANCELED);
+    CHECK(s.again == -1);   // Its callback couldn't queue another.
+}
+
+//
+// A read from a pipe nobody writes to never finishes on io_uring. (The threads' pread()
+// refuses pipes outright.)
+//
+static void test_free_stuck(void)
+{
+    file_io_t io;
+    file_io_req_t req[2];
+    seen_t s[2];
+    uint64_t startMs;
+    int pool;
+    int p[2];
+
+    memset(s, 0, sizeof(s));
+    CHECK(pipe(p) == 0);
+    setup(&io);
+    io.freeTimeoutMs = 50;
+    pool = io.backend == FILE_IO_POOL;
+    CHECK(file_io_read(&io, &req[0], p[0], s[0].buf, sizeof(s[0].buf), 0, seen_cb, &s[0]) == 0);
+    CHECK(file_io_read(&io, &req[1], sFd, s[1].buf, 5, 0, seen_cb, &s[1]) == 0);
+    RUN_UNTIL(s[1].calls && (s[0].calls || !pool));
+    CHECK(s[1].calls == 1 && s[1].result == 5);
+    CHECK(s[0].calls == pool);
+    startMs = now_ms();
+    file_io_free(&io);
+    CHECK(now_ms() - startMs < 1000);
+    CHECK(s[0].calls == 1);
+    CHECK(s[0].result == (pool ? -ESPIPE : -ECANCELED));
+    CHECK(s[1].calls == 1);   // Done already; not cancelled again.
+    close(p[0]);
+    close(p[1]);
+}
+
+//
+// A batch the kernel turns away is sent again without anything new being queued, on the
+// loop and from file_io_free().
+//
+static void test_resubmit(void)
+{
+#ifdef APP_IO_URING
+    file_io_t io;
+    file_io_req_t req;
+    seen_t s = { 0 };
+    uint64_t startMs;
+
+    setup(&io);
+    if (io.backend != FILE_IO_URING) {
+        file_io_free(&io);
+        return;
+    }
+    sFailEnters = 3;
+    CHECK(file_io_read(&io, &req, sFd, s.buf, 5, 0, seen_cb, &s) == 0);
+    RUN_UNTIL(s.calls);
+    CHECK(sFailEnters == 0);
+    CHECK(s.calls == 1 && s.result == 5);
+
+    memset(&s, 0, sizeof(s));
+    sFailEnters = 3;
+    CHECK(file_io_read(&io, &req, sFd, s.buf, 5, 0, seen_cb, &s) == 0);
+    startMs = now_ms();
+    file_io_free(&io);
+    CHECK(now_ms() - startMs < 100);
+    CHECK(s.calls == 1 && s.result == 5);
+#endif
+}
+
+int main(void)
+{
+    sBase = event_base_new();
+    sFd = mkstemp(sPath);
+    CHECK(sFd >= 0);
+    unlink(sPath);
+    test_read_write();
+    test_errors();
+    test_full();
+    test_free_finishes();
+    test_free_gives_up();
+    test_free_stuck();
+    test_resubmit();
+    close(sFd);
+    event_base_free(sBase);
+    return TEST_DONE();
+}
@@ -0,0 +1,384 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for gateway mode's fake_asr.c and loop_pool.c.
+*/
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include <event2/thread.h>
+
+#include "device-description.h"
+#include "fake_asr.h"
+#include "loop_pool.h"
+#include "test.h"
+
+typedef struct {
+    int             events;
+    int             requests;
+    int             responses;
+    int             busy;
+    int             bad;           // Requests for attributes we didn't ask for, or bad values.
+    uint16_t        lastAttrId;
+    af_lib_error_t  lastError;
+    uint64_t        lastMs;
+    pthread_t       thread;
+} seen_t;
+
+static struct event_base *sBase;
+static profile_t sProfile;
+static const uint16_t sInputs[] = { AF_GETDOUBLED, AF_TOGGLELED, AF_GETREVERSED, 4242 };
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+    nanosleep(&ts, NULL);
+}
+
+//
+// Run sBase until cond holds, for up to a second.
+//
+#define RUN_UNTIL(cond) do { \
+        int tries; \
+        for (tries = 0; tries < 1000 && !(cond); tries++) { \
+            event_base_loop(sBase, EVLOOP_NONBLOCK); \
+            if (!(cond)) sleep_ms(1); \
+        } \
+    } while (0)
+
+//
+// Run sBase for about ms.
+//
+static void run_for(long ms)
+{
+    uint64_t endMs = now_ms() + ms;
+
+    while (now_ms() < endMs) {
+        event_base_loop(sBase, EVLOOP_NONBLOCK);
+        sleep_ms(1);
+    }
+}
+
+static void seen_cb(void *ctx, const af_lib_event_type_t eventType, const af_lib_error_t error,
+                    const uint16_t attributeId, const uint16_t valueLen, const uint8_t *value)
+{
+    seen_t *s = (seen_t *)ctx;
+    uint16_t i;
+
+    s->lastAttrId = attributeId;
+    s->lastError  = error;
+    s->lastMs     = now_ms();
+    s->thread     = pthread_self();
+    if (eventType == AF_LIB_EVENT_MCU_SET_REQUEST) {
+        s->requests++;
+        switch (attributeId) {
+            case AF_GETDOUBLED:
+                s->bad += valueLen != 2;
+                break;
+            case AF_TOGGLELED:
+                s->bad += valueLen != 1 || value[0] > 1;
+                break;
+            case AF_GETREVERSED:
+                s->bad += valueLen < 1 || valueLen > FAKE_ASR_STR_MAX;
+                for (i = 0; i < valueLen; i++) {
+                    s->bad += value[i] < 'a' || value[i] > 'z';
+                }
+                break;
+            default:
+                s->bad++;
+                break;
+        }
+    }
+    else if (eventType == AF_LIB_EVENT_ASR_SET_RESPONSE) {
+        s->responses++;
+        s->busy += error != AF_SUCCESS;
+    }
+    else {
+        s->bad++;
+    }
+    __atomic_fetch_add(&s->events, 1, __ATOMIC_RELEASE);
+}
+
+static af_lib_error_t fake_set(fake_asr_t *f, uint16_t attrId)
+{
+    int32_t v = 1;
+
+    return f->link.ops->set(&f->link, attrId, SET_KIND_32, &v, sizeof(v));
+}
+
+//
+// Set requests only for inputs the profile has, with values that fit them.
+//
+static void test_requests(void)
+{
+    fake_asr_t f;
+    seen_t s = { 0 };
+
+    CHECK(fake_asr_init(&f, sBase, &sProfile, sInputs, sizeof(sInputs) / sizeof(sInputs[0]), 1,
+                        seen_cb, &s) == 0);
+    CHECK(f.inputCount == 3);   // 4242 isn't in the profile.
+    f.periodMs = 2;
+    fake_asr_start(&f);
+    RUN_UNTIL(s.requests >= 50);
+    CHECK(s.requests >= 50);
+    CHECK(f.requests == (uint32_t)s.requests);
+    CHECK(s.bad == 0);
+
+    //
+    // periodMs 0 stops them once the timer that's armed goes off.
+    //
+    f.periodMs = 0;
+    run_for(10);
+    s.requests = 0;
+    run_for(20);
+    CHECK(s.requests == 0);
+    fake_asr_free(&f);
+}
+
+//
+// A set is answered latencyMs later, never from inside set(), and the ones that don't
+// fit are turned away.
+//
+static void test_set_responses(void)
+{
+    fake_asr_t f;
+    seen_t s = { 0 };
+    uint64_t startMs;
+    int i;
+
+    CHECK(fake_asr_init(&f, sBase, &sProfile, sInputs, 3, 2, seen_cb, &s) == 0);
+    f.periodMs  = 0;
+    f.latencyMs = 30;
+    fake_asr_start(&f);
+
+    startMs = now_ms();
+    CHECK(fake_set(&f, AF_GETDOUBLED) == AF_SUCCESS);
+    CHECK(s.events == 0);
+    RUN_UNTIL(s.responses == 1);
+    CHECK(s.responses == 1);
+    CHECK(s.lastAttrId == AF_GETDOUBLED && s.lastError == AF_SUCCESS);
+    CHECK(s.lastMs - startMs >= 29);
+    CHECK(f.sets == 1 && f.refused == 0);
+
+    //
+    // No more than FAKE_ASR_MAX_PENDING at once, answered in order.
+    //
+    memset(&s, 0, sizeof(s));
+    for (i = 0; i < FAKE_ASR_MAX_PENDING; i++) {
+        CHECK(fake_set(&f, AF_GETREVERSED) == AF_SUCCESS);
+    }
+    CHECK(fake_set(&f, AF_TOGGLELED) == AF_ERROR_BUSY);
+    CHECK(f.refused == 1);
+    RUN_UNTIL(s.responses == FAKE_ASR_MAX_PENDING);
+    CHECK(s.responses == FAKE_ASR_MAX_PENDING);
+    CHECK(s.busy == 0 && s.lastAttrId == AF_GETREVERSED);
+    CHECK(fake_set(&f, AF_TOGGLELED) == AF_SUCCESS);   // Room again.
+    RUN_UNTIL(s.responses == FAKE_ASR_MAX_PENDING + 1);
+    CHECK(s.lastAttrId == AF_TOGGLELED);
+    fake_asr_free(&f);
+}
+
+//
+// failPermille of the sets come back AF_ERROR_BUSY.
+//
+static void test_refusals(void)
+{
+    fake_asr_t f;
+    seen_t s = { 0 };
+    int i;
+
+    CHECK(fake_asr_init(&f, sBase, &sProfile, sInputs, 3, 3, seen_cb, &s) == 0);
+    f.periodMs     = 0;
+    f.latencyMs    = 1;
+    f.failPermille = 1000;
+    for (i = 0; i < 10; i++) {
+        CHECK(fake_set(&f, AF_GETDOUBLED) == AF_SUCCESS);   // Refused in the response, not here.
+    }
+    RUN_UNTIL(s.responses == 10);
+    CHECK(s.responses == 10 && s.busy == 10);
+
+    memset(&s, 0, sizeof(s));
+    f.failPermille = 500;
+    for (i = 0; i < 400; i++) {
+        if (i % 20 == 0) {
+            RUN_UNTIL(s.responses >= i);
+        }
+        fake_set(&f, AF_GETDOUBLED);
+    }
+    RUN_UNTIL(s.responses == 400);
+    CHECK(s.responses == 400);
+    CHECK(s.busy > 140 && s.busy < 260);
+
+    memset(&s, 0, sizeof(s));
+    f.failPermille = 0;
+    for (i = 0; i < 20; i++) {
+        fake_set(&f, AF_GETDOUBLED);
+    }
+    RUN_UNTIL(s.responses == 20);
+    CHECK(s.responses == 20 && s.busy == 0);
+    fake_asr_free(&f);
+}
+
+//
+// The device's set responses are timed from the set request that asked for them.
+//
+static void test_response_timing(void)
+{
+    fake_asr_t f;
+    seen_t s = { 0 };
+    uint8_t value[2] = { 0 };
+
+    CHECK(fake_asr_init(&f, sBase, &sProfile, sInputs, 1, 4, seen_cb, &s) == 0);
+    f.periodMs = 1;
+    fake_asr_start(&f);
+    RUN_UNTIL(s.requests >= 1);
+    f.periodMs = 0;
+    CHECK(s.lastAttrId == AF_GETDOUBLED);
+    sleep_ms(10);
+    f.link.ops->set_response(&f.link, AF_GETDOUBLED, true, sizeof(value), value);
+    CHECK(f.responses == 1);
+    CHECK(f.responseMaxUs >= 10000 && f.responseTotalUs == f.responseMaxUs);
+
+    //
+    // Answered already: a second response isn't timed again.
+    //
+    f.link.ops->set_response(&f.link, AF_GETDOUBLED, true, sizeof(value), value);
+    CHECK(f.responses == 2);
+    CHECK(f.responseTotalUs == f.responseMaxUs);
+    fake_asr_free(&f);
+}
+
+static void test_pool_limits(void)
+{
+    loop_pool_t lp;
+
+    CHECK(loop_pool_init(&lp, sBase, 0) == 0);
+    CHECK(lp.count == 1 && loop_pool_base(&lp, 0) == sBase);
+    loop_pool_free(&lp);
+
+    CHECK(loop_pool_init(&lp, sBase, LOOP_POOL_MAX + 5) == 0);
+    CHECK(lp.count == LOOP_POOL_MAX);
+    loop_pool_free(&lp);
+    CHECK(lp.count == 1);
+}
+
+typedef struct {
+    loop_pool_t *lp;
+    int          stopped;
+} time_up_t;
+
+//
+// What gatewayTimeUp() does: stop every loop from loop 0, then loop 0 itself.
+//
+static void time_up_cb(evutil_socket_t fd, short what, void *arg)
+{
+    time_up_t *t = (time_up_t *)arg;
+
+    loop_pool_stop(t->lp);
+    t->stopped = t->lp->running == 1;
+    event_base_loopexit(sBase, NULL);
+}
+
+//
+// Devices on the other loops run on their threads, and stop with them.
+//
+static void test_pool(void)
+{
+    loop_pool_t lp;
+    fake_asr_t f[2];
+    seen_t s[2];
+    time_up_t t;
+    struct timeval tv = { 0, 100000 };
+    uint64_t startMs;
+    int events[2];
+    int i;
+
+    memset(s, 0, sizeof(s));
+    CHECK(loop_pool_init(&lp, sBase, 3) == 0);
+    CHECK(lp.count == 3 && lp.running == 0);
+    for (i = 0; i < 2; i++) {
+        CHECK(fake_asr_init(&f[i], loop_pool_base(&lp, i + 1), &sProfile, sInputs, 3, 10 + i,
+                            seen_cb, &s[i]) == 0);
+        f[i].periodMs = 2;
+        fake_asr_start(&f[i]);
+    }
+    CHECK(loop_pool_start(&lp) == 0);
+    CHECK(lp.running == 3);
+
+    t.lp = &lp;
+    t.stopped = 0;
+    CHECK(event_base_once(sBase, -1, EV_TIMEOUT, time_up_cb, &t, &tv) == 0);
+    startMs = now_ms();
+    event_base_dispatch(sBase);
+    CHECK(t.stopped);
+    CHECK(now_ms() - startMs < 1000);   // Nobody waited for anything but the timer.
+
+    for (i = 0; i < 2; i++) {
+        events[i] = __atomic_load_n(&s[i].events, __ATOMIC_ACQUIRE);
+        CHECK(events[i] > 10);
+        CHECK(s[i].bad == 0);
+        CHECK(!pthread_equal(s[i].thread, pthread_self()));
+    }
+    CHECK(!pthread_equal(s[0].thread, s[1].thread));
+
+    //
+    // Stopped means stopped: nothing more happens on the other loops.
+    //
+    sleep_ms(20);
+    for (i = 0; i < 2; i++) {
+        CHECK(__atomic_load_n(&s[i].events, __ATOMIC_ACQUIRE) == events[i]);
+        fake_asr_free(&f[i]);
+    }
+    loop_pool_stop(&lp);   // Again, as main() does on the way out.
+    loop_pool_free(&lp);
+    CHECK(lp.count == 1);
+}
+
+//
+// Stopped straight after starting, before the threads have even got to their loops, as
+// main() does when loop_pool_start() fails partway. None of them may be missed.
+//
+static void test_pool_stop_early(void)
+{
+    loop_pool_t lp;
+    int i;
+    int stopped = 0;
+
+    for (i = 0; i < 200; i++) {
+        CHECK(loop_pool_init(&lp, sBase, 4) == 0);
+        CHECK(loop_pool_start(&lp) == 0);
+        loop_pool_stop(&lp);
+        stopped += lp.running == 1;
+        loop_pool_free(&lp);
+    }
+    CHECK(stopped == 200);
+}
+
+int main(void)
+{
+    alarm(30);   // A loop that never stops hangs the test rather than failing it.
+    evthread_use_pthreads();
+    sBase = event_base_new();
+    CHECK(profile_load_builtin(&sProfile) == 0);
+    test_requests();
+    test_set_responses();
+    test_refusals();
+    test_response_timing();
+    test_pool_limits();
+    test_pool();
+    test_pool_stop_early();
+    profile_unload(&sProfile);
+    event_base_free(sBase);
+    return TEST_DONE();
+}
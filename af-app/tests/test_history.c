@@ -0,0 +1,294 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for history.c: what goes in comes back out of the packed blocks, SIGUSR1 dumps
+   it from a thread, and the socket streams it a block at a time.
+*/
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <event2/event.h>
+
+#include "device-description.h"
+#include "history.h"
+#include "profile.h"
+#include "test.h"
+
+#define LINES_MAX  4096
+
+typedef struct {
+    unsigned long long ms;
+    char               dir[4];
+    unsigned           id;
+    char               value[1600];
+} line_t;
+
+static struct event_base *sBase;
+static profile_t sProfile;
+static line_t sLines[LINES_MAX];
+
+//
+// Run a query and split the answer into lines.
+//
+static int query(history_t *h, int attrId, uint64_t fromMs, uint64_t toMs)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    char *line, *save = NULL;
+    uint32_t n;
+    int count = 0;
+
+    n = history_query(h, out, attrId, fromMs, toMs);
+    fclose(out);
+    for (line = strtok_r(text, "\n", &save); line != NULL && count < LINES_MAX; line = strtok_r(NULL, "\n", &save)) {
+        line_t *l = &sLines[count++];
+
+        l->value[0] = '\0';
+        sscanf(line, "%llu %3s %u %1599[^\n]", &l->ms, l->dir, &l->id, l->value);
+    }
+    free(text);
+    return (uint32_t)count == n ? count : -1;
+}
+
+static void record32(history_t *h, int dir, uint16_t id, int32_t v)
+{
+    history_record(h, dir, id, &v, sizeof(v));
+}
+
+static void test_round_trip(void)
+{
+    history_t h;
+    static const int32_t sums[] = { 0, 5, 3, -100000, INT32_MIN, INT32_MAX, INT32_MIN, 42 };
+    int8_t bits = -128;
+    uint8_t bytes[] = { 0x00, 0xff, 0x10 };
+    uint64_t before = (uint64_t)time(NULL) * 1000 - 1000;
+    char want[32];
+    int i, n;
+
+    CHECK(history_init(&h, sBase, &sProfile) == 0);
+    for (i = 0; i < (int)(sizeof(sums) / sizeof(sums[0])); i++) {
+        record32(&h, i & 1 ? HISTORY_OUT : HISTORY_IN, AF_CURRENTSUM, sums[i]);
+    }
+    history_record(&h, HISTORY_IN, AF_NUMBEROFBITS, &bits, sizeof(bits));
+    history_record(&h, HISTORY_OUT, AF_REVERSED, "olleh", 5);
+    history_record(&h, HISTORY_OUT, AF_REVERSED, "olleh", 5);        // Stored as a reference.
+    history_record(&h, HISTORY_OUT, AF_REVERSED, "a\"b\\c\n", 6);
+    history_record(&h, HISTORY_IN, 4242, bytes, sizeof(bytes));      // Not in the profile: bytes.
+    history_record(&h, HISTORY_IN, AF_REVERSED, NULL, 0);
+    CHECK(h.records == 14 && h.strRefs == 1);
+    CHECK(h.bytes < h.rawBytes + 14 * 4);
+
+    n = query(&h, -1, 0, UINT64_MAX);
+    CHECK(n == 14);
+    for (i = 0; i < 8; i++) {
+        snprintf(want, sizeof(want), "%d", sums[i]);
+        CHECK(sLines[i].id == AF_CURRENTSUM && strcmp(sLines[i].value, want) == 0);
+        CHECK(strcmp(sLines[i].dir, i & 1 ? "out" : "in") == 0);
+        CHECK(sLines[i].ms >= before && sLines[i].ms <= before + 60000);
+    }
+    CHECK(sLines[8].id == AF_NUMBEROFBITS && strcmp(sLines[8].value, "-128") == 0);
+    CHECK(strcmp(sLines[9].value, "\"olleh\"") == 0 && strcmp(sLines[10].value, "\"olleh\"") == 0);
+    CHECK(strcmp(sLines[11].value, "\"a\\\"b\\\\c\\x0a\"") == 0);
+    CHECK(sLines[12].id == 4242 && strcmp(sLines[12].value, "00ff10") == 0);
+    CHECK(strcmp(sLines[13].value, "\"\"") == 0);
+
+    // One attribute, and a time range that holds nothing.
+    CHECK(query(&h, AF_NUMBEROFBITS, 0, UINT64_MAX) == 1);
+    CHECK(query(&h, AF_CURRENTSUM, 0, UINT64_MAX) == 8);
+    CHECK(query(&h, -1, 0, before - 1) == 0);
+    history_free(&h);
+}
+
+//
+// Fill the ring several times over. Deltas start afresh in every block, so what's left
+// must still decode to the right values.
+//
+static void test_wraps(void)
+{
+    history_t h;
+    char s[600];
+    char want[32];
+    int i, n, bad = 0;
+    long first;
+
+    CHECK(history_init(&h, sBase, &sProfile) == 0);
+    for (i = 0; i < 1000; i++) {
+        record32(&h, HISTORY_IN, AF_CURRENTSUM, i * 7);
+        memset(s, 'a' + i % 26, sizeof(s));
+        snprintf(s, 8, "%07d", i);
+        history_record(&h, HISTORY_OUT, AF_REVERSED, s, sizeof(s));
+    }
+    CHECK(h.recycled > 0);
+    n = query(&h, AF_CURRENTSUM, 0, UINT64_MAX);
+    CHECK(n > 100 && n < 1000);
+    first = 1000 - n;
+    for (i = 0; i < n; i++) {
+        snprintf(want, sizeof(want), "%ld", (first + i) * 7);
+        bad += strcmp(sLines[i].value, want) != 0;
+    }
+    CHECK(bad == 0);
+    history_free(&h);
+}
+
+static void test_dump(void)
+{
+    history_t h;
+    char line[256];
+    FILE *f;
+    int i, lines = 0;
+    struct timespec ms = { 0, 1000000 };
+
+    remove(HISTORY_DUMP_PATH);
+    CHECK(history_init(&h, sBase, &sProfile) == 0);
+    for (i = 0; i < 100; i++) {
+        record32(&h, HISTORY_IN, AF_CURRENTSUM, i);
+    }
+    raise(SIGUSR1);
+    for (i = 0; i < 1000 && !h.dumpStarted; i++) {
+        event_base_loop(sBase, EVLOOP_NONBLOCK);
+    }
+    CHECK(h.dumpStarted);
+    record32(&h, HISTORY_IN, AF_CURRENTSUM, 1000);    // After the copy; not in the dump.
+    for (i = 0; i < 1000 && __atomic_load_n(&h.dumpRunning, __ATOMIC_ACQUIRE); i++) {
+        nanosleep(&ms, NULL);
+    }
+    f = fopen(HISTORY_DUMP_PATH, "r");
+    CHECK(f != NULL);
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        lines++;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    CHECK(lines == 100);
+    history_free(&h);
+    remove(HISTORY_DUMP_PATH);
+}
+
+//
+// Ask over the socket and read the whole answer, running the loop meanwhile. passes is
+// how many passes of the loop the answer came in over.
+//
+static char *ask(const char *request, int *passes)
+{
+    struct sockaddr_un sa;
+    struct timespec ms = { 0, 1000000 };
+    char *text = malloc(1);
+    size_t len = 0;
+    char buf[65536];
+    ssize_t n;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, HISTORY_SOCKET_PATH, sizeof(sa.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        write(fd, request, strlen(request)) != (ssize_t)strlen(request)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(text);
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    *passes = 0;
+    for (i = 0; i < 5000; i++) {
+        event_base_loop(sBase, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+        n = read(fd, buf, sizeof(buf));
+        if (n == 0) {
+            break;
+        }
+        if (n > 0) {
+            text = realloc(text, len + n + 1);
+            memcpy(text + len, buf, n);
+            len += n;
+            (*passes)++;
+        }
+        else if (errno == EAGAIN) {
+            nanosleep(&ms, NULL);
+        }
+    }
+    close(fd);
+    text[len] = '\0';
+    return text;
+}
+
+static int count_lines(const char *text)
+{
+    int n = 0;
+
+    for (; *text; text++) {
+        n += *text == '\n';
+    }
+    return n;
+}
+
+//
+// dump and query answer from a copy taken when they ask, the same as history_query(),
+// and a block at a time.
+//
+static void test_socket(void)
+{
+    history_t h;
+    char *text;
+    char *want = NULL;
+    size_t wantLen = 0;
+    FILE *out;
+    int passes = 0;
+    int i;
+
+    CHECK(history_init(&h, sBase, &sProfile) == 0);
+    if (h.listener == NULL) {
+        history_free(&h);
+        return;   // No /run/af-app here.
+    }
+    for (i = 0; i < 20000; i++) {
+        record32(&h, i % 2 ? HISTORY_OUT : HISTORY_IN, i % 3 ? AF_CURRENTSUM : AF_GETDOUBLED, i * 7);
+    }
+    CHECK(h.recycled == 0 && h.cur - h.blocks > 4);   // Several blocks, none lost.
+
+    out = open_memstream(&want, &wantLen);
+    CHECK(history_query(&h, out, -1, 0, UINT64_MAX) == 20000);
+    fclose(out);
+    text = ask("dump\n", &passes);
+    CHECK(text != NULL && strcmp(text, want) == 0);
+    CHECK(passes > 1);
+    free(text);
+    free(want);
+
+    text = ask("query 1 0\n", &passes);
+    CHECK(text != NULL && count_lines(text) == 6667);   // Every third is AF_GETDOUBLED.
+    CHECK(text != NULL && strlen(text) > 8 && strcmp(text + strlen(text) - 8, " 139986\n") == 0);
+    free(text);
+
+    text = ask("stats\n", &passes);
+    CHECK(text != NULL && strncmp(text, "records=20000 ", 14) == 0);
+    free(text);
+
+    text = ask("nonsense\n", &passes);
+    CHECK(text != NULL && strncmp(text, "error:", 6) == 0);
+    free(text);
+    history_free(&h);
+}
+
+int main(void)
+{
+    sBase = event_base_new();
+    CHECK(profile_load_builtin(&sProfile) == 0);
+    test_round_trip();
+    test_wraps();
+    test_dump();
+    test_socket();
+    profile_unload(&sProfile);
+    event_base_free(sBase);
+    return TEST_DONE();
+}
@@ -0,0 +1,133 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for memo_cache.c.
+*/
+#include <stdint.h>
+#include <string.h>
+
+#include "memo_cache.h"
+#include "test.h"
+
+#define ATTR_IN   1
+#define ATTR_OUT  2
+
+static void test_hit_and_miss(void)
+{
+    memo_cache_t mc;
+    memo_key_t key;
+    const memo_entry_t *e;
+    uint32_t in = 21, out = 42, other = 22;
+
+    memo_cache_init(&mc);
+    CHECK(memo_cache_lookup(&mc, ATTR_IN, (uint8_t *)&in, sizeof(in), &key) == NULL);
+    memo_cache_store(&mc, ATTR_IN, sizeof(in), &key, (uint8_t *)&out, sizeof(out));
+
+    e = memo_cache_lookup(&mc, ATTR_IN, (uint8_t *)&in, sizeof(in), &key);
+    CHECK(e != NULL);
+    CHECK(e != NULL && e->outLen == sizeof(out) && memcmp(e->out, &out, sizeof(out)) == 0);
+
+    // Same bytes, different attribute or length: not the same input.
+    CHECK(memo_cache_lookup(&mc, ATTR_IN + 1, (uint8_t *)&in, sizeof(in), &key) == NULL);
+    CHECK(memo_cache_lookup(&mc, ATTR_IN, (uint8_t *)&in, 2, &key) == NULL);
+    CHECK(memo_cache_lookup(&mc, ATTR_IN, (uint8_t *)&other, sizeof(other), &key) == NULL);
+    CHECK(mc.lookups == 5 && mc.hits == 1);
+}
+
+//
+// Fill one set past its ways; the least recently used input goes.
+//
+static void test_lru_eviction(void)
+{
+    memo_cache_t mc;
+    memo_key_t keys[MEMO_CACHE_WAYS + 1];
+    uint32_t inputs[MEMO_CACHE_WAYS + 1];
+    uint32_t v, set = 0;
+    int n = 0, i;
+    memo_key_t k;
+
+    memo_cache_init(&mc);
+    for (v = 0; n < MEMO_CACHE_WAYS + 1; v++) {
+        memo_key(&k, &v, sizeof(v));
+        if (n == 0) {
+            set = (k.hash ^ ATTR_IN) & (MEMO_CACHE_SETS - 1);
+        }
+        if (((k.hash ^ ATTR_IN) & (MEMO_CACHE_SETS - 1)) == set) {
+            inputs[n] = v;
+            keys[n++] = k;
+        }
+    }
+    for (i = 0; i < MEMO_CACHE_WAYS; i++) {
+        memo_cache_store(&mc, ATTR_IN, sizeof(uint32_t), &keys[i], (uint8_t *)&inputs[i], sizeof(uint32_t));
+    }
+    // Touch input 0 so input 1 is now the oldest.
+    CHECK(memo_cache_lookup(&mc, ATTR_IN, (uint8_t *)&inputs[0], sizeof(uint32_t), &k) != NULL);
+    memo_cache_store(&mc, ATTR_IN, sizeof(uint32_t), &keys[MEMO_CACHE_WAYS],
+                     (uint8_t *)&inputs[MEMO_CACHE_WAYS], sizeof(uint32_t));
+
+    CHECK(memo_cache_lookup(&mc, ATTR_IN, (uint8_t *)&inputs[0], sizeof(uint32_t), &k) != NULL);
+    CHECK(memo_cache_lookup(&mc, ATTR_IN, (uint8_t *)&inputs[1], sizeof(uint32_t), &k) == NULL);
+    for (i = 2; i <= MEMO_CACHE_WAYS; i++) {
+        CHECK(memo_cache_lookup(&mc, ATTR_IN, (uint8_t *)&inputs[i], sizeof(uint32_t), &k) != NULL);
+    }
+}
+
+static void test_published_skip(void)
+{
+    memo_cache_t mc;
+    uint32_t a = 7, b = 8;
+
+    memo_cache_init(&mc);
+    CHECK(!memo_published_matches(&mc, ATTR_OUT, (uint8_t *)&a, sizeof(a)));
+    memo_note_published(&mc, ATTR_OUT, (uint8_t *)&a, sizeof(a));
+    CHECK(memo_published_matches(&mc, ATTR_OUT, (uint8_t *)&a, sizeof(a)));
+    CHECK(!memo_published_matches(&mc, ATTR_OUT, (uint8_t *)&b, sizeof(b)));
+    CHECK(!memo_published_matches(&mc, ATTR_OUT + 1, (uint8_t *)&a, sizeof(a)));
+    CHECK(mc.setsSkipped == 1);
+
+    // A failed set: the next identical value has to go out again.
+    memo_forget_published(&mc, ATTR_OUT);
+    CHECK(!memo_published_matches(&mc, ATTR_OUT, (uint8_t *)&a, sizeof(a)));
+}
+
+//
+// Keys of short values are the values; long ones need both hashes to match.
+//
+static void test_keys_tell_values_apart(void)
+{
+    memo_cache_t mc;
+    memo_key_t ka, kb, planted;
+    char a[64], b[64];
+    uint64_t x = 0x0102030405060708ULL, y = 0x0102030405060709ULL;
+
+    memo_key(&ka, &x, sizeof(x));
+    memo_key(&kb, &y, sizeof(y));
+    CHECK(ka.check == x && kb.check == y);
+
+    memset(a, 'a', sizeof(a));
+    memcpy(b, a, sizeof(b));
+    b[63] = 'b';
+    memo_key(&ka, a, sizeof(a));
+    memo_key(&kb, b, sizeof(b));
+    CHECK(ka.hash != kb.hash && ka.check != kb.check);
+
+    // An entry whose hash matches but whose check word doesn't is someone else's.
+    memo_cache_init(&mc);
+    planted = ka;
+    planted.check ^= 1;
+    memo_cache_store(&mc, ATTR_IN, sizeof(a), &planted, (uint8_t *)"x", 1);
+    CHECK(memo_cache_lookup(&mc, ATTR_IN, (uint8_t *)a, sizeof(a), &kb) == NULL);
+
+    memo_note_published_key(&mc, ATTR_OUT, sizeof(a), &planted);
+    CHECK(!memo_published_matches(&mc, ATTR_OUT, (uint8_t *)a, sizeof(a)));
+    memo_note_published_key(&mc, ATTR_OUT, sizeof(a), &ka);
+    CHECK(memo_published_matches(&mc, ATTR_OUT, (uint8_t *)a, sizeof(a)));
+}
+
+int main(void)
+{
+    test_hit_and_miss();
+    test_lru_eviction();
+    test_published_skip();
+    test_keys_tell_values_apart();
+    return TEST_DONE();
+}
@@ -0,0 +1,195 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for profile.c, and for the images profilec.py writes.
+
+   Set TEST_PROFILE_BIN to a file from profilec.py to check it too; make check does.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "device-description.h"
+#include "profile.h"
+#include "test.h"
+
+static char sPath[] = "/tmp/test_profile_XXXXXX";
+
+//
+// Write img to a file and try to load it.
+//
+static int load_image(const uint8_t *img, size_t len)
+{
+    profile_t p;
+    FILE *f = fopen(sPath, "wb");
+    int ret;
+
+    if (f == NULL || fwrite(img, 1, len, f) != len) {
+        return -2;
+    }
+    fclose(f);
+    ret = profile_load(&p, sPath);
+    if (ret == 0) {
+        profile_unload(&p);
+    }
+    return ret;
+}
+
+static void fix_crc(uint8_t *img, size_t len)
+{
+    profile_header_t *hdr = (profile_header_t *)img;
+
+    hdr->crc32 = profile_crc32(img + sizeof(*hdr), len - sizeof(*hdr));
+}
+
+static void test_builtin_lookup(const profile_t *p)
+{
+    const profile_attr_t *a;
+    uint32_t i;
+
+    for (i = 0; i < p->hdr->attrCount; i++) {
+        CHECK(profile_lookup(p, p->attrs[i].id) == &p->attrs[i]);
+    }
+    a = profile_lookup(p, AF_GETDOUBLED);
+    CHECK(a != NULL && a->size == AF_GETDOUBLED_SZ && strcmp(profile_name(p, a), "GetDoubled") == 0);
+    CHECK(profile_find_by_name(p, "Reversed") == profile_lookup(p, AF_REVERSED));
+    CHECK(profile_lookup(p, 4242) == NULL);
+    CHECK(profile_find_by_name(p, "NoSuchThing") == NULL);
+    CHECK(p->aggCount == 1 && p->aggs[0].srcId == AF_GETADDED && p->aggs[0].outId == AF_CURRENTSUM);
+}
+
+//
+// Every kind of damage validation is there to catch, made to a good image.
+//
+static void test_rejects_corrupt(const profile_t *good)
+{
+    size_t len = good->mappingLen;
+    uint8_t *img = malloc(len + 16);
+    profile_header_t *hdr = (profile_header_t *)img;
+    profile_attr_t *attrs;
+    profile_agg_t *aggs;
+
+#define FRESH() do { memcpy(img, good->mapping, len); \
+                     attrs = (profile_attr_t *)(img + hdr->attrsOffset); \
+                     aggs  = (profile_agg_t *)(img + hdr->aggsOffset); } while (0)
+
+    FRESH();
+    CHECK(load_image(img, len) == 0);
+
+    // Truncated, padded, and a flipped bit without fixing the CRC.
+    FRESH();
+    CHECK(load_image(img, len - 4) == -1);
+    FRESH();
+    memset(img + len, 0, 16);
+    CHECK(load_image(img, len + 16) == -1);
+    FRESH();
+    img[len - 1] ^= 0x40;
+    CHECK(load_image(img, len) == -1);
+    FRESH();
+    hdr->magic++;
+    CHECK(load_image(img, len) == -1);
+
+    // Offsets that only look in bounds because a 32-bit sum wraps.
+    FRESH();
+    hdr->namesOffset = 0xfffffff0u;
+    hdr->namesSize   = 0x20;
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+    FRESH();
+    hdr->aggCount   = 0xffff;
+    hdr->aggsOffset = 0xfffff000u;
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+    FRESH();
+    hdr->slotsOffset = 0xfffffff8u;
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+
+    // A repeated ID, and IDs out of order.
+    FRESH();
+    attrs[1].id = attrs[0].id;
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+    FRESH();
+    attrs[2].id = attrs[0].id - 1;
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+
+    // A name past the table, and a hash slot pointing at the wrong attribute.
+    FRESH();
+    attrs[0].nameOffset = (uint16_t)hdr->namesSize;
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+    FRESH();
+    {
+        uint16_t *slots = (uint16_t *)(img + hdr->slotsOffset);
+        uint32_t i, a = 0, b = 0;
+
+        for (i = 0; i < hdr->slotCount; i++) {
+            if (slots[i] != 0) {
+                if (a == 0) {
+                    a = i + 1;
+                }
+                else {
+                    b = i + 1;
+                    break;
+                }
+            }
+        }
+        slots[a - 1] = slots[b - 1];
+    }
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+
+    // Aggregates with an attribute that isn't there, at either end, or a bad window.
+    FRESH();
+    aggs[0].outId = 4242;
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+    FRESH();
+    aggs[0].srcId = 4242;
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+    FRESH();
+    aggs[0].window = PROFILE_WINDOW_SAMPLES;
+    fix_crc(img, len);
+    CHECK(load_image(img, len) == -1);
+
+#undef FRESH
+    free(img);
+}
+
+static void test_profilec_output(const char *path)
+{
+    profile_t p;
+    uint32_t i;
+
+    CHECK(profile_load(&p, path) == 0);
+    if (p.hdr == NULL) {
+        return;
+    }
+    for (i = 0; i < p.hdr->attrCount; i++) {
+        CHECK(profile_lookup(&p, p.attrs[i].id) == &p.attrs[i]);
+    }
+    CHECK(profile_lookup(&p, AF_GETDOUBLED) != NULL);
+    profile_unload(&p);
+}
+
+int main(void)
+{
+    profile_t builtin;
+    const char *bin = getenv("TEST_PROFILE_BIN");
+    int fd = mkstemp(sPath);
+
+    close(fd);
+    CHECK(profile_load_builtin(&builtin) == 0);
+    test_builtin_lookup(&builtin);
+    test_rejects_corrupt(&builtin);
+    profile_unload(&builtin);
+    if (bin != NULL) {
+        test_profilec_output(bin);
+    }
+    unlink(sPath);
+    return TEST_DONE();
+}
@@ -0,0 +1,296 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for set_tracker.c, against a fake ASR link that answers whatever it's told to.
+*/
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+
+#include "set_tracker.h"
+#include "test.h"
+
+typedef struct {
+    asr_link_t      link;
+    af_lib_error_t  refuse;     // What set() returns.
+    int             sets;
+    uint16_t        lastAttrId;
+    uint32_t        lastValue;
+} fake_link_t;
+
+static af_lib_error_t fake_set(asr_link_t *link, uint16_t attrId, set_kind_t kind,
+                               const void *value, uint16_t len)
+{
+    fake_link_t *l = (fake_link_t *)link;
+
+    l->sets++;
+    l->lastAttrId = attrId;
+    l->lastValue = 0;
+    memcpy(&l->lastValue, value, len < sizeof(l->lastValue) ? len : sizeof(l->lastValue));
+    return l->refuse;
+}
+
+static void fake_set_response(asr_link_t *link, uint16_t attrId, bool succeeded,
+                              uint16_t len, const uint8_t *value)
+{
+}
+
+static const asr_link_ops_t sFakeOps = { .set = fake_set, .set_response = fake_set_response };
+
+typedef struct {
+    int  calls;
+    int  status;
+    int  attempts;
+} done_t;
+
+static void done_cb(set_tracker_t *st, const set_handle_t *h, int status, void *ctx)
+{
+    done_t *d = (done_t *)ctx;
+
+    d->calls++;
+    d->status = status;
+    d->attempts = h->attempts;
+}
+
+static struct event_base *sBase;
+static fake_link_t sLink;
+static set_tracker_t sSt;
+
+//
+// Run the loop until cond holds, for up to a second.
+//
+#define RUN_UNTIL(cond) do { \
+        struct timespec ms = { 0, 1000000 }; \
+        int i; \
+        for (i = 0; i < 1000 && !(cond); i++) { \
+            event_base_loop(sBase, EVLOOP_NONBLOCK); \
+            if (!(cond)) nanosleep(&ms, NULL); \
+        } \
+    } while (0)
+
+static void setup(void)
+{
+    memset(&sLink, 0, sizeof(sLink));
+    sLink.link.ops = &sFakeOps;
+    set_tracker_init(&sSt, sBase, &sLink.link);
+    sSt.timeoutMs    = 30;
+    sSt.backoffMs    = 5;
+    sSt.backoffMaxMs = 20;
+    sSt.lateGraceMs  = 1000;
+}
+
+static void test_lands(void)
+{
+    done_t d = { 0 };
+    uint32_t v = 7;
+
+    setup();
+    CHECK(set_tracker_submit(&sSt, 10, SET_KIND_32, &v, sizeof(v), 0, done_cb, &d) != NULL);
+    CHECK(sLink.sets == 1 && sLink.lastAttrId == 10 && sLink.lastValue == 7);
+    CHECK(d.calls == 0);   // Never from inside submit.
+    set_tracker_response(&sSt, 10, AF_SUCCESS);
+    RUN_UNTIL(d.calls == 1);
+    CHECK(d.calls == 1 && d.status == SET_STATUS_OK && d.attempts == 1);
+    CHECK(sSt.succeeded == 1 && sSt.inFlight == 0 && sSt.head == NULL);
+
+    set_tracker_response(&sSt, 10, AF_SUCCESS);   // Nothing in flight.
+    CHECK(sSt.unmatched == 1 && sSt.late == 0);
+    set_tracker_shutdown(&sSt);
+}
+
+//
+// A failed response is retried after a backoff, and a refusal from af_lib counts the same.
+//
+static void test_retry_and_backoff(void)
+{
+    done_t d = { 0 };
+    uint32_t v = 8;
+
+    setup();
+    set_tracker_submit(&sSt, 11, SET_KIND_32, &v, sizeof(v), 0, done_cb, &d);
+    set_tracker_response(&sSt, 11, AF_ERROR_BUSY);
+    CHECK(sSt.head != NULL && sSt.head->state == SET_STATE_BACKOFF);
+    CHECK(sLink.sets == 1 && sSt.retries == 1);
+    RUN_UNTIL(sLink.sets == 2);
+    CHECK(sLink.sets == 2 && sLink.lastValue == 8 && sSt.head->state == SET_STATE_IN_FLIGHT);
+    set_tracker_response(&sSt, 11, AF_SUCCESS);
+    RUN_UNTIL(d.calls == 1);
+    CHECK(d.status == SET_STATUS_OK && d.attempts == 2);
+    set_tracker_shutdown(&sSt);
+
+    // Every attempt refused: gives up with af_lib's error after maxAttempts.
+    memset(&d, 0, sizeof(d));
+    setup();
+    sSt.maxAttempts = 3;
+    sLink.refuse = AF_ERROR_BUSY;
+    set_tracker_submit(&sSt, 12, SET_KIND_32, &v, sizeof(v), 0, done_cb, &d);
+    RUN_UNTIL(d.calls == 1);
+    CHECK(d.calls == 1 && d.status == AF_ERROR_BUSY && d.attempts == 3);
+    CHECK(sLink.sets == 3 && sSt.failed == 1 && sSt.retries == 2 && sSt.inFlight == 0);
+    set_tracker_shutdown(&sSt);
+}
+
+static void test_timeout(void)
+{
+    done_t d = { 0 };
+    uint32_t v = 9;
+
+    setup();
+    sSt.maxAttempts = 2;
+    set_tracker_submit(&sSt, 13, SET_KIND_32, &v, sizeof(v), 0, done_cb, &d);
+    RUN_UNTIL(d.calls == 1);
+    CHECK(d.calls == 1 && d.status == SET_STATUS_TIMEOUT && d.attempts == 2);
+    CHECK(sSt.timeouts == 2);
+    set_tracker_shutdown(&sSt);
+}
+
+//
+// The response to an attempt that timed out arrives while the retry is in flight. It
+// mustn't complete the retry.
+//
+static void test_late_response(void)
+{
+    done_t d = { 0 };
+    uint32_t v = 10;
+
+    setup();
+    set_tracker_submit(&sSt, 14, SET_KIND_32, &v, sizeof(v), 0, done_cb, &d);
+    RUN_UNTIL(sLink.sets == 2);
+    CHECK(sSt.timeouts == 1 && sSt.head->state == SET_STATE_IN_FLIGHT);
+
+    set_tracker_response(&sSt, 14, AF_ERROR_BUSY);   // The first attempt's, late.
+    CHECK(sSt.unmatched == 1 && sSt.late == 1);
+    CHECK(sSt.head != NULL && sSt.head->state == SET_STATE_IN_FLIGHT && sSt.retries == 1);
+
+    set_tracker_response(&sSt, 14, AF_SUCCESS);      // The retry's.
+    RUN_UNTIL(d.calls == 1);
+    CHECK(d.calls == 1 && d.status == SET_STATUS_OK && d.attempts == 2);
+    set_tracker_shutdown(&sSt);
+
+    // Once the grace is over, a response goes to what's in flight again.
+    memset(&d, 0, sizeof(d));
+    setup();
+    sSt.lateGraceMs = 1;
+    set_tracker_submit(&sSt, 15, SET_KIND_32, &v, sizeof(v), 0, done_cb, &d);
+    RUN_UNTIL(sLink.sets == 2);
+    set_tracker_response(&sSt, 15, AF_SUCCESS);
+    RUN_UNTIL(d.calls == 1);
+    CHECK(d.calls == 1 && d.status == SET_STATUS_OK && sSt.late == 0);
+    set_tracker_shutdown(&sSt);
+}
+
+//
+// The first attempt's response is lost for good, and the retry's is taken for it. The
+// retry times out, but expects nothing more, and the attempt after it lands.
+//
+static void test_lost_response(void)
+{
+    done_t d = { 0 }, next = { 0 };
+    uint32_t v = 11;
+
+    setup();
+    sSt.lateGraceMs = SET_TRACKER_LATE_GRACE_MS;
+    set_tracker_submit(&sSt, 22, SET_KIND_32, &v, sizeof(v), 0, done_cb, &d);
+    RUN_UNTIL(sLink.sets == 2);
+    CHECK(sSt.timeouts == 1 && sSt.expectLateCount == 1);
+    set_tracker_response(&sSt, 22, AF_SUCCESS);      // The retry's, dropped.
+    CHECK(sSt.late == 1 && sSt.expectLateCount == 0);
+    RUN_UNTIL(sLink.sets == 3);
+    CHECK(sSt.timeouts == 2 && sSt.expectLateCount == 0);
+    set_tracker_response(&sSt, 22, AF_SUCCESS);
+    RUN_UNTIL(d.calls == 1);
+    CHECK(d.calls == 1 && d.status == SET_STATUS_OK && d.attempts == 3);
+    CHECK(sSt.late == 1 && sSt.failed == 0);
+    set_tracker_shutdown(&sSt);
+
+    //
+    // Every attempt times out: one late response is expected, not one per attempt, and
+    // the next set to the attribute costs an attempt rather than failing.
+    //
+    memset(&d, 0, sizeof(d));
+    setup();
+    sSt.lateGraceMs = SET_TRACKER_LATE_GRACE_MS;
+    sSt.maxAttempts = 3;
+    set_tracker_submit(&sSt, 23, SET_KIND_32, &v, sizeof(v), 0, done_cb, &d);
+    RUN_UNTIL(d.calls == 1);
+    CHECK(d.status == SET_STATUS_TIMEOUT && sSt.timeouts == 3 && sSt.expectLateCount == 1);
+    set_tracker_submit(&sSt, 23, SET_KIND_32, &v, sizeof(v), 0, done_cb, &next);
+    CHECK(sLink.sets == 4);
+    set_tracker_response(&sSt, 23, AF_SUCCESS);
+    CHECK(sSt.late == 1);
+    RUN_UNTIL(sLink.sets == 5);
+    set_tracker_response(&sSt, 23, AF_SUCCESS);
+    RUN_UNTIL(next.calls == 1);
+    CHECK(next.calls == 1 && next.status == SET_STATUS_OK && next.attempts == 2);
+    set_tracker_shutdown(&sSt);
+}
+
+//
+// Sets to one attribute go one at a time, and an unsent one gives way to a newer value.
+//
+static void test_order_and_supersede(void)
+{
+    done_t a = { 0 }, b = { 0 }, c = { 0 }, other = { 0 };
+    uint32_t va = 1, vb = 2, vc = 3, vo = 4;
+
+    setup();
+    set_tracker_submit(&sSt, 16, SET_KIND_32, &va, sizeof(va), 0, done_cb, &a);
+    set_tracker_submit(&sSt, 16, SET_KIND_32, &vb, sizeof(vb), 0, done_cb, &b);
+    set_tracker_submit(&sSt, 17, SET_KIND_32, &vo, sizeof(vo), 0, done_cb, &other);
+    CHECK(sLink.sets == 2 && sSt.inFlight == 2 && sSt.queued == 1);   // b waits for a.
+
+    set_tracker_submit(&sSt, 16, SET_KIND_32, &vc, sizeof(vc), 0, done_cb, &c);
+    RUN_UNTIL(b.calls == 1);
+    CHECK(b.calls == 1 && b.status == SET_STATUS_SUPERSEDED && b.attempts == 0);
+    CHECK(sSt.failed == 0);
+
+    set_tracker_response(&sSt, 16, AF_SUCCESS);
+    CHECK(sLink.sets == 3 && sLink.lastAttrId == 16 && sLink.lastValue == 3);
+    set_tracker_response(&sSt, 16, AF_SUCCESS);
+    set_tracker_response(&sSt, 17, AF_SUCCESS);
+    RUN_UNTIL(c.calls == 1 && other.calls == 1);
+    CHECK(a.status == SET_STATUS_OK && c.status == SET_STATUS_OK && other.status == SET_STATUS_OK);
+    CHECK(sSt.succeeded == 3 && sSt.submitted == 4);
+    set_tracker_shutdown(&sSt);
+
+    // The in-flight cap holds the rest back.
+    memset(&a, 0, sizeof(a));
+    setup();
+    sSt.maxInFlight = 1;
+    set_tracker_submit(&sSt, 18, SET_KIND_32, &va, sizeof(va), 0, done_cb, &a);
+    set_tracker_submit(&sSt, 19, SET_KIND_32, &vb, sizeof(vb), 0, NULL, NULL);
+    CHECK(sLink.sets == 1 && sSt.queued == 1);
+    set_tracker_response(&sSt, 18, AF_SUCCESS);
+    CHECK(sLink.sets == 2 && sLink.lastAttrId == 19 && sSt.peakInFlight == 1);
+    set_tracker_shutdown(&sSt);
+    RUN_UNTIL(a.calls == 1);
+    CHECK(a.calls == 1);
+}
+
+static void test_shutdown_cancels(void)
+{
+    done_t a = { 0 }, b = { 0 };
+    uint32_t v = 5;
+
+    setup();
+    sSt.maxInFlight = 1;
+    set_tracker_submit(&sSt, 20, SET_KIND_32, &v, sizeof(v), 0, done_cb, &a);
+    set_tracker_submit(&sSt, 21, SET_KIND_32, &v, sizeof(v), 0, done_cb, &b);
+    set_tracker_shutdown(&sSt);
+    CHECK(a.calls == 1 && a.status == SET_STATUS_CANCELLED);
+    CHECK(b.calls == 1 && b.status == SET_STATUS_CANCELLED);
+}
+
+int main(void)
+{
+    sBase = event_base_new();
+    test_lands();
+    test_retry_and_backoff();
+    test_timeout();
+    test_late_response();
+    test_lost_response();
+    test_order_and_supersede();
+    test_shutdown_cancels();
+    event_base_free(sBase);
+    return TEST_DONE();
+}
@@ -0,0 +1,171 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for trace.c, built with the ring: dumps hold the right events in order, and no
+   torn ones while other threads keep recording.
+*/
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <event2/event.h>
+
+#include "trace.h"
+#include "test.h"
+
+static char sPath[] = "/tmp/test_trace_XXXXXX";
+
+//
+// Every event says the same number four ways, so a torn one doesn't add up.
+//
+static void record(uint32_t i)
+{
+    trace_span_at(TRACE_SET, (uint64_t)i * 1000, (uint64_t)i * 1000, (uint16_t)i, i, (int32_t)~i);
+}
+
+//
+// Read a dump back. Returns the number of events, or -1 if one is inconsistent;
+// *first and *last get the numbers of the first and last, and *ordered whether they
+// went up one at a time.
+//
+static int read_dump(const char *path, uint32_t *first, uint32_t *last, int *ordered)
+{
+    FILE *f = fopen(path, "r");
+    char line[512];
+    int n = 0;
+
+    *ordered = 1;
+    if (f == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        const char *ts = strstr(line, "\"ts\":");
+        const char *attr = strstr(line, "\"attrId\":");
+        const char *seq = strstr(line, "\"seq\":");
+        const char *att = strstr(line, "\"attempt\":");
+        unsigned long long t;
+        unsigned a, s;
+        int arg;
+
+        if (ts == NULL || strstr(line, "\"ph\":\"X\"") == NULL) {
+            continue;
+        }
+        if (attr == NULL || seq == NULL || att == NULL ||
+            sscanf(ts + 5, "%llu", &t) != 1 || sscanf(attr + 9, "%u", &a) != 1 ||
+            sscanf(seq + 6, "%u", &s) != 1 || sscanf(att + 10, "%d", &arg) != 1 ||
+            t != s || a != (s & 0xffff) || arg != (int)~s) {
+            fclose(f);
+            return -1;
+        }
+        if (n == 0) {
+            *first = s;
+        }
+        else if (s != *last + 1) {
+            *ordered = 0;
+        }
+        *last = s;
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static void test_dump_and_wrap(void)
+{
+    uint32_t first = 0, last = 0, i;
+    int ordered;
+
+    for (i = 0; i < 100; i++) {
+        record(i);
+    }
+    CHECK(trace_dump(sPath) == 100);
+    CHECK(read_dump(sPath, &first, &last, &ordered) == 100 && first == 0 && last == 99 && ordered);
+
+    for (; i < TRACE_RING_EVENTS + 500; i++) {
+        record(i);
+    }
+    CHECK(trace_dump(sPath) == TRACE_RING_EVENTS);
+    CHECK(read_dump(sPath, &first, &last, &ordered) == TRACE_RING_EVENTS);
+    CHECK(first == 500 && last == TRACE_RING_EVENTS + 499 && ordered);
+}
+
+static volatile int sStop;
+
+static void *recorder(void *arg)
+{
+    uint32_t i = (uint32_t)(uintptr_t)arg;
+
+    while (!sStop) {
+        record(i);
+        i += 2;
+    }
+    return NULL;
+}
+
+//
+// Two threads lap the ring over and over while it's dumped.
+//
+static void test_concurrent(void)
+{
+    pthread_t threads[2];
+    uint32_t first, last;
+    int ordered, i, bad = 0, total = 0, n;
+
+    sStop = 0;
+    pthread_create(&threads[0], NULL, recorder, (void *)(uintptr_t)0);
+    pthread_create(&threads[1], NULL, recorder, (void *)(uintptr_t)1);
+    for (i = 0; i < 20; i++) {
+        n = trace_dump(sPath);
+        if (n < 0 || read_dump(sPath, &first, &last, &ordered) != n) {
+            bad++;
+        }
+        total += n;
+    }
+    sStop = 1;
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    CHECK(bad == 0 && total > 0);
+}
+
+//
+// SIGUSR2 dumps from a thread while the loop goes on.
+//
+static void test_signal(void)
+{
+    struct event_base *base = event_base_new();
+    struct timespec ms = { 0, 1000000 };
+    uint32_t first = 0, last = 0, i;
+    int ordered;
+
+    remove(TRACE_DUMP_PATH);
+    trace_init(base);
+    for (i = 0; i < 10; i++) {
+        record(i);
+    }
+    raise(SIGUSR2);
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    record(10);                                    // After the copy; not in the dump.
+    for (i = 0; i < 1000 && access(TRACE_DUMP_PATH, F_OK) != 0; i++) {
+        nanosleep(&ms, NULL);
+    }
+    trace_free();
+    CHECK(read_dump(TRACE_DUMP_PATH, &first, &last, &ordered) == 10 && first == 0 && last == 9);
+    remove(TRACE_DUMP_PATH);
+    event_base_free(base);
+}
+
+int main(void)
+{
+    int fd = mkstemp(sPath);
+
+    close(fd);
+    test_dump_and_wrap();
+    test_concurrent();
+    test_signal();
+    trace_log_stats();
+    unlink(sPath);
+    return TEST_DONE();
+}
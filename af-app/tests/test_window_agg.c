@@ -0,0 +1,223 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tests for window_agg.c, checked against the aggregates worked out the slow way.
+*/
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+
+#include "device-description.h"
+#include "profile.h"
+#include "window_agg.h"
+#include "test.h"
+
+static struct event_base *sBase;
+static profile_t sBuiltin;
+static profile_t sProfile;
+
+//
+// What got published, by output attribute.
+//
+static int64_t sOut[32];
+static int     sPublishes[32];
+static int     sPublishResult;
+
+static int capture(void *ctx, uint16_t attrId, set_kind_t kind, const void *value, uint16_t len)
+{
+    int8_t v8;
+    int16_t v16;
+    int32_t v32;
+
+    if (sPublishResult != AF_SUCCESS) {
+        return sPublishResult;
+    }
+    switch (len) {
+        case 1: memcpy(&v8, value, 1);  sOut[attrId] = v8;  break;
+        case 2: memcpy(&v16, value, 2); sOut[attrId] = v16; break;
+        case 4: memcpy(&v32, value, 4); sOut[attrId] = v32; break;
+        default: memcpy(&sOut[attrId], value, 8); break;
+    }
+    sPublishes[attrId]++;
+    return AF_SUCCESS;
+}
+
+static int setup(agg_engine_t *e, const profile_agg_t *defs, uint16_t count)
+{
+    sProfile = sBuiltin;
+    sProfile.aggs = defs;
+    sProfile.aggCount = count;
+    memset(sOut, 0, sizeof(sOut));
+    memset(sPublishes, 0, sizeof(sPublishes));
+    sPublishResult = AF_SUCCESS;
+    return agg_engine_init(e, sBase, &sProfile, capture, NULL);
+}
+
+static void feed8(agg_engine_t *e, uint16_t attrId, int8_t v)
+{
+    agg_engine_update(e, attrId, (const uint8_t *)&v, sizeof(v));
+}
+
+static void test_total_and_clamp(void)
+{
+    static const profile_agg_t defs[] = {
+        { AF_GETROTATED, AF_NUMBEROFBITS, PROFILE_AGG_TOTAL, PROFILE_WINDOW_NONE, 0, 0, 0 },
+    };
+    agg_engine_t e;
+    int32_t v = 100;
+
+    // The built-in profile's own: AF_GETADDED into AF_CURRENTSUM.
+    CHECK(setup(&e, sBuiltin.aggs, sBuiltin.aggCount) == 0);
+    feed8(&e, AF_GETADDED, 5);
+    feed8(&e, AF_GETADDED, -3);
+    CHECK(sOut[AF_CURRENTSUM] == 2 && sPublishes[AF_CURRENTSUM] == 2);
+    feed8(&e, AF_GETADDED, 0);
+    CHECK(sPublishes[AF_CURRENTSUM] == 2 && e.unchanged == 1);
+    CHECK(agg_engine_update(&e, AF_GETDOUBLED, (const uint8_t *)&v, 2) == 0);
+    agg_engine_free(&e);
+
+    // A total that outgrows a one-byte output sticks at its largest value.
+    CHECK(setup(&e, defs, 1) == 0);
+    agg_engine_update(&e, AF_GETROTATED, (const uint8_t *)&v, sizeof(v));
+    agg_engine_update(&e, AF_GETROTATED, (const uint8_t *)&v, sizeof(v));
+    CHECK(sOut[AF_NUMBEROFBITS] == 127);
+    agg_engine_free(&e);
+}
+
+//
+// Every function over a sample window, after every value, against a brute-force pass
+// over the window. start is where the sequence numbers begin, to take them past wrapping.
+//
+static void check_sliding(uint32_t start, int rounds)
+{
+    static const profile_agg_t defs[] = {
+        { AF_GETADDED, AF_DOUBLED,         PROFILE_AGG_MIN,   PROFILE_WINDOW_SAMPLES, 5, 5, 0 },
+        { AF_GETADDED, AF_ROTATE,          PROFILE_AGG_MAX,   PROFILE_WINDOW_SAMPLES, 5, 5, 0 },
+        { AF_GETADDED, AF_ROTATEDR,        PROFILE_AGG_SUM,   PROFILE_WINDOW_SAMPLES, 5, 5, 0 },
+        { AF_GETADDED, AF_ROTATEL,         PROFILE_AGG_AVG,   PROFILE_WINDOW_SAMPLES, 5, 5, 0 },
+        { AF_GETADDED, AF_COUNTBITSOFTHIS, PROFILE_AGG_COUNT, PROFILE_WINDOW_SAMPLES, 5, 5, 0 },
+    };
+    agg_engine_t e;
+    int8_t window[5];
+    uint32_t rng = 12345;
+    int i, j, n, bad = 0;
+    uint16_t k;
+
+    CHECK(setup(&e, defs, 5) == 0);
+    for (k = 0; k < e.count; k++) {
+        agg_state_t *a = &e.aggs[k];
+
+        a->first = a->next = a->monoFirst = a->monoNext = start;
+    }
+    for (i = 0; i < rounds; i++) {
+        int64_t mn = INT64_MAX, mx = INT64_MIN, sum = 0;
+        int8_t v;
+
+        rng = rng * 1103515245 + 12345;
+        v = (int8_t)(rng >> 16);
+        if (i % 7 == 3) {
+            v = window[(i - 1) % 5];   // Ties, which the deque must keep.
+        }
+        window[i % 5] = v;
+        feed8(&e, AF_GETADDED, v);
+
+        n = i + 1 < 5 ? i + 1 : 5;
+        for (j = 0; j < n; j++) {
+            int8_t w = window[(i - j) % 5];
+
+            mn = w < mn ? w : mn;
+            mx = w > mx ? w : mx;
+            sum += w;
+        }
+        if (sOut[AF_DOUBLED] != mn || sOut[AF_ROTATE] != mx || sOut[AF_ROTATEDR] != sum ||
+            sOut[AF_ROTATEL] != sum / n || sOut[AF_COUNTBITSOFTHIS] != n) {
+            bad++;
+        }
+    }
+    CHECK(bad == 0);
+    CHECK(e.aggs[0].next == start + (uint32_t)rounds);
+    agg_engine_free(&e);
+}
+
+static void test_sliding(void)
+{
+    check_sliding(0, 500);
+    check_sliding(UINT32_MAX - 20, 100);   // Sequence numbers wrap partway.
+}
+
+//
+// A time window empties on its own as its samples get old.
+//
+static void test_time_window(void)
+{
+    static const profile_agg_t defs[] = {
+        { AF_GETADDED, AF_COUNTBITSOFTHIS, PROFILE_AGG_COUNT, PROFILE_WINDOW_TIME, 4, 30, 0 },
+    };
+    agg_engine_t e;
+    struct timespec ms = { 0, 1000000 };
+    int i;
+
+    CHECK(setup(&e, defs, 1) == 0);
+    for (i = 0; i < 6; i++) {
+        feed8(&e, AF_GETADDED, 1);
+    }
+    CHECK(sOut[AF_COUNTBITSOFTHIS] == 4 && e.dropped == 2);
+    for (i = 0; i < 1000 && sOut[AF_COUNTBITSOFTHIS] != 0; i++) {
+        event_base_loop(sBase, EVLOOP_NONBLOCK);
+        nanosleep(&ms, NULL);
+    }
+    CHECK(sOut[AF_COUNTBITSOFTHIS] == 0);
+    agg_engine_free(&e);
+}
+
+//
+// A result that didn't make it to the Cloud goes out again on its own, without another
+// source value.
+//
+static void test_republish(void)
+{
+    agg_engine_t e;
+    struct timespec ms = { 0, 1000000 };
+    int i;
+
+    CHECK(setup(&e, sBuiltin.aggs, sBuiltin.aggCount) == 0);
+    feed8(&e, AF_GETADDED, 4);
+    feed8(&e, AF_GETADDED, 0);
+    CHECK(sPublishes[AF_CURRENTSUM] == 1 && e.unchanged == 1);
+
+    agg_engine_forget_published(&e, AF_CURRENTSUM);   // The set of 4 failed.
+    CHECK(sPublishes[AF_CURRENTSUM] == 1);            // Not from inside the callback.
+    for (i = 0; i < 1000 && sPublishes[AF_CURRENTSUM] == 1; i++) {
+        event_base_loop(sBase, EVLOOP_NONBLOCK);
+        nanosleep(&ms, NULL);
+    }
+    CHECK(sPublishes[AF_CURRENTSUM] == 2 && sOut[AF_CURRENTSUM] == 4);
+    feed8(&e, AF_GETADDED, 0);
+    CHECK(sPublishes[AF_CURRENTSUM] == 2);            // Published again, so unchanged.
+
+    // Nor does one that couldn't be queued count as published.
+    sPublishResult = AF_ERROR_BUSY;
+    feed8(&e, AF_GETADDED, 1);
+    sPublishResult = AF_SUCCESS;
+    feed8(&e, AF_GETADDED, 0);
+    CHECK(sPublishes[AF_CURRENTSUM] == 3 && sOut[AF_CURRENTSUM] == 5);
+
+    agg_engine_forget_published(&e, AF_DOUBLED);      // Not an output here.
+    event_base_loop(sBase, EVLOOP_NONBLOCK);
+    feed8(&e, AF_GETADDED, 0);
+    CHECK(sPublishes[AF_CURRENTSUM] == 3);
+    agg_engine_free(&e);
+}
+
+int main(void)
+{
+    sBase = event_base_new();
+    CHECK(profile_load_builtin(&sBuiltin) == 0);
+    test_total_and_clamp();
+    test_sliding();
+    test_time_window();
+    test_republish();
+    profile_unload(&sBuiltin);
+    event_base_free(sBase);
+    return TEST_DONE();
+}
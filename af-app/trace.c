@@ -0,0 +1,310 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Attribute tracing. See trace.h.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <event2/event.h>
+
+#include "af_log.h"
+#include "trace.h"
+
+#ifdef APP_TRACE_RING
+
+//
+// How each name shows up in the trace: its category, and what its id and arg are.
+//
+static const struct {
+    const char *name;
+    const char *cat;
+    const char *idLabel;
+    const char *argLabel;
+} sNames[TRACE_NAME_COUNT] = {
+    [TRACE_CALLBACK]     = { "callback",     "af_lib", "eventType", "error"     },
+    [TRACE_QUEUED]       = { "queued",       "queue",  "eventType", "class"     },
+    [TRACE_HANDLE]       = { "handle",       "app",    "eventType", "error"     },
+    [TRACE_COMPUTE]      = { "compute",      "app",    "role",      "valueLen"  },
+    [TRACE_SET_RESPONSE] = { "set_response", "af_lib", "succeeded", "valueLen"  },
+    [TRACE_SET]          = { "set",          "af_lib", "seq",       "attempt"   },
+    [TRACE_IN_FLIGHT]    = { "in_flight",    "set",    "seq",       "status"    },
+    [TRACE_ASR_RESPONSE] = { "asr_response", "af_lib", "eventType", "error"     },
+};
+
+//
+// A copy of the ring for a dump, oldest event first.
+//
+typedef struct {
+    uint32_t       count;
+    trace_event_t  events[TRACE_RING_EVENTS];
+} trace_snapshot_t;
+
+static trace_event_t  sRing[TRACE_RING_EVENTS];
+static uint32_t       sRecorded;   // Ever, modulo 2^32; the ring has the last TRACE_RING_EVENTS.
+static uint32_t       sDumps;
+static uint32_t       sTorn;       // Events left out of dumps because they were being written.
+static struct event  *sDumpSignal;
+static pthread_t      sDumpThread;
+static int            sDumpStarted;
+static int            sDumpRunning;
+static __thread uint32_t sTid;
+
+static void trace_put(uint8_t ph, trace_name_t name, uint64_t tsNs, uint32_t durNs,
+                      uint16_t attrId, uint32_t id, int32_t arg)
+{
+    uint32_t n = __atomic_fetch_add(&sRecorded, 1, __ATOMIC_RELAXED);
+    trace_event_t *ev = &sRing[n & (TRACE_RING_EVENTS - 1)];
+
+    if (sTid == 0) {
+        sTid = (uint32_t)syscall(SYS_gettid);
+    }
+    //
+    // Zero while writing, the event's number once it's all there: a seqlock per slot.
+    //
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->tsNs   = tsNs;
+    ev->durNs  = durNs;
+    ev->ph     = ph;
+    ev->name   = (uint8_t)name;
+    ev->attrId = attrId;
+    ev->id     = id;
+    ev->arg    = arg;
+    ev->tid    = sTid;
+    __atomic_store_n(&ev->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+void trace_span_at(trace_name_t name, uint64_t startNs, uint64_t endNs, uint16_t attrId,
+                   uint32_t id, int32_t arg)
+{
+    uint64_t dur = endNs > startNs ? endNs - startNs : 0;
+
+    trace_put('X', name, startNs, dur > UINT32_MAX ? UINT32_MAX : (uint32_t)dur, attrId, id, arg);
+}
+
+void trace_span(trace_name_t name, uint64_t startNs, uint16_t attrId, uint32_t id, int32_t arg)
+{
+    trace_span_at(name, startNs, trace_now(), attrId, id, arg);
+}
+
+void trace_instant(trace_name_t name, uint16_t attrId, uint32_t id, int32_t arg)
+{
+    trace_put('i', name, trace_now(), 0, attrId, id, arg);
+}
+
+void trace_async_begin(trace_name_t name, uint16_t attrId, uint32_t id, int32_t arg)
+{
+    trace_put('b', name, trace_now(), 0, attrId, id, arg);
+}
+
+void trace_async_end(trace_name_t name, uint16_t attrId, uint32_t id, int32_t arg)
+{
+    trace_put('e', name, trace_now(), 0, attrId, id, arg);
+}
+
+//
+// Copy out every complete event still in the ring. A slot whose stamp isn't the event
+// we expect there, before and after the copy, was being written or had been lapped.
+//
+static void trace_snapshot(trace_snapshot_t *snap)
+{
+    uint32_t end = __atomic_load_n(&sRecorded, __ATOMIC_ACQUIRE);
+    uint32_t n = end - TRACE_RING_EVENTS;
+    uint32_t seq;
+    uint32_t i;
+
+    snap->count = 0;
+    for (i = 0; i < TRACE_RING_EVENTS; i++, n++) {
+        const trace_event_t *ev = &sRing[n & (TRACE_RING_EVENTS - 1)];
+        trace_event_t *copy = &snap->events[snap->count];
+
+        seq = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0 || seq != n + 1) {
+            continue;  // Never written, still being written, or already lapped.
+        }
+        *copy = *ev;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) != seq) {
+            __atomic_fetch_add(&sTorn, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        snap->count++;
+    }
+}
+
+//
+// Chrome wants microseconds; the fraction keeps the nanoseconds.
+//
+static void trace_write_event(FILE *out, const trace_event_t *ev, int pid)
+{
+    fprintf(out, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,",
+            sNames[ev->name].name, sNames[ev->name].cat, ev->ph,
+            (unsigned long long)(ev->tsNs / 1000), (unsigned)(ev->tsNs % 1000));
+    if (ev->ph == 'X') {
+        fprintf(out, "\"dur\":%u.%03u,", ev->durNs / 1000, ev->durNs % 1000);
+    }
+    else if (ev->ph == 'i') {
+        fprintf(out, "\"s\":\"t\",");
+    }
+    else {
+        fprintf(out, "\"id\":%u,", ev->id);
+    }
+    fprintf(out, "\"pid\":%d,\"tid\":%d,\"args\":{\"attrId\":%u,\"%s\":%u,\"%s\":%d}}",
+            pid, ev->tid, ev->attrId, sNames[ev->name].idLabel, ev->id, sNames[ev->name].argLabel, ev->arg);
+}
+
+static int trace_write(const trace_snapshot_t *snap, const char *path)
+{
+    char tmp[256];
+    FILE *out;
+    uint32_t i;
+    int pid = (int)getpid();
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    out = fopen(tmp, "w");
+    if (out == NULL) {
+        AFLOG_ERR("my-app: trace: can't write %s: %m", tmp);
+        return -1;
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                 "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"af-app\"}}", pid);
+    for (i = 0; i < snap->count; i++) {
+        fputs(",\n", out);
+        trace_write_event(out, &snap->events[i], pid);
+    }
+    fputs("\n]}\n", out);
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        AFLOG_ERR("my-app: trace: can't write %s: %m", path);
+        return -1;
+    }
+    __atomic_fetch_add(&sDumps, 1, __ATOMIC_RELAXED);
+    return (int)snap->count;
+}
+
+int trace_dump(const char *path)
+{
+    trace_snapshot_t *snap = malloc(sizeof(*snap));
+    int n;
+
+    if (snap == NULL) {
+        AFLOG_ERR("my-app: trace: out of memory for a dump");
+        return -1;
+    }
+    trace_snapshot(snap);
+    n = trace_write(snap, path);
+    free(snap);
+    return n;
+}
+
+static void *trace_dump_thread(void *arg)
+{
+    trace_snapshot_t *snap = (trace_snapshot_t *)arg;
+    int n = trace_write(snap, TRACE_DUMP_PATH);
+
+    if (n >= 0) {
+        AFLOG_INFO("my-app: trace: dumped %d events to %s", n, TRACE_DUMP_PATH);
+    }
+    free(snap);
+    __atomic_store_n(&sDumpRunning, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+//
+// SIGUSR2. The loop only copies the ring; formatting thousands of events is left to a
+// thread of its own.
+//
+static void trace_dump_cb(evutil_socket_t sig, short what, void *arg)
+{
+    trace_snapshot_t *snap;
+
+    if (__atomic_load_n(&sDumpRunning, __ATOMIC_ACQUIRE)) {
+        AFLOG_INFO("my-app: trace: still writing the last dump");
+        return;
+    }
+    if (sDumpStarted) {
+        pthread_join(sDumpThread, NULL);
+        sDumpStarted = 0;
+    }
+    snap = malloc(sizeof(*snap));
+    if (snap == NULL) {
+        AFLOG_ERR("my-app: trace: out of memory for a dump");
+        return;
+    }
+    trace_snapshot(snap);
+
+    sDumpRunning = 1;
+    if (pthread_create(&sDumpThread, NULL, trace_dump_thread, snap) != 0) {
+        AFLOG_ERR("my-app: trace: can't start the dump thread");
+        sDumpRunning = 0;
+        free(snap);
+        return;
+    }
+    sDumpStarted = 1;
+}
+
+void trace_init(struct event_base *base)
+{
+    sRecorded = 0;
+    sDumps    = 0;
+    sTorn     = 0;
+    memset(sRing, 0, sizeof(sRing));
+    sDumpSignal = evsignal_new(base, SIGUSR2, trace_dump_cb, NULL);
+    if (sDumpSignal == NULL || evsignal_add(sDumpSignal, NULL) != 0) {
+        AFLOG_WARNING("my-app: trace: no SIGUSR2, the trace can't be dumped");
+    }
+#ifdef APP_USDT
+    AFLOG_INFO("my-app: trace: %d events kept, static probes built in", TRACE_RING_EVENTS);
+#else
+    AFLOG_INFO("my-app: trace: %d events kept, no static probes", TRACE_RING_EVENTS);
+#endif
+}
+
+void trace_free(void)
+{
+    if (sDumpSignal) {
+        event_free(sDumpSignal);
+        sDumpSignal = NULL;
+    }
+    if (sDumpStarted) {
+        pthread_join(sDumpThread, NULL);  // A dump being written is finished first.
+        sDumpStarted = 0;
+    }
+}
+
+void trace_log_stats(void)
+{
+    uint32_t recorded = __atomic_load_n(&sRecorded, __ATOMIC_RELAXED);
+
+    AFLOG_INFO("my-app: trace: recorded=%u kept=%u dumps=%u torn=%u", recorded,
+               recorded < TRACE_RING_EVENTS ? recorded : TRACE_RING_EVENTS,
+               __atomic_load_n(&sDumps, __ATOMIC_RELAXED), __atomic_load_n(&sTorn, __ATOMIC_RELAXED));
+}
+
+#else // !APP_TRACE_RING
+
+void trace_init(struct event_base *base)
+{
+#ifdef APP_USDT
+    AFLOG_INFO("my-app: trace: static probes built in, no ring");
+#endif
+}
+
+void trace_free(void)
+{
+}
+
+int trace_dump(const char *path)
+{
+    return -1;
+}
+
+void trace_log_stats(void)
+{
+}
+
+#endif // APP_TRACE_RING
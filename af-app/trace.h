@@ -0,0 +1,146 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Tracing an attribute through the app.
+
+   Two ways to see where the time goes between af_lib handing us an event and the ASR
+   confirming what we sent back, at the same points along the way:
+
+     callback        af_lib called attrEventCallback()
+     queued          the event waited in the event queue
+     handle          handleAttrEvent() ran
+     compute         the handler did its work for an MCU set request
+     set_response    af_lib_send_set_response() acknowledged the request
+     set             an af_lib_set_attribute_* call sent a value
+     in_flight       the value was on its way, until its ASR_SET_RESPONSE or timeout
+     asr_response    the ASR_SET_RESPONSE arrived
+
+   Static probes (USDT), provider af_app, for perf and bpftrace. Each one is a single nop
+   in the code until a tracer attaches to it. For example:
+
+     bpftrace -e 'usdt:/usr/bin/app:af_app:handle__start { @s[arg1] = nsecs; }
+                  usdt:/usr/bin/app:af_app:handle__done  { @us[arg1] = hist((nsecs - @s[arg1]) / 1000); }'
+
+     perf buildid-cache --add /usr/bin/app && perf record -e 'sdt_af_app:*' -p $(pidof app)
+
+   The probes need <sys/sdt.h> at build time (systemtap's, in the SDK sysroot). Without
+   it, or with -DAPP_NO_USDT, they compile to nothing.
+
+   Built with -DAPP_TRACE_RING, a tracer that keeps the last TRACE_RING_EVENTS of these
+   in memory, at the cost of a clock read and a 32-byte store each. Without it, the
+   default, trace_now() and the calls that record are empty inlines and cost nothing.
+   SIGUSR2 copies the ring and a thread writes the copy to TRACE_DUMP_PATH in the Chrome
+   trace-event format; load it into chrome://tracing or https://ui.perfetto.dev. Spans
+   nest, so a handler's set response and sets show up inside it, and every set's
+   in_flight span runs until the ASR answered it.
+
+   In gateway mode several event loops record at once, each event in its own slot of the
+   ring and on its own track (tid) in the trace. Every slot is stamped with the number of
+   the event in it once the event is complete, so the copy leaves out events that were
+   being written or overwritten while it was taken. Event numbers are 32 bits, which
+   ARMv7 can count atomically without a library call.
+*/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <event2/event.h>
+
+#if !defined(APP_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define APP_USDT 1
+#endif
+#endif
+
+#ifdef APP_USDT
+#define TRACE_PROBE(probe, a, b)  DTRACE_PROBE2(af_app, probe, a, b)
+#else
+#define TRACE_PROBE(probe, a, b)  do { } while (0)
+#endif
+
+#define TRACE_RING_EVENTS   8192   // Power of two.
+#define TRACE_DUMP_PATH     "/tmp/af-app-trace.json"
+
+typedef enum {
+    TRACE_CALLBACK,
+    TRACE_QUEUED,
+    TRACE_HANDLE,
+    TRACE_COMPUTE,
+    TRACE_SET_RESPONSE,
+    TRACE_SET,
+    TRACE_IN_FLIGHT,
+    TRACE_ASR_RESPONSE,
+    TRACE_NAME_COUNT
+} trace_name_t;
+
+typedef struct {
+    uint64_t tsNs;     // CLOCK_MONOTONIC. For spans, when it started.
+    uint32_t durNs;    // Spans only.
+    uint8_t  ph;       // Chrome phase: 'X' span, 'i' instant, 'b'/'e' start/end of an async span.
+    uint8_t  name;     // trace_name_t
+    uint16_t attrId;
+    uint32_t id;       // What the name's table entry says it is: event type, set seq...
+    int32_t  arg;
+    uint32_t tid;      // Thread that recorded it.
+    uint32_t seq;      // Number of the event in this slot plus one, 0 while it's being written.
+} trace_event_t;
+
+//
+// Set up the ring and the SIGUSR2 handler. The ring itself is static, so this can't fail
+// in a way that matters; without the signal there's just no way to dump it.
+//
+void trace_init(struct event_base *base);
+
+void trace_free(void);
+
+//
+// Write the ring to path, oldest first, from the calling thread. Returns the number of
+// events, or -1.
+//
+int trace_dump(const char *path);
+
+void trace_log_stats(void);
+
+#ifdef APP_TRACE_RING
+static inline uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+//
+// A span that started at startNs (from trace_now()) and ends now.
+//
+void trace_span(trace_name_t name, uint64_t startNs, uint16_t attrId, uint32_t id, int32_t arg);
+
+//
+// The same, for a span whose end time is already known.
+//
+void trace_span_at(trace_name_t name, uint64_t startNs, uint64_t endNs, uint16_t attrId,
+                   uint32_t id, int32_t arg);
+
+void trace_instant(trace_name_t name, uint16_t attrId, uint32_t id, int32_t arg);
+
+//
+// Start and end of a span that others can overlap, matched up by name and id.
+//
+void trace_async_begin(trace_name_t name, uint16_t attrId, uint32_t id, int32_t arg);
+void trace_async_end(trace_name_t name, uint16_t attrId, uint32_t id, int32_t arg);
+
+#else
+//
+// No ring: nothing to record, and the compiler drops the calls.
+//
+static inline uint64_t trace_now(void) { return 0; }
+static inline void trace_span(trace_name_t name, uint64_t startNs, uint16_t attrId, uint32_t id, int32_t arg) { }
+static inline void trace_span_at(trace_name_t name, uint64_t startNs, uint64_t endNs, uint16_t attrId,
+                                 uint32_t id, int32_t arg) { }
+static inline void trace_instant(trace_name_t name, uint16_t attrId, uint32_t id, int32_t arg) { }
+static inline void trace_async_begin(trace_name_t name, uint16_t attrId, uint32_t id, int32_t arg) { }
+static inline void trace_async_end(trace_name_t name, uint16_t attrId, uint32_t id, int32_t arg) { }
+#endif // APP_TRACE_RING
+
+#endif // TRACE_H
@@ -0,0 +1,441 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Windowed aggregates over numeric attributes. See window_agg.h.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+
+#include "af_log.h"
+#include "device-description.h"
+#include "window_agg.h"
+
+static uint64_t agg_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int agg_is_numeric(const profile_attr_t *a)
+{
+    return a != NULL && a->type >= ATTRIBUTE_TYPE_BOOLEAN && a->type <= ATTRIBUTE_TYPE_SINT64 &&
+           (a->size == 1 || a->size == 2 || a->size == 4 || a->size == 8);
+}
+
+static int64_t agg_sat_add(int64_t a, int64_t b)
+{
+    if (b > 0 && a > INT64_MAX - b) {
+        return INT64_MAX;
+    }
+    if (b < 0 && a < INT64_MIN - b) {
+        return INT64_MIN;
+    }
+    return a + b;
+}
+
+//
+// Window sums can't saturate: what is added has to come off again exactly when the
+// sample leaves. Wrapping arithmetic keeps them exact whenever the true sum fits.
+//
+static int64_t agg_wrap_add(int64_t a, int64_t b)
+{
+    return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+
+static agg_sample_t *agg_sample(agg_state_t *a, uint32_t seq)
+{
+    return &a->ring[seq & a->mask];
+}
+
+static void agg_evict(agg_state_t *a)
+{
+    a->sum = agg_wrap_add(a->sum, -agg_sample(a, a->first)->v);
+    if (a->monoFirst != a->monoNext && a->mono[a->monoFirst & a->mask] == a->first) {
+        a->monoFirst++;
+    }
+    a->first++;
+}
+
+//
+// Drop samples that have slid out of a time window. Returns how many went.
+//
+static uint32_t agg_expire(agg_state_t *a, uint64_t now)
+{
+    uint32_t n = 0;
+
+    if (a->def->window != PROFILE_WINDOW_TIME) {
+        return 0;
+    }
+    while (a->first != a->next && agg_sample(a, a->first)->tMs + a->def->span <= now) {
+        agg_evict(a);
+        n++;
+    }
+    return n;
+}
+
+static void agg_push(agg_engine_t *e, agg_state_t *a, int64_t v, uint64_t now)
+{
+    uint32_t cap = a->def->capacity;
+    agg_sample_t *s;
+
+    if (a->def->window == PROFILE_WINDOW_NONE) {
+        a->sum = agg_sat_add(a->sum, v);
+        return;
+    }
+
+    agg_expire(a, now);
+    if (a->next - a->first == cap) {
+        if (a->def->window == PROFILE_WINDOW_TIME) {
+            e->dropped++;
+        }
+        agg_evict(a);
+    }
+
+    //
+    // Keep the deque monotonic: anything the new value beats can never be the min (or
+    // max) again, since the new value outlives it.
+    //
+    if (a->def->fn == PROFILE_AGG_MIN || a->def->fn == PROFILE_AGG_MAX) {
+        while (a->monoNext != a->monoFirst) {
+            int64_t back = agg_sample(a, a->mono[(a->monoNext - 1) & a->mask])->v;
+
+            if (a->def->fn == PROFILE_AGG_MIN ? back < v : back > v) {
+                break;
+            }
+            a->monoNext--;
+        }
+        a->mono[a->monoNext & a->mask] = a->next;
+        a->monoNext++;
+    }
+
+    s = agg_sample(a, a->next);
+    s->tMs = now;
+    s->v   = v;
+    a->sum = agg_wrap_add(a->sum, v);
+    a->next++;
+}
+
+static int64_t agg_value(agg_state_t *a)
+{
+    uint32_t n = a->next - a->first;
+    int64_t span;
+
+    switch (a->def->fn) {
+        case PROFILE_AGG_TOTAL:
+        case PROFILE_AGG_SUM:
+            return a->sum;
+        case PROFILE_AGG_AVG:
+            return n ? a->sum / (int64_t)n : 0;
+        case PROFILE_AGG_MIN:
+        case PROFILE_AGG_MAX:
+            return a->monoFirst != a->monoNext ? agg_sample(a, a->mono[a->monoFirst & a->mask])->v : 0;
+        case PROFILE_AGG_COUNT:
+            return n;
+        default:
+            //
+            // Rate over the window length, or for a sample window over the time its
+            // samples cover.
+            //
+            if (a->def->window == PROFILE_WINDOW_TIME) {
+                span = a->def->span;
+            }
+            else {
+                span = n ? (int64_t)(agg_sample(a, a->next - 1)->tMs - agg_sample(a, a->first)->tMs) : 0;
+            }
+            if (span == 0) {
+                return 0;
+            }
+            return a->sum / span * 1000 + a->sum % span * 1000 / span;
+    }
+}
+
+static void agg_flush(agg_engine_t *e, agg_state_t *a, uint64_t now)
+{
+    int64_t v = agg_value(a);
+    int8_t  v8;
+    int16_t v16;
+    int32_t v32;
+    set_kind_t kind;
+    const void *out;
+
+    //
+    // Clamp to the output attribute rather than let it wrap.
+    //
+    if (a->outType == ATTRIBUTE_TYPE_BOOLEAN) {
+        v = v != 0;
+    }
+    else if (a->outSize < 8) {
+        int64_t max = ((int64_t)1 << (a->outSize * 8 - 1)) - 1;
+
+        v = v > max ? max : v < -max - 1 ? -max - 1 : v;
+    }
+
+    if (a->hasPublished && v == a->published) {
+        a->dirty = 0;
+        e->unchanged++;
+        return;
+    }
+    if (a->hasPublished && a->def->intervalMs && now < a->publishedMs + a->def->intervalMs) {
+        if (!a->dirty) {
+            e->deferred++;
+        }
+        a->dirty = 1;
+        return;
+    }
+
+    switch (a->outSize) {
+        case 1:
+            v8 = (int8_t)v;
+            kind = SET_KIND_8;
+            out = &v8;
+            break;
+        case 2:
+            v16 = (int16_t)v;
+            kind = SET_KIND_16;
+            out = &v16;
+            break;
+        case 4:
+            v32 = (int32_t)v;
+            kind = SET_KIND_32;
+            out = &v32;
+            break;
+        default:
+            kind = SET_KIND_BYTES;
+            out = &v;
+            break;
+    }
+    a->dirty = 0;
+    if (e->publish(e->ctx, a->def->outId, kind, out, a->outSize) != AF_SUCCESS) {
+        AFLOG_ERR("my-app: agg: couldn't publish attrId=%d", a->def->outId);
+        return;
+    }
+    a->hasPublished = 1;
+    a->published    = v;
+    a->publishedMs  = now;
+    e->publishes++;
+    AFLOG_INFO("my-app: agg: attrId=%d -> attrId=%d now %lld", a->def->srcId, a->def->outId, (long long)v);
+}
+
+//
+// One timer for the whole engine, set for whichever comes first: a sample leaving a time
+// window or a held-back publish coming due.
+//
+static void agg_rearm(agg_engine_t *e, uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+    uint64_t t;
+    struct timeval tv;
+    uint16_t i;
+
+    for (i = 0; i < e->count; i++) {
+        agg_state_t *a = &e->aggs[i];
+
+        if (a->def->window == PROFILE_WINDOW_TIME && a->first != a->next) {
+            t = agg_sample(a, a->first)->tMs + a->def->span;
+            if (t < next) {
+                next = t;
+            }
+        }
+        if (a->dirty) {
+            t = a->publishedMs + a->def->intervalMs;
+            if (t < next) {
+                next = t;
+            }
+        }
+    }
+    if (next == UINT64_MAX) {
+        evtimer_del(e->timer);
+        return;
+    }
+    next = next > now ? next - now : 0;
+    tv.tv_sec  = next / 1000;
+    tv.tv_usec = (next % 1000) * 1000;
+    evtimer_add(e->timer, &tv);
+}
+
+static void agg_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+    agg_engine_t *e = (agg_engine_t *)arg;
+    uint64_t now = agg_now_ms();
+    uint16_t i;
+
+    for (i = 0; i < e->count; i++) {
+        agg_state_t *a = &e->aggs[i];
+
+        if (agg_expire(a, now) > 0 || a->dirty) {
+            agg_flush(e, a, now);
+        }
+    }
+    agg_rearm(e, now);
+}
+
+int agg_engine_init(agg_engine_t *e, struct event_base *base, const profile_t *p,
+                    agg_publish_cb_t publish, void *ctx)
+{
+    const profile_attr_t *src;
+    const profile_attr_t *out;
+    uint16_t i;
+
+    memset(e, 0, sizeof(*e));
+    e->profile = p;
+    e->publish = publish;
+    e->ctx     = ctx;
+    if (p->aggCount == 0) {
+        return 0;
+    }
+
+    e->aggs        = calloc(p->aggCount, sizeof(*e->aggs));
+    e->firstBySlot = calloc(p->hdr->slotCount, sizeof(*e->firstBySlot));
+    e->timer       = evtimer_new(base, agg_timer_cb, e);
+    if (e->aggs == NULL || e->firstBySlot == NULL || e->timer == NULL) {
+        AFLOG_ERR("my-app: agg: out of memory");
+        agg_engine_free(e);
+        return -1;
+    }
+
+    for (i = 0; i < p->aggCount; i++) {
+        const profile_agg_t *def = &p->aggs[i];
+        agg_state_t *a = &e->aggs[i];
+
+        e->count = i + 1;  // So agg_engine_free() cleans up this far if we bail out.
+        src = profile_lookup(p, def->srcId);
+        out = profile_lookup(p, def->outId);
+        if (!agg_is_numeric(src) || !agg_is_numeric(out)) {
+            AFLOG_ERR("my-app: agg: aggregate %d -> %d needs two numeric attributes in the profile",
+                      def->srcId, def->outId);
+            agg_engine_free(e);
+            return -1;
+        }
+        a->def     = def;
+        a->srcSize = (uint8_t)src->size;
+        a->outSize = (uint8_t)out->size;
+        a->outType = out->type;
+        if (def->window != PROFILE_WINDOW_NONE) {
+            //
+            // Rounded up to a power of two, so the ring index stays right when the
+            // sequence numbers wrap.
+            //
+            for (a->mask = 1; a->mask < def->capacity; a->mask <<= 1) {
+            }
+            a->ring = calloc(a->mask, sizeof(*a->ring));
+            if (def->fn == PROFILE_AGG_MIN || def->fn == PROFILE_AGG_MAX) {
+                a->mono = calloc(a->mask, sizeof(*a->mono));
+            }
+            a->mask--;
+            if (a->ring == NULL || ((def->fn == PROFILE_AGG_MIN || def->fn == PROFILE_AGG_MAX) && a->mono == NULL)) {
+                AFLOG_ERR("my-app: agg: out of memory for a %u sample window", def->capacity);
+                agg_engine_free(e);
+                return -1;
+            }
+        }
+        //
+        // The profile keeps aggregates sorted by source, so one slot is enough to find
+        // all of them for an attribute.
+        //
+        if (i == 0 || p->aggs[i - 1].srcId != def->srcId) {
+            e->firstBySlot[profile_slot(p, def->srcId)] = i + 1;
+        }
+    }
+    AFLOG_INFO("my-app: agg: %d aggregates", e->count);
+    return 0;
+}
+
+void agg_engine_free(agg_engine_t *e)
+{
+    uint16_t i;
+
+    if (e->aggs) {
+        for (i = 0; i < e->count; i++) {
+            free(e->aggs[i].ring);
+            free(e->aggs[i].mono);
+        }
+        free(e->aggs);
+    }
+    free(e->firstBySlot);
+    if (e->timer) {
+        event_free(e->timer);
+    }
+    memset(e, 0, sizeof(*e));
+}
+
+int agg_engine_update(agg_engine_t *e, uint16_t attrId, const uint8_t *value, uint16_t len)
+{
+    uint16_t idx;
+    uint16_t i;
+    int64_t v;
+    int8_t  v8;
+    int16_t v16;
+    int32_t v32;
+    uint64_t now;
+
+    if (e->count == 0) {
+        return 0;
+    }
+    idx = e->firstBySlot[profile_slot(e->profile, attrId)];
+    if (idx == 0 || e->aggs[idx - 1].def->srcId != attrId) {
+        return 0;
+    }
+
+    switch (len < e->aggs[idx - 1].srcSize ? len : e->aggs[idx - 1].srcSize) {
+        case 1:
+            memcpy(&v8, value, sizeof(v8));
+            v = v8;
+            break;
+        case 2:
+            memcpy(&v16, value, sizeof(v16));
+            v = v16;
+            break;
+        case 4:
+            memcpy(&v32, value, sizeof(v32));
+            v = v32;
+            break;
+        case 8:
+            memcpy(&v, value, sizeof(v));
+            break;
+        default:
+            AFLOG_ERR("my-app: agg: attrId=%d value of %d bytes doesn't decode", attrId, len);
+            return 0;
+    }
+
+    now = agg_now_ms();
+    for (i = idx - 1; i < e->count && e->aggs[i].def->srcId == attrId; i++) {
+        agg_push(e, &e->aggs[i], v, now);
+        agg_flush(e, &e->aggs[i], now);
+        e->updates++;
+    }
+    agg_rearm(e, now);
+    return i - (idx - 1);
+}
+
+void agg_engine_forget_published(agg_engine_t *e, uint16_t attrId)
+{
+    uint16_t i;
+    int resend = 0;
+
+    for (i = 0; i < e->count; i++) {
+        agg_state_t *a = &e->aggs[i];
+
+        if (a->def->outId == attrId && a->hasPublished) {
+            //
+            // Send it again from the timer rather than from inside the failed set's
+            // callback, and no sooner than intervalMs allows.
+            //
+            a->hasPublished = 0;
+            a->dirty = 1;
+            resend = 1;
+        }
+    }
+    if (resend) {
+        agg_rearm(e, agg_now_ms());
+    }
+}
+
+void agg_engine_log_stats(const agg_engine_t *e)
+{
+    AFLOG_INFO("my-app: agg: aggregates=%d updates=%u published=%u unchanged=%u deferred=%u dropped=%u",
+               e->count, e->updates, e->publishes, e->unchanged, e->deferred, e->dropped);
+}
@@ -0,0 +1,113 @@
+/**
+   Copyright 2019 Afero, Inc.
+   Windowed aggregates over numeric attributes.
+
+   The demo used to keep AF_CURRENTSUM by hand: every AF_GETADDED value was added to a
+   global and the total sent back to the Cloud. This module does the same thing for any
+   numeric attribute, driven by the aggregates in the device profile (see profile.h and
+   profilec.py) instead of code. Each aggregate follows a source attribute and publishes
+   one of these to an output attribute:
+
+     total   running total since startup (what AF_CURRENTSUM always was)
+     sum     sum of the values in the window
+     avg     their average, rounded toward zero
+     min     the smallest
+     max     the largest
+     count   how many values are in the window
+     rate    sum per second
+
+   A window is either the last N values or the values from the last N milliseconds. Every
+   update is O(1) amortized no matter how big the window is: values live in a ring
+   buffer, the sum is kept running as values come and go, and min and max come from a
+   monotonic deque (each value is pushed and popped at most once).
+
+   Time windows shrink on their own as values get old, so the engine keeps one timer for
+   the next value to expire or the next publish that intervalMs held back. An output that
+   hasn't changed is not published again, unless the set that published it failed.
+
+   Values are decoded as signed integers of the source attribute's size, as the profile
+   types say, and results are clamped to what fits the output attribute.
+*/
+#ifndef WINDOW_AGG_H
+#define WINDOW_AGG_H
+
+#include <stdint.h>
+#include <event2/event.h>
+#include "profile.h"
+#include "set_tracker.h"
+
+//
+// How results go out. my_app.c hands in its publish(), so aggregates are tracked by the
+// set tracker like every other set. ctx is what was handed to agg_engine_init(). Returns
+// AF_SUCCESS if the set was queued.
+//
+typedef int (*agg_publish_cb_t)(void *ctx, uint16_t attrId, set_kind_t kind, const void *value, uint16_t len);
+
+typedef struct {
+    uint64_t tMs;
+    int64_t  v;
+} agg_sample_t;
+
+typedef struct {
+    const profile_agg_t *def;
+    uint8_t       srcSize;
+    uint8_t       outSize;
+    uint8_t       outType;
+    uint8_t       dirty;         // A publish is due from the timer: held back by intervalMs, or resent.
+    uint8_t       hasPublished;
+    agg_sample_t *ring;          // At least def->capacity samples, indexed by sequence number.
+    uint32_t     *mono;          // Sequence numbers of the min or max candidates, oldest first.
+    uint32_t      first;         // Sequence number of the oldest sample in the window.
+    uint32_t      next;          // Sequence number the next sample gets.
+    uint32_t      monoFirst;
+    uint32_t      monoNext;
+    uint32_t      mask;          // Size of ring and mono, less one.
+    int64_t       sum;           // Window sum, or the running total for PROFILE_AGG_TOTAL.
+    int64_t       published;     // Last value published.
+    uint64_t      publishedMs;
+} agg_state_t;
+
+typedef struct {
+    const profile_t  *profile;
+    struct event     *timer;
+    agg_publish_cb_t  publish;
+    void             *ctx;
+    agg_state_t      *aggs;        // In profile order, so sorted by source.
+    uint16_t          count;
+    uint16_t         *firstBySlot; // Perfect hash slot of a source -> its first aggregate + 1.
+    //
+    // Statistics, reported with agg_engine_log_stats().
+    //
+    uint32_t          updates;     // Source values fed to an aggregate.
+    uint32_t          publishes;
+    uint32_t          unchanged;   // Results not published because the Cloud already has them.
+    uint32_t          deferred;    // Results held back by intervalMs.
+    uint32_t          dropped;     // Samples pushed out of a full time window before they expired.
+} agg_engine_t;
+
+//
+// Set up the aggregates from the profile. Checks that every source and output is a
+// numeric attribute in the profile. Returns 0 on success, -1 on failure with the reason
+// logged. A profile without aggregates is fine; the engine then does nothing.
+//
+int agg_engine_init(agg_engine_t *e, struct event_base *base, const profile_t *p,
+                    agg_publish_cb_t publish, void *ctx);
+
+void agg_engine_free(agg_engine_t *e);
+
+//
+// Feed a value the Cloud set on an attribute. Returns how many aggregates it went
+// into, 0 if the attribute isn't the source of any.
+//
+int agg_engine_update(agg_engine_t *e, uint16_t attrId, const uint8_t *value, uint16_t len);
+
+//
+// A set of attrId didn't make it to the Cloud. Aggregates that publish to it forget what
+// they published and send their current result again from the engine's timer, without
+// waiting for the source to change.
+//
+void agg_engine_forget_published(agg_engine_t *e, uint16_t attrId);
+
+void agg_engine_log_stats(const agg_engine_t *e);
+
+#endif // WINDOW_AGG_H